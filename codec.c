@@ -0,0 +1,226 @@
+/* codec.c */
+#include "codec.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "zlib.h"
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/*
+  The PBF spec allows a Blob to hold its payload raw, or compressed with zlib, LZ4 (block format) or
+  zstd (one frame), with raw_size giving the uncompressed length in every compressed case.
+  zlib is always available. LZ4 and zstd are optional at build time (make WITH_LZ4=1 WITH_ZSTD=1),
+  so that vex still builds where those libraries are not installed.
+*/
+
+static void die(const char *msg) {
+    fprintf(stderr, "%s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+/* The names accepted by codec_parse, indexed by BlobCodec. */
+static const char *codec_names[] = { "none", "zlib", "lz4", "zstd" };
+
+/* Whether a level is one the given codec accepts. Stored payloads have no level. */
+static bool level_in_range (BlobCodec codec, long level) {
+    switch (codec) {
+    case CODEC_ZLIB:
+        return level >= Z_NO_COMPRESSION && level <= Z_BEST_COMPRESSION;
+#ifdef HAVE_LZ4
+    case CODEC_LZ4:
+        return level >= 0 && level <= LZ4HC_CLEVEL_MAX;
+#endif
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD:
+        return level >= ZSTD_minCLevel() && level <= ZSTD_maxCLevel();
+#endif
+    default:
+        return false;
+    }
+}
+
+/*
+  Parse a compression setting of the form "codec" or "codec:level", for example "zstd:9".
+  Returns false, leaving the output untouched, if the codec is unknown or not compiled into this build,
+  or if the level is not a whole number within the codec's range.
+*/
+bool codec_parse (const char *spec, BlobCompression *compression) {
+    const char *colon = strchr(spec, ':');
+    size_t name_len = colon ? colon - spec : strlen(spec);
+    for (int c = CODEC_RAW; c <= CODEC_ZSTD; c++) {
+        if (strlen(codec_names[c]) != name_len || strncmp(spec, codec_names[c], name_len) != 0) continue;
+#ifndef HAVE_LZ4
+        if (c == CODEC_LZ4) return false;
+#endif
+#ifndef HAVE_ZSTD
+        if (c == CODEC_ZSTD) return false;
+#endif
+        long level = 0;
+        if (colon != NULL) {
+            char *end;
+            errno = 0;
+            level = strtol(colon + 1, &end, 10);
+            if (end == colon + 1 || *end != '\0' || errno != 0 || !level_in_range(c, level)) return false;
+        }
+        compression->codec = c;
+        compression->has_level = (colon != NULL);
+        compression->level = level;
+        return true;
+    }
+    return false;
+}
+
+/* Inflate a zlib stream into out, returning the number of bytes produced or 0 on failure. */
+static size_t zinflate (ProtobufCBinaryData *in, uint8_t *out, size_t capacity) {
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = 0;
+    strm.next_in = Z_NULL;
+    if (inflateInit(&strm) != Z_OK)
+        die("zlib init failed");
+    /* ProtobufCBinaryData is {size_t len; uint8_t *data} */
+    strm.avail_in = in->len;
+    strm.next_in = in->data;
+    strm.avail_out = capacity;
+    strm.next_out = out;
+    int ret = inflate(&strm, Z_FINISH);
+    (void)inflateEnd(&strm);
+    if (ret != Z_STREAM_END) return 0;
+    return capacity - strm.avail_out;
+}
+
+/*
+  Decompress the payload of a Blob into buf if necessary. On return *data points to the payload,
+  which is either in buf or (for raw blobs) inside the blob itself, and its length is returned.
+  Dies if the payload is corrupt, too big for buf, or uses a codec this build does not support.
+*/
+size_t codec_decode_blob (OSMPBF__Blob *blob, uint8_t *buf, size_t capacity, uint8_t **data) {
+    if (blob->has_raw) {
+        *data = blob->raw.data;
+        return blob->raw.len;
+    }
+    if (!blob->has_raw_size || blob->raw_size < 0 || blob->raw_size > capacity)
+        die("missing or excessive uncompressed size in compressed blob");
+    size_t expected = blob->raw_size;
+    size_t size = 0;
+    *data = buf;
+    if (blob->has_zlib_data) {
+        size = zinflate(&(blob->zlib_data), buf, expected);
+    } else if (blob->has_lz4_data) {
+#ifdef HAVE_LZ4
+        int ret = LZ4_decompress_safe((char*)blob->lz4_data.data, (char*)buf, blob->lz4_data.len, expected);
+        size = ret < 0 ? 0 : ret;
+#else
+        die("input contains LZ4 compressed blobs, rebuild vex with make WITH_LZ4=1");
+#endif
+    } else if (blob->has_zstd_data) {
+#ifdef HAVE_ZSTD
+        size = ZSTD_decompress(buf, expected, blob->zstd_data.data, blob->zstd_data.len);
+        if (ZSTD_isError(size)) size = 0;
+#else
+        die("input contains zstd compressed blobs, rebuild vex with make WITH_ZSTD=1");
+#endif
+    } else {
+        die("blob uses an unsupported compression method");
+    }
+    if (size != expected)
+        die("decompressed blob size does not match expected size");
+    return size;
+}
+
+#ifdef HAVE_ZSTD
+/*
+  Each writing thread keeps one zstd context, which is much cheaper than setting one up per blob.
+  It is held under a thread-specific key so that it is freed when its thread exits.
+*/
+static pthread_key_t zstd_cctx_key;
+static pthread_once_t zstd_cctx_once = PTHREAD_ONCE_INIT;
+
+static void free_zstd_cctx (void *cctx) {
+    ZSTD_freeCCtx(cctx);
+}
+
+static void make_zstd_cctx_key () {
+    if (pthread_key_create(&zstd_cctx_key, &free_zstd_cctx) != 0)
+        die("could not create zstd compression context key");
+}
+
+/* The zstd context of the calling thread, created on first use. */
+static ZSTD_CCtx *zstd_cctx () {
+    pthread_once(&zstd_cctx_once, &make_zstd_cctx_key);
+    ZSTD_CCtx *cctx = pthread_getspecific(zstd_cctx_key);
+    if (cctx == NULL) {
+        cctx = ZSTD_createCCtx();
+        if (cctx == NULL || pthread_setspecific(zstd_cctx_key, cctx) != 0)
+            die("could not create zstd compression context");
+    }
+    return cctx;
+}
+#endif
+
+/*
+  Fill in the payload fields of a Blob, compressing the payload into buf with the given codec.
+  For CODEC_RAW the blob refers to the payload itself and buf is unused.
+*/
+void codec_encode_blob (BlobCompression *compression, uint8_t *payload, size_t payload_len,
+                        uint8_t *buf, size_t capacity, OSMPBF__Blob *blob) {
+    bool has_level = compression->has_level;
+    int level = compression->level;
+    size_t len = 0;
+    switch (compression->codec) {
+    case CODEC_RAW:
+        blob->raw.data = payload;
+        blob->raw.len = payload_len;
+        blob->has_raw = true;
+        return;
+    case CODEC_ZLIB: {
+        uLongf zlen = capacity;
+        if (compress2(buf, &zlen, payload, payload_len, has_level ? level : Z_DEFAULT_COMPRESSION) != Z_OK)
+            die("error while compressing PBF blob payload with zlib");
+        len = zlen;
+        blob->zlib_data.data = buf;
+        blob->zlib_data.len = len;
+        blob->has_zlib_data = true;
+        break;
+    }
+#ifdef HAVE_LZ4
+    case CODEC_LZ4: {
+        int ret = (has_level && level > 1)
+            ? LZ4_compress_HC((char*)payload, (char*)buf, payload_len, capacity, level)
+            : LZ4_compress_default((char*)payload, (char*)buf, payload_len, capacity);
+        if (ret <= 0)
+            die("error while compressing PBF blob payload with LZ4");
+        len = ret;
+        blob->lz4_data.data = buf;
+        blob->lz4_data.len = len;
+        blob->has_lz4_data = true;
+        break;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD: {
+        len = ZSTD_compressCCtx(zstd_cctx(), buf, capacity, payload, payload_len, has_level ? level : 3);
+        if (ZSTD_isError(len))
+            die("error while compressing PBF blob payload with zstd");
+        blob->zstd_data.data = buf;
+        blob->zstd_data.len = len;
+        blob->has_zstd_data = true;
+        break;
+    }
+#endif
+    default:
+        die("compression codec not available in this build");
+    }
+    blob->raw_size = payload_len; // spec: "Only set when compressed, to the uncompressed size"
+    blob->has_raw_size = true;
+}
@@ -0,0 +1,32 @@
+/* codec.h : compression codecs for the payloads of PBF blobs. */
+#ifndef CODEC_H_INCLUDED
+#define CODEC_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "fileformat.pb-c.h"
+
+/* The ways a Blob can carry its payload. LZ4 and zstd are only available when vex is built with them. */
+typedef enum {
+    CODEC_RAW,
+    CODEC_ZLIB,
+    CODEC_LZ4,
+    CODEC_ZSTD
+} BlobCodec;
+
+/* A codec and its compression level. Without has_level the codec's default level is used. */
+typedef struct {
+    BlobCodec codec;
+    bool has_level;
+    int level;
+} BlobCompression;
+
+bool codec_parse (const char *spec, /*OUT*/ BlobCompression *compression);
+
+size_t codec_decode_blob (OSMPBF__Blob *blob, uint8_t *buf, size_t capacity, /*OUT*/ uint8_t **data);
+
+void codec_encode_blob (BlobCompression *compression, uint8_t *payload, size_t payload_len,
+                        uint8_t *buf, size_t capacity, /*OUT*/ OSMPBF__Blob *blob);
+
+#endif /* CODEC_H_INCLUDED */
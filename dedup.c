@@ -15,29 +15,32 @@ struct entry {
 };
 
 #define SIZE 9973 // prime
-static Entry entries[SIZE];
-static uint32_t n;
-static ProtobufCBinaryData *inverse = NULL; /* Inverse mapping, from ints to strings. */
-OSMPBF__StringTable string_table;
+
+struct Dedup {
+    Entry entries[SIZE];
+    uint32_t n;
+    ProtobufCBinaryData *inverse; /* Inverse mapping, from ints to strings. */
+    OSMPBF__StringTable string_table;
+};
 
 /* Copy string pointers over to a dynamically allocated array of ProtobufBinaryData. */
-OSMPBF__StringTable *Dedup_string_table () {
-    osmpbf__string_table__init(&string_table);
-    if (inverse != NULL) free (inverse);
-    inverse = malloc(n * sizeof(ProtobufCBinaryData));
-    if (inverse == NULL) exit (-1);
+OSMPBF__StringTable *Dedup_string_table (Dedup *dedup) {
+    osmpbf__string_table__init(&(dedup->string_table));
+    if (dedup->inverse != NULL) free (dedup->inverse);
+    dedup->inverse = malloc(dedup->n * sizeof(ProtobufCBinaryData));
+    if (dedup->inverse == NULL) exit (-1);
     for (int ei = 0; ei < SIZE; ++ei) {
-        Entry *e = &(entries[ei]);
+        Entry *e = &(dedup->entries[ei]);
         if (e->key != NULL) {
             for (; e != NULL; e = e->next) {
-                inverse[e->val].data = (uint8_t*) e->key;
-                inverse[e->val].len = strlen(e->key);
+                dedup->inverse[e->val].data = (uint8_t*) e->key;
+                dedup->inverse[e->val].len = strlen(e->key);
             }
         }
     }
-    string_table.n_s = n;
-    string_table.s = inverse;
-    return &string_table; // return pointer to static var
+    dedup->string_table.n_s = dedup->n;
+    dedup->string_table.s = dedup->inverse;
+    return &(dedup->string_table); // the table belongs to the Dedup, and is valid until it is cleared
 }
 
 static void free_list(Entry *e) {
@@ -48,31 +51,34 @@ static void free_list(Entry *e) {
     }
 }
 
-void Dedup_clear() {
+void Dedup_clear (Dedup *dedup) {
     for (int i = 0; i < SIZE; ++i) {
-        if (entries[i].next != NULL) free_list (entries[i].next);
-        entries[i].key = NULL;
-        entries[i].next = NULL;
+        if (dedup->entries[i].next != NULL) free_list (dedup->entries[i].next);
+        dedup->entries[i].key = NULL;
+        dedup->entries[i].next = NULL;
     }
-    if (inverse != NULL) {
-        free (inverse);
-        inverse = NULL;
+    if (dedup->inverse != NULL) {
+        free (dedup->inverse);
+        dedup->inverse = NULL;
     }
-    n = 0;
+    dedup->n = 0;
 }
 
-void Dedup_init() {
-    for (int i = 0; i < SIZE; ++i) {
-        entries[i].key = NULL;
-        entries[i].next = NULL;
-    }
-    inverse = NULL;
-    n = 0;
+/* A new, empty string table. Allocated zeroed, so every hash bucket starts out empty. */
+Dedup *Dedup_new () {
+    Dedup *dedup = calloc (1, sizeof(Dedup));
+    if (dedup == NULL) exit (-1);
+    return dedup;
+}
+
+void Dedup_free (Dedup *dedup) {
+    Dedup_clear (dedup);
+    free (dedup);
 }
 
-void Dedup_print() {
+void Dedup_print (Dedup *dedup) {
     for (int i = 0; i < SIZE; ++i) {
-        Entry *e = &(entries[i]);
+        Entry *e = &(dedup->entries[i]);
         if (e->key != NULL) {
             fprintf (stderr, "[%02d] ", i);
             for (; e != NULL; e = e->next) {
@@ -94,9 +100,9 @@ static uint32_t hash(char *s) {
 }
 
 /* Add a string to the map. Return the existing mapping if it is already present. */
-uint32_t Dedup_dedup (char *key) {
+uint32_t Dedup_dedup (Dedup *dedup, char *key) {
     uint32_t hc = hash(key) % SIZE;
-    Entry *e = &(entries[hc]);
+    Entry *e = &(dedup->entries[hc]);
     if (e->key != NULL) {
         while (true) {
             if (strcmp(e->key, key) == 0) return e->val; // key already in set
@@ -107,26 +113,26 @@ uint32_t Dedup_dedup (char *key) {
         e = e->next;
     }
     e->key = key;
-    e->val = n;
+    e->val = dedup->n;
     e->next = NULL;
-    n += 1;
+    dedup->n += 1;
     return e->val;
 }
 
 int test() {
-    Dedup_init();
-    Dedup_dedup("fifteen cans of soup");
-    Dedup_dedup("the color of the sky");
-    Dedup_dedup("tomorrow, it rains");
-    Dedup_dedup("              ...espace");
-    for (int i = 0; i < 100; ++i) Dedup_dedup("hello");
-    fprintf(stderr, "n = %d\n", n);
-    fprintf(stderr, "index of hello is %d\n", Dedup_dedup("hello"));
-    Dedup_print();
-    Dedup_clear();
-    for (int i = 0; i < 100; ++i) Dedup_dedup("hello");
-    fprintf(stderr, "n = %d\n", n);
-    fprintf(stderr, "index of hello is %d\n", Dedup_dedup("hello"));
-    Dedup_clear();
+    Dedup *dedup = Dedup_new();
+    Dedup_dedup(dedup, "fifteen cans of soup");
+    Dedup_dedup(dedup, "the color of the sky");
+    Dedup_dedup(dedup, "tomorrow, it rains");
+    Dedup_dedup(dedup, "              ...espace");
+    for (int i = 0; i < 100; ++i) Dedup_dedup(dedup, "hello");
+    fprintf(stderr, "n = %d\n", dedup->n);
+    fprintf(stderr, "index of hello is %d\n", Dedup_dedup(dedup, "hello"));
+    Dedup_print(dedup);
+    Dedup_clear(dedup);
+    for (int i = 0; i < 100; ++i) Dedup_dedup(dedup, "hello");
+    fprintf(stderr, "n = %d\n", dedup->n);
+    fprintf(stderr, "index of hello is %d\n", Dedup_dedup(dedup, "hello"));
+    Dedup_free(dedup);
     return 0;
 }
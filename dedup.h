@@ -4,9 +4,13 @@
 #include "fileformat.pb-c.h"
 #include "osmformat.pb-c.h"
 
-void Dedup_clear();
-void Dedup_init();
-void Dedup_print();
-uint32_t Dedup_dedup (char *key);
-OSMPBF__StringTable *Dedup_string_table ();
+/* A string table under construction. Each PBF writer has its own, so several can be built at once. */
+typedef struct Dedup Dedup;
+
+Dedup *Dedup_new ();
+void Dedup_free (Dedup *dedup);
+void Dedup_clear (Dedup *dedup);
+void Dedup_print (Dedup *dedup);
+uint32_t Dedup_dedup (Dedup *dedup, char *key);
+OSMPBF__StringTable *Dedup_string_table (Dedup *dedup);
 
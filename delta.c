@@ -0,0 +1,341 @@
+/* delta.c */
+#include "delta.h"
+#include "intpack.h"
+#include <stdbool.h>
+#include <pthread.h>
+
+/*
+  PBF stores node IDs, coordinates and way refs as zigzag varints, each the difference from the one
+  before, and the node_refs file stores the node list of each way the same way. Decoding them one at
+  a time interleaves a data-dependent branch per byte with a serial running sum. Here a whole list is
+  decoded at once, summing runs of varints inside SIMD registers. SSE4.1 and AVX2 versions are chosen
+  at runtime, with plain C used elsewhere and as the fallback.
+
+  The varint pass only vectorizes runs of single-byte varints. That is the common case for way refs,
+  which are dominated by deltas within +/-63, and it is only used for those. Dense node columns keep
+  the reader's interleaved loop: decoding the ID, latitude and longitude of each node together
+  overlaps three independent running sums, and splitting the IDs out into a column of their own
+  measured no faster (see the benchmark below). Coordinate deltas are mostly two-byte varints, which
+  would all take the scalar path anyway.
+*/
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DELTA_X86
+#include <immintrin.h>
+#endif
+
+/* Scalar decode and running sum of n packed zigzag varints, the fallback for every other path. */
+static uint8_t *unpack_sum_scalar (uint8_t *in, size_t n, int64_t *out, int64_t sum) {
+    while (n-- > 0) *(out++) = (sum += svarint_read(&in));
+    return in;
+}
+
+#ifdef DELTA_X86
+
+/* Zigzag decode two int64 lanes: (v >> 1) ^ -(v & 1) */
+__attribute__((target("sse4.1")))
+static inline __m128i unzigzag_sse (__m128i v) {
+    __m128i sign = _mm_sub_epi64(_mm_setzero_si128(), _mm_and_si128(v, _mm_set1_epi64x(1)));
+    return _mm_xor_si128(_mm_srli_epi64(v, 1), sign);
+}
+
+/* Prefix sum of two lanes plus a carried total: [a b] + [0 a] + [c c] */
+__attribute__((target("sse4.1")))
+static inline __m128i prefix2_sse (__m128i x, __m128i carry) {
+    x = _mm_add_epi64(x, _mm_slli_si128(x, 8));
+    return _mm_add_epi64(x, carry);
+}
+
+/*
+  Decode and sum in one pass. While the next 16 bytes are all complete varints, widen them 2 at a
+  time. Otherwise decode varints one by one until past the last multi-byte varint in those 16 bytes,
+  so that the check is made at most once per 16 bytes of input. With at least 16 varints left there
+  are at least 16 bytes left, so the loads never run past the end of the list.
+*/
+__attribute__((target("sse4.1")))
+static uint8_t *unpack_sum_sse41 (uint8_t *in, size_t n, int64_t *out, int64_t sum) {
+    while (n >= 16) {
+        __m128i bytes = _mm_loadu_si128((__m128i*)in);
+        int mask = _mm_movemask_epi8(bytes);
+        if (mask == 0) {
+            __m128i carry = _mm_set1_epi64x(sum);
+            for (int k = 0; k < 8; k++) {
+                /* _mm_cvtepu8_epi64 only reads the low 2 bytes, so shift each pair down in turn. */
+                __m128i x = unzigzag_sse(_mm_cvtepu8_epi64(bytes));
+                carry = prefix2_sse(x, carry);
+                _mm_storeu_si128((__m128i*)out, carry);
+                carry = _mm_unpackhi_epi64(carry, carry);
+                bytes = _mm_srli_si128(bytes, 2);
+                out += 2;
+            }
+            sum = _mm_cvtsi128_si64(carry);
+            in += 16;
+            n -= 16;
+        } else {
+            /* At most 16 varints start before past, so this cannot decode more than are left. */
+            uint8_t *past = in + (32 - __builtin_clz(mask));
+            for (; in < past; n--) *(out++) = (sum += svarint_read(&in));
+        }
+    }
+    return unpack_sum_scalar(in, n, out, sum);
+}
+
+/* Zigzag decode four int64 lanes. */
+__attribute__((target("avx2")))
+static inline __m256i unzigzag_avx2 (__m256i v) {
+    __m256i sign = _mm256_sub_epi64(_mm256_setzero_si256(), _mm256_and_si256(v, _mm256_set1_epi64x(1)));
+    return _mm256_xor_si256(_mm256_srli_epi64(v, 1), sign);
+}
+
+/* Prefix sum of four lanes plus a carried total, in two shift-and-add steps across the register. */
+__attribute__((target("avx2")))
+static inline __m256i prefix4_avx2 (__m256i x, __m256i carry) {
+    __m256i zero = _mm256_setzero_si256();
+    // [a b c d] + [0 a b c]
+    x = _mm256_add_epi64(x, _mm256_blend_epi32(_mm256_permute4x64_epi64(x, _MM_SHUFFLE(2,1,0,0)), zero, 0x03));
+    // [a ab bc cd] + [0 0 a ab]
+    x = _mm256_add_epi64(x, _mm256_blend_epi32(_mm256_permute4x64_epi64(x, _MM_SHUFFLE(1,0,0,0)), zero, 0x0F));
+    return _mm256_add_epi64(x, carry);
+}
+
+/* As unpack_sum_sse41, widening and summing 4 varints at a time. */
+__attribute__((target("avx2")))
+static uint8_t *unpack_sum_avx2 (uint8_t *in, size_t n, int64_t *out, int64_t sum) {
+    while (n >= 16) {
+        __m128i bytes = _mm_loadu_si128((__m128i*)in);
+        int mask = _mm_movemask_epi8(bytes);
+        if (mask == 0) {
+            __m256i carry = _mm256_set1_epi64x(sum);
+            for (int k = 0; k < 4; k++) {
+                __m256i x = unzigzag_avx2(_mm256_cvtepu8_epi64(bytes));
+                carry = prefix4_avx2(x, carry);
+                _mm256_storeu_si256((__m256i*)out, carry);
+                carry = _mm256_permute4x64_epi64(carry, _MM_SHUFFLE(3,3,3,3));
+                bytes = _mm_srli_si128(bytes, 4);
+                out += 4;
+            }
+            sum = _mm_cvtsi128_si64(_mm256_castsi256_si128(carry));
+            in += 16;
+            n -= 16;
+        } else {
+            uint8_t *past = in + (32 - __builtin_clz(mask));
+            for (; in < past; n--) *(out++) = (sum += svarint_read(&in));
+        }
+    }
+    return unpack_sum_scalar(in, n, out, sum);
+}
+
+#endif /* DELTA_X86 */
+
+/* Kernel selection, performed once on first use by whichever thread gets there first. */
+static uint8_t *(*unpack_kernel) (uint8_t *in, size_t n, int64_t *out, int64_t sum);
+static pthread_once_t kernels_chosen = PTHREAD_ONCE_INIT;
+
+static void choose_kernels () {
+    unpack_kernel = &unpack_sum_scalar;
+#ifdef DELTA_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1")) {
+        unpack_kernel = &unpack_sum_sse41;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        unpack_kernel = &unpack_sum_avx2;
+    }
+#endif
+}
+
+/*
+  Decode n packed, delta-coded zigzag varints (sint64) starting at in into out, undoing the delta
+  coding by adding each one to the running sum that starts at base. Returns the address just past
+  the last varint decoded. The input must really hold n complete varints.
+*/
+uint8_t *delta_unpack_sint64 (uint8_t *in, size_t n, int64_t *out, int64_t base) {
+    pthread_once(&kernels_chosen, &choose_kernels);
+    return (*unpack_kernel)(in, n, out, base);
+}
+
+/*
+  Replace n delta-coded values with their running sum starting from base. Returns the final sum.
+  This is for columns protobuf-c has already unpacked. Once the values are in memory a plain loop is
+  bound by the dependency between additions, and the SIMD versions measured slower, so there are none.
+*/
+int64_t delta_decode (int64_t *values, size_t n, int64_t base) {
+    for (size_t i = 0; i < n; i++) values[i] = (base += values[i]);
+    return base;
+}
+
+
+#ifdef DELTA_BENCHMARK
+/*
+  Microbenchmark comparing these kernels with the one-value-at-a-time loops they replace, first on
+  single columns, then on whole DenseNodes groups against the reader's loop that decodes the ID,
+  latitude and longitude of each node together.
+  Build and run with: make delta-bench && ./delta-bench
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_N 8000
+#define BENCH_REPEAT 20000
+
+static double now () {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* Pack n delta-coded values the way a PBF writer would. */
+static size_t pack_column (int64_t *absolute, size_t n, uint8_t *out) {
+    size_t len = 0;
+    int64_t prev = 0;
+    for (size_t i = 0; i < n; i++) {
+        len += sint64_pack(absolute[i] - prev, out + len);
+        prev = absolute[i];
+    }
+    return len;
+}
+
+/* The loop used before these kernels: one varint read and one addition per value. */
+static int64_t streaming_loop (uint8_t *in, size_t n, int64_t *out) {
+    int64_t sum = 0;
+    for (size_t i = 0; i < n; i++) out[i] = (sum += svarint_read(&in));
+    return sum;
+}
+
+static void bench (const char *name, uint8_t *packed, size_t len, int64_t *expected, int64_t *out) {
+    double t_stream = 1e9, t_kernels = 1e9;
+    for (int r = 0; r < BENCH_REPEAT; r++) {
+        double t0 = now();
+        streaming_loop(packed, BENCH_N, out);
+        double t1 = now();
+        delta_unpack_sint64(packed, BENCH_N, out, 0);
+        double t2 = now();
+        if (t1 - t0 < t_stream) t_stream = t1 - t0;
+        if (t2 - t1 < t_kernels) t_kernels = t2 - t1;
+    }
+    for (size_t i = 0; i < BENCH_N; i++) {
+        if (out[i] != expected[i]) {
+            fprintf(stderr, "%s: mismatch at %zu\n", name, i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    printf("%-12s %5.2f bytes/value  streaming %6.1f Mvalues/s  kernels %6.1f Mvalues/s  (%.2fx)\n", 
+        name, (double)len / BENCH_N, BENCH_N / t_stream / 1e6, BENCH_N / t_kernels / 1e6, t_stream / t_kernels);
+}
+
+/*
+  Time node lists the length of real ways, decoded one way at a time as way_node_refs does: lists
+  shorter than one 16-byte SIMD step stay with the inline loop, the rest go to the kernels.
+*/
+static void bench_ways (const char *name, int max_refs) {
+    size_t n_ways = BENCH_N / 8, n_total = 0, len = 0;
+    size_t *offsets = malloc(n_ways * sizeof(size_t));
+    size_t *counts = malloc(n_ways * sizeof(size_t));
+    uint8_t *packed = malloc(n_ways * max_refs * 10);
+    int64_t *values = malloc(max_refs * sizeof(int64_t));
+    int64_t *out = malloc(max_refs * sizeof(int64_t));
+    for (size_t w = 0; w < n_ways; w++) {
+        int64_t v = 5000000000;
+        counts[w] = 2 + rand() % (max_refs - 1);
+        for (size_t i = 0; i < counts[w]; i++) values[i] = v += (rand() % 100) - 40;
+        offsets[w] = len;
+        len += pack_column(values, counts[w], packed + len);
+        n_total += counts[w];
+    }
+    double t_stream = 1e9, t_kernels = 1e9;
+    for (int r = 0; r < BENCH_REPEAT / 8; r++) {
+        double t0 = now();
+        for (size_t w = 0; w < n_ways; w++) streaming_loop(packed + offsets[w], counts[w], out);
+        double t1 = now();
+        for (size_t w = 0; w < n_ways; w++) {
+            if (counts[w] < 16) streaming_loop(packed + offsets[w], counts[w], out);
+            else delta_unpack_sint64(packed + offsets[w], counts[w], out, 0);
+        }
+        double t2 = now();
+        if (t1 - t0 < t_stream) t_stream = t1 - t0;
+        if (t2 - t1 < t_kernels) t_kernels = t2 - t1;
+    }
+    printf("%-12s %5.2f refs/way    streaming %6.1f Mvalues/s  kernels %6.1f Mvalues/s  (%.2fx)\n",
+        name, (double)n_total / n_ways, n_total / t_stream / 1e6, n_total / t_kernels / 1e6, t_stream / t_kernels);
+}
+
+/* The DenseNodes loop in the reader: ID, latitude and longitude of each node decoded in turn. */
+static void interleaved_loop (uint8_t *id, uint8_t *lat, uint8_t *lon, int64_t *ids, int64_t *lats, int64_t *lons) {
+    int64_t id_sum = 0, lat_sum = 0, lon_sum = 0;
+    for (size_t i = 0; i < BENCH_N; i++) {
+        ids[i]  = (id_sum  += svarint_read(&id));
+        lats[i] = (lat_sum += svarint_read(&lat));
+        lons[i] = (lon_sum += svarint_read(&lon));
+    }
+}
+
+/* Time the interleaved loop against the column kernel run over each of the three columns. */
+static void bench_dense (int64_t **expected) {
+    uint8_t *packed[3];
+    size_t len = 0;
+    int64_t *out[3];
+    for (int c = 0; c < 3; c++) {
+        packed[c] = malloc(BENCH_N * 10);
+        out[c] = malloc(BENCH_N * sizeof(int64_t));
+        len += pack_column(expected[c], BENCH_N, packed[c]);
+    }
+    double t_stream = 1e9, t_kernels = 1e9;
+    for (int r = 0; r < BENCH_REPEAT; r++) {
+        double t0 = now();
+        interleaved_loop(packed[0], packed[1], packed[2], out[0], out[1], out[2]);
+        double t1 = now();
+        for (int c = 0; c < 3; c++) delta_unpack_sint64(packed[c], BENCH_N, out[c], 0);
+        double t2 = now();
+        if (t1 - t0 < t_stream) t_stream = t1 - t0;
+        if (t2 - t1 < t_kernels) t_kernels = t2 - t1;
+    }
+    for (int c = 0; c < 3; c++) {
+        if (memcmp(out[c], expected[c], BENCH_N * sizeof(int64_t)) != 0) {
+            fprintf(stderr, "dense nodes: mismatch in column %d\n", c);
+            exit(EXIT_FAILURE);
+        }
+    }
+    printf("%-12s %5.2f bytes/node   interleaved %6.1f Mnodes/s  kernels %6.1f Mnodes/s  (%.2fx)\n",
+        "dense nodes", (double)len / BENCH_N, BENCH_N / t_stream / 1e6, BENCH_N / t_kernels / 1e6,
+        t_stream / t_kernels);
+}
+
+int main () {
+    choose_kernels();
+    printf("kernels: %s\n", unpack_kernel == &unpack_sum_scalar ? "scalar" : 
+#ifdef DELTA_X86
+        unpack_kernel == &unpack_sum_avx2 ? "avx2" : "sse4.1"
+#else
+        "?"
+#endif
+    );
+    int64_t *values = malloc(BENCH_N * sizeof(int64_t));
+    int64_t *out = malloc(BENCH_N * sizeof(int64_t));
+    uint8_t *packed = malloc(BENCH_N * 10);
+    srand(42);
+    /* Node IDs: mostly consecutive, with the occasional gap left by deletions. */
+    int64_t *ids = malloc(BENCH_N * sizeof(int64_t));
+    int64_t v = 5000000000;
+    for (size_t i = 0; i < BENCH_N; i++) ids[i] = v += (rand() % 10 == 0) ? 1 + rand() % 40 : 1;
+    bench("node ids", packed, pack_column(ids, BENCH_N, packed), ids, out);
+    /* Way refs: short local jumps between nearby node IDs. */
+    v = 5000000000;
+    for (size_t i = 0; i < BENCH_N; i++) values[i] = v += (rand() % 100) - 40;
+    bench("way refs", packed, pack_column(values, BENCH_N, packed), values, out);
+    /* Coordinates in units of 100 nanodegrees: deltas of a few meters between successive nodes. */
+    int64_t *lats = malloc(BENCH_N * sizeof(int64_t));
+    int64_t *lons = malloc(BENCH_N * sizeof(int64_t));
+    v = 450000000;
+    for (size_t i = 0; i < BENCH_N; i++) lats[i] = v += (rand() % 4000) - 2000;
+    v = 90000000;
+    for (size_t i = 0; i < BENCH_N; i++) lons[i] = v += (rand() % 4000) - 2000;
+    bench("coordinates", packed, pack_column(lats, BENCH_N, packed), lats, out);
+    bench_ways("short ways", 12);
+    bench_ways("long ways", 120);
+    int64_t *columns[3] = {ids, lats, lons};
+    bench_dense(columns);
+    return EXIT_SUCCESS;
+}
+#endif /* DELTA_BENCHMARK */
@@ -0,0 +1,13 @@
+/* delta.h : bulk varint decoding and prefix sums for delta-coded PBF columns. */
+#ifndef DELTA_H_INCLUDED
+#define DELTA_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+uint8_t *delta_unpack_sint64 (uint8_t *in, size_t n, int64_t *out, int64_t base);
+
+int64_t delta_decode (int64_t *values, size_t n, int64_t base);
+
+
+#endif /* DELTA_H_INCLUDED */
@@ -0,0 +1,425 @@
+/* grid.c */
+#include "grid.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+  The spatial index grid. A node's grid bin is determined by right-shifting its coordinates by an
+  amount chosen when the database is created. Most of the grid is empty due to ocean and wilderness,
+  so cells are only allocated a square tile of them at a time, the first time something is indexed
+  in the tile. A dense directory gives the index of each tile, or zero for tiles not allocated, so
+  the empty parts of the world cost four bytes per tile rather than eight bytes per cell. This allows
+  finer cells where the data is dense, and is cheap to look up since the directory is small.
+  TODO eliminate coastlines etc.
+
+  Ways may be indexed from several threads at once, without locks. New way blocks are allocated by
+  atomically bumping way_block_count. A block is pushed onto the head of a cell's chain with a 
+  compare-and-swap on the cell's head index, and a slot in the head block is claimed with a
+  compare-and-swap on the block's last ref, which counts its free slots while any remain.
+  Nothing is removed from a chain during a load, so a head index only ever changes to a block
+  that points at the previous head, and an index cannot come back to confuse a compare-and-swap.
+  Tiles are allocated in the same way as blocks, and linked into the directory with a
+  compare-and-swap on its entry.
+*/
+
+static void die(const char *msg) {
+    fprintf(stderr, "%s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+uint32_t  grid_bits = DEFAULT_GRID_BITS;
+uint32_t  grid_max_tiles;
+uint32_t  grid_max_way_blocks;
+uint32_t *grid_tiles;
+GridCell *grid_cells;
+WayBlock *way_blocks;
+GridRange *grid_ranges;
+int32_t   *grid_way_ids;
+uint32_t  *grid_relation_ids;
+uint32_t   grid_way_ids_end = 0;
+uint32_t   grid_way_ids_waste = 0;
+uint32_t   grid_relation_ids_end = 0;
+uint32_t   grid_relation_ids_waste = 0;
+
+/*
+  The number of way reference blocks currently allocated.
+  Sparse files appear to be full of zeros until you write to them. Therefore we skip way block zero
+  so we can use the zero index to mean "no way block".
+*/
+uint32_t way_block_count = 1;
+
+/* The number of grid tiles allocated. Tile zero is skipped in the same way, to mean "no tile". */
+uint32_t grid_tile_count = 1;
+
+/*
+  Set the size of the grid, and from it how many tiles and way reference blocks its files are mapped
+  for. The files are sparse, so room for every tile of the grid costs nothing until it is used.
+  The observed number of way blocks was ~15000000 with the default grid when ways were only indexed in
+  the cell of their first node. Indexing them in every cell they touch takes more, and so does a finer
+  grid, whose cells each hold fewer ways in partly filled blocks. A coarser grid fills its blocks
+  better but still needs as many for all the way references, so it keeps the default's limit.
+*/
+void grid_set_bits (uint32_t bits) {
+    grid_bits = bits;
+    uint32_t tiles_per_side = 1 << (bits - TILE_BITS);
+    grid_max_tiles = tiles_per_side * tiles_per_side + 1; // tile zero is never used
+    uint32_t block_bits = (bits > DEFAULT_GRID_BITS) ? bits : DEFAULT_GRID_BITS;
+    grid_max_way_blocks = (uint32_t)(((uint64_t)1 << (2 * block_bits)) / 3);
+}
+
+/* Reserve the index of a new way block. Its contents are set up by the caller before it is linked in. */
+static uint32_t new_way_block () {
+    uint32_t index = __atomic_fetch_add(&way_block_count, 1, __ATOMIC_RELAXED);
+    if (index % 100000 == 0)
+        fprintf(stderr, "%dk way blocks in use out of %dk.\n", index/1000, grid_max_way_blocks/1000);
+    if (index >= grid_max_way_blocks)
+        die("More way reference blocks are used than expected.");
+    return index;
+}
+
+/* Reserve and clear the index of a new tile. It is linked into the directory by the caller. */
+static uint32_t new_tile () {
+    uint32_t tile = __atomic_fetch_add(&grid_tile_count, 1, __ATOMIC_RELAXED);
+    if (tile >= grid_max_tiles)
+        die("More grid tiles are used than expected.");
+    /* A tile may be reused after a resumed load has rolled back, so it is not necessarily empty. */
+    memset(&(grid_cells[(size_t)tile * TILE_CELLS]), 0, TILE_CELLS * sizeof(GridCell));
+    return tile;
+}
+
+/* Get the x or y bin for the given x or y coordinate. */
+uint32_t grid_bin (int32_t xy) {
+    return ((uint32_t)(xy)) >> (32 - grid_bits); // unsigned: logical shift
+}
+
+/* The directory entry of the tile containing the given bins. */
+static uint32_t *tile_entry (uint32_t xbin, uint32_t ybin) {
+    uint32_t tiles_per_row = 1 << (grid_bits - TILE_BITS);
+    return &(grid_tiles[(xbin >> TILE_BITS) * tiles_per_row + (ybin >> TILE_BITS)]);
+}
+
+/* The address of the cell with the given bins, within the given tile. */
+static GridCell *cell_in_tile (uint32_t tile, uint32_t xbin, uint32_t ybin) {
+    uint32_t mask = (1 << TILE_BITS) - 1;
+    return &(grid_cells[(size_t)tile * TILE_CELLS + ((xbin & mask) << TILE_BITS) + (ybin & mask)]);
+}
+
+/*
+  Get the address of the grid cell for the given internal coordinates, allocating its tile if it
+  has none yet. Safe to call from several threads at once, including for the same tile.
+*/
+GridCell *grid_cell (int32_t x, int32_t y) {
+    /* A tile that lost the race to be allocated, kept for the next time one is needed. */
+    static __thread uint32_t spare_tile = 0;
+    uint32_t xbin = grid_bin(x), ybin = grid_bin(y);
+    uint32_t *entry = tile_entry(xbin, ybin);
+    uint32_t tile = __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+    if (tile == 0) {
+        uint32_t fresh = spare_tile ? spare_tile : new_tile();
+        spare_tile = 0;
+        if (__atomic_compare_exchange_n(entry, &tile, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            tile = fresh;
+        } else {
+            spare_tile = fresh; // another thread got there first, and tile now holds its tile
+        }
+    }
+    return cell_in_tile(tile, xbin, ybin);
+}
+
+/* Get the grid cell with the given bins, or NULL if nothing was ever indexed in its tile. */
+GridCell *grid_cell_find (uint32_t xbin, uint32_t ybin) {
+    uint32_t tile = *tile_entry(xbin, ybin);
+    return (tile == 0) ? NULL : cell_in_tile(tile, xbin, ybin);
+}
+
+/*
+  Get a number identifying the given grid cell, for storing in place of a pointer. Every cell of
+  every allocated tile has a number below grid_tile_count * TILE_CELLS.
+*/
+uint32_t grid_cell_index (GridCell *cell) {
+    return cell - grid_cells;
+}
+
+/* Get the grid cell identified by a number from grid_cell_index. */
+GridCell *grid_cell_at (uint32_t index) {
+    return grid_cells + index;
+}
+
+/*
+  Forget the tiles allocated after the first n_tiles, returning the directory and the tile count to
+  an earlier state. Not safe to call while ways are being added.
+*/
+void grid_truncate_tiles (uint32_t n_tiles) {
+    uint32_t tiles_per_row = 1 << (grid_bits - TILE_BITS);
+    for (uint32_t t = 0; t < tiles_per_row * tiles_per_row; t++) {
+        if (grid_tiles[t] >= n_tiles) grid_tiles[t] = 0;
+    }
+    grid_tile_count = n_tiles;
+}
+
+/*
+  Record that the given way begins in the given grid cell, claiming a free slot in the cell's head
+  way block or first pushing a new empty block onto the head of the chain if there is none.
+  Safe to call from several threads at once, including for the same cell.
+*/
+void grid_add_way (GridCell *cell, int32_t way_id) {
+    /* A block that lost the race to become some cell's head, kept for the next time one is needed. */
+    static __thread uint32_t spare_block = 0;
+    while (true) {
+        uint32_t head = __atomic_load_n(&(cell->head_way_block), __ATOMIC_ACQUIRE);
+        if (head != 0) {
+            WayBlock *wb = &(way_blocks[head]);
+            int32_t *last = &(wb->refs[WAY_BLOCK_SIZE - 1]);
+            /* A final ref < 0 gives the number of free slots in this block. */
+            int32_t nfree = __atomic_load_n(last, __ATOMIC_RELAXED);
+            while (nfree < 0) {
+                /* The last free slot holds the count itself, so claiming it stores the way ID there. */
+                int32_t claimed = (nfree == -1) ? way_id : nfree + 1;
+                if (__atomic_compare_exchange_n(last, &nfree, claimed, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                    if (nfree != -1) __atomic_store_n(&(wb->refs[WAY_BLOCK_SIZE + nfree]), way_id, __ATOMIC_RELAXED);
+                    return;
+                }
+            }
+        }
+        /* The cell is empty or its head block is full. Insert a new empty block at the head of the list 
+           to avoid later scanning though large swaths of memory. */
+        uint32_t block = spare_block ? spare_block : new_way_block();
+        spare_block = 0;
+        way_blocks[block].refs[WAY_BLOCK_SIZE - 1] = -WAY_BLOCK_SIZE;
+        way_blocks[block].next = head;
+        if (!__atomic_compare_exchange_n(&(cell->head_way_block), &head, block, false, 
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            spare_block = block; // another thread got there first, so try its block
+        }
+    }
+}
+
+/*
+  Remove a way from the chain of the given grid cell, returning false if it was not there. The way 
+  added most recently takes over its slot, so that only the head block ever has free slots, and a
+  head block left empty is dropped from the chain. Not safe to call while ways are being added.
+*/
+bool grid_remove_way (GridCell *cell, int32_t way_id) {
+    uint32_t head = cell->head_way_block;
+    for (uint32_t b = head; b != 0; b = way_blocks[b].next) {
+        WayBlock *wb = &(way_blocks[b]);
+        for (int w = 0; w < WAY_BLOCK_SIZE; w++) {
+            /* Empty slots in the way block will be either negative or zero. */
+            if (wb->refs[w] <= 0) break;
+            if (wb->refs[w] != way_id) continue;
+            WayBlock *hb = &(way_blocks[head]);
+            int32_t nfree = hb->refs[WAY_BLOCK_SIZE - 1];
+            int last = (nfree >= 0) ? WAY_BLOCK_SIZE - 1 : WAY_BLOCK_SIZE + nfree - 1;
+            wb->refs[w] = hb->refs[last];
+            if (nfree >= 0) {
+                hb->refs[WAY_BLOCK_SIZE - 1] = -1;
+            } else {
+                hb->refs[last] = 0;
+                hb->refs[WAY_BLOCK_SIZE - 1] = nfree - 1;
+            }
+            if (hb->refs[WAY_BLOCK_SIZE - 1] == -WAY_BLOCK_SIZE) cell->head_way_block = hb->next;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+  Return the chain of the given grid cell to an earlier state, in which only blocks below n_blocks
+  were allocated, and none of the ways for which is_new returns true had been added yet. Ways are
+  only ever added to the head block, in slot order, so everything added since that state is at the
+  head of the chain: whole blocks (including spare blocks reserved earlier but linked in later),
+  followed by the last slots of the block that was at the head then.
+  Not safe to call while ways are being added.
+*/
+void grid_truncate_ways (GridCell *cell, uint32_t n_blocks, bool (*is_new)(int32_t way_id)) {
+    while (cell->head_way_block != 0) {
+        WayBlock *wb = &(way_blocks[cell->head_way_block]);
+        int kept = 0;
+        if (cell->head_way_block < n_blocks) {
+            while (kept < WAY_BLOCK_SIZE && wb->refs[kept] > 0 && !is_new(wb->refs[kept])) kept++;
+        }
+        if (kept == 0) {
+            cell->head_way_block = wb->next;
+            continue;
+        }
+        if (kept < WAY_BLOCK_SIZE) {
+            for (int w = kept; w < WAY_BLOCK_SIZE; w++) wb->refs[w] = 0;
+            wb->refs[WAY_BLOCK_SIZE - 1] = kept - WAY_BLOCK_SIZE;
+        }
+        return;
+    }
+}
+
+/*
+  The chains are good for adding and removing ways, but reading a cell means following them from
+  block to block across the whole way_blocks file, and relations are chained through the relations
+  themselves. Once a load or a set of changes is finished, the contents of every cell are copied
+  into two contiguous arrays of IDs in cell order, each cell's IDs sorted. The ways of cell c are then
+  the n_ways IDs in grid_way_ids from grid_ranges[c].first_way, and likewise for relations, so the
+  cells of one row of a bounding box are a single sequential read. Ranges are only written for cells
+  with contents (or that had some when last compacted), so most of the range file stays sparse.
+  The relation chains are followed with the next_relation function. Not safe to call while ways are
+  being added or removed.
+
+  After a set of changes only the cells they touched need compacting again. Their new contents are
+  appended after the end of the arrays, abandoning the IDs they had before as waste, which stays
+  until the next full compaction. Until then those cells are read out of row order.
+*/
+static int compare_way_ids (const void *a, const void *b) {
+    int32_t x = *(const int32_t *)a, y = *(const int32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int compare_relation_ids (const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+  Copy the contents of cell c to the end of the compacted arrays and point its range at them.
+  Returns false, leaving the range as it was, if the arrays have no room for them.
+*/
+static bool compact_cell (uint32_t c, uint32_t max_ways, uint32_t max_relations,
+                          uint32_t (*next_relation)(uint32_t relation_id)) {
+    GridCell *cell = grid_cell_at(c);
+    GridRange *range = &(grid_ranges[c]);
+    if (cell->head_way_block == 0 && cell->head_relation == 0) {
+        if (range->n_ways != 0 || range->n_relations != 0) memset(range, 0, sizeof(GridRange));
+        return true;
+    }
+    uint32_t n_ways = grid_way_ids_end, n_relations = grid_relation_ids_end;
+    for (uint32_t b = cell->head_way_block; b != 0; b = way_blocks[b].next) {
+        for (int w = 0; w < WAY_BLOCK_SIZE; w++) {
+            int32_t way_id = way_blocks[b].refs[w];
+            /* Empty slots in the way block will be either negative or zero. */
+            if (way_id <= 0) break;
+            if (n_ways >= max_ways) return false;
+            grid_way_ids[n_ways++] = way_id;
+        }
+    }
+    for (uint32_t r = cell->head_relation; r != 0; r = next_relation(r)) {
+        if (n_relations >= max_relations) return false;
+        grid_relation_ids[n_relations++] = r;
+    }
+    range->first_way = grid_way_ids_end;
+    range->first_relation = grid_relation_ids_end;
+    range->n_ways = n_ways - grid_way_ids_end;
+    range->n_relations = n_relations - grid_relation_ids_end;
+    grid_way_ids_end = n_ways;
+    grid_relation_ids_end = n_relations;
+    if (range->n_ways > 1) qsort(&(grid_way_ids[range->first_way]), range->n_ways,
+                                 sizeof(int32_t), &compare_way_ids);
+    if (range->n_relations > 1) qsort(&(grid_relation_ids[range->first_relation]), range->n_relations,
+                                      sizeof(uint32_t), &compare_relation_ids);
+    return true;
+}
+
+void grid_compact (uint32_t max_ways, uint32_t max_relations, uint32_t (*next_relation)(uint32_t relation_id)) {
+    grid_way_ids_end = grid_way_ids_waste = 0;
+    grid_relation_ids_end = grid_relation_ids_waste = 0;
+    for (uint32_t c = 0; c < grid_tile_count * TILE_CELLS; c++) {
+        if (!compact_cell(c, max_ways, max_relations, next_relation))
+            die("More ways or relations are indexed than expected.");
+    }
+    fprintf(stderr, "Compacted the grid index to %u ways and %u relations.\n",
+        grid_way_ids_end, grid_relation_ids_end);
+}
+
+/*
+  Compact only the n_cells cells listed, each of which must appear only once. Returns false if the
+  arrays run out of room, after which only a full compaction leaves the index consistent.
+*/
+bool grid_compact_cells (uint32_t *cells, size_t n_cells, uint32_t max_ways, uint32_t max_relations,
+                         uint32_t (*next_relation)(uint32_t relation_id)) {
+    for (size_t i = 0; i < n_cells; i++) {
+        GridRange *range = &(grid_ranges[cells[i]]);
+        uint32_t old_ways = range->n_ways, old_relations = range->n_relations;
+        if (!compact_cell(cells[i], max_ways, max_relations, next_relation)) return false;
+        grid_way_ids_waste += old_ways;
+        grid_relation_ids_waste += old_relations;
+    }
+    fprintf(stderr, "Compacted %zu grid cells again, leaving %u of %u way IDs and %u of %u relation IDs unused.\n",
+        n_cells, grid_way_ids_waste, grid_way_ids_end, grid_relation_ids_waste, grid_relation_ids_end);
+    return true;
+}
+
+#ifdef GRID_STRESS_TEST
+/*
+  Stress test indexing ways from many threads into a few hot grid cells, each in a tile of its own
+  that the threads race to allocate, then check that every way appears exactly once across the
+  cells' chains. Build and run with: make grid-stress && ./grid-stress
+*/
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define STRESS_THREADS 8
+#define STRESS_WAYS_PER_THREAD 2000000
+#define STRESS_CELLS 64
+
+/* The grid cell on the diagonal used for stress test cell c. */
+static GridCell *stress_cell (int c) {
+    int32_t xy = (int32_t)((uint32_t)(c << TILE_BITS) << (32 - grid_bits));
+    return grid_cell(xy, xy);
+}
+
+static void *stress_thread (void *arg) {
+    int t = (int)(intptr_t)arg;
+    uint32_t seed = t + 1;
+    for (int32_t i = 0; i < STRESS_WAYS_PER_THREAD; i++) {
+        seed = seed * 1103515245 + 12345;
+        /* Half the ways go to a single cell, the rest are spread over the others. */
+        int c = (seed >> 16) % (STRESS_CELLS * 2);
+        if (c >= STRESS_CELLS) c = 0;
+        grid_add_way(stress_cell(c), t * STRESS_WAYS_PER_THREAD + i + 1);
+    }
+    return NULL;
+}
+
+static void *map_zeros (size_t size) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) die("Could not map memory for stress test.");
+    return p;
+}
+
+int main () {
+    grid_set_bits(DEFAULT_GRID_BITS);
+    grid_tiles = map_zeros(sizeof(uint32_t) * MAX_TILE_DIR);
+    grid_cells = map_zeros(sizeof(GridCell) * TILE_CELLS * grid_max_tiles);
+    way_blocks = map_zeros(sizeof(WayBlock) * grid_max_way_blocks);
+    size_t n_ways = (size_t)STRESS_THREADS * STRESS_WAYS_PER_THREAD;
+    uint8_t *seen = calloc(n_ways + 1, 1);
+    pthread_t threads[STRESS_THREADS];
+    for (int t = 0; t < STRESS_THREADS; t++)
+        pthread_create(&(threads[t]), NULL, &stress_thread, (void*)(intptr_t)t);
+    for (int t = 0; t < STRESS_THREADS; t++)
+        pthread_join(threads[t], NULL);
+    size_t found = 0, duplicates = 0, blocks = 0, partial = 0;
+    for (int c = 0; c < STRESS_CELLS; c++) {
+        GridCell *cell = stress_cell(c);
+        for (uint32_t b = cell->head_way_block; b != 0; b = way_blocks[b].next) {
+            blocks++;
+            for (int w = 0; w < WAY_BLOCK_SIZE; w++) {
+                int32_t way_id = way_blocks[b].refs[w];
+                /* Empty slots in the way block will be either negative or zero. */
+                if (way_id <= 0) break;
+                if (seen[way_id]++) duplicates++;
+                found++;
+            }
+            /* Only the head block of a chain may have free slots. */
+            if (way_blocks[b].refs[WAY_BLOCK_SIZE - 1] < 0 && b != cell->head_way_block) partial++;
+        }
+    }
+    printf("%zu ways indexed by %d threads, %zu found in %zu blocks (%u allocated), "
+           "%zu duplicates, %zu partial blocks behind a head, %u tiles allocated for %d cells\n",
+           n_ways, STRESS_THREADS, found, blocks, way_block_count - 1, duplicates, partial,
+           grid_tile_count - 1, STRESS_CELLS);
+    if (found != n_ways || duplicates != 0) {
+        printf("FAILED: ways were lost or duplicated\n");
+        return EXIT_FAILURE;
+    }
+    printf("OK\n");
+    return EXIT_SUCCESS;
+}
+#endif /* GRID_STRESS_TEST */
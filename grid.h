@@ -0,0 +1,104 @@
+/* grid.h : the spatial index, a grid of cells each heading chains of way reference blocks and relations. */
+#ifndef GRID_H_INCLUDED
+#define GRID_H_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// 14 bits -> 1.7km at 45 degrees
+// 13 bits -> 3.4km at 45 degrees
+// at 45 degrees cos(pi/4)~=0.7
+// TODO maybe shift one more bit off of y to make bins more square
+/* The width and height of the grid is 2^grid_bits cells, chosen when a database is created. */
+#define DEFAULT_GRID_BITS 14
+#define MIN_GRID_BITS 8
+#define MAX_GRID_BITS 16
+
+/* The grid is allocated in square tiles of 2^TILE_BITS cells on a side. */
+#define TILE_BITS 6
+#define TILE_CELLS (1 << (2 * TILE_BITS))
+/* The tile directory has room for a grid of MAX_GRID_BITS. */
+#define MAX_TILE_DIR ((1 << (MAX_GRID_BITS - TILE_BITS)) * (1 << (MAX_GRID_BITS - TILE_BITS)))
+
+/* Way reference block size is based on the typical number of ways per grid cell. */
+#define WAY_BLOCK_SIZE 32
+
+/* 
+  A block of way references. Chained together to record which ways begin in each grid cell. 
+  Way references can still be stored in signed 32 bit integers since there are not as many of 
+  them as there are nodes. If the last reference in a block is negative, it indicates how many
+  slots are unused at the end of the block. New empty way blocks for a particular grid cell are 
+  inserted at the head of the list, so even when the head block is not completely full it may
+  point to a next block.
+*/
+typedef struct {
+    int32_t refs[WAY_BLOCK_SIZE];
+    uint32_t next; // the index of the next way block in the chain, or zero if there is no next way block.
+} WayBlock;
+
+/* Indexes for the first block of nodes and the first relation in each grid cell. */
+typedef struct {
+    uint32_t head_way_block;
+    uint32_t head_relation;
+} GridCell;
+
+/* Where the ways and relations of one cell are in the compacted index. */
+typedef struct {
+    uint32_t first_way;
+    uint32_t n_ways;
+    uint32_t first_relation;
+    uint32_t n_relations;
+} GridRange;
+
+/*
+  The memory-mapped grid: the tile directory, the tiles of cells, and the number of tiles allocated
+  so far. Then the way reference blocks and the number of blocks allocated so far.
+*/
+extern uint32_t  grid_bits;
+extern uint32_t  grid_max_tiles;
+extern uint32_t  grid_max_way_blocks;
+extern uint32_t *grid_tiles;
+extern GridCell *grid_cells;
+extern uint32_t  grid_tile_count;
+extern WayBlock *way_blocks;
+extern uint32_t  way_block_count;
+
+/*
+  The compacted index, with one range for each cell. Then the used length of each array of IDs,
+  and how many of those IDs are left over from cells compacted again since the last full compaction.
+*/
+extern GridRange *grid_ranges;
+extern int32_t   *grid_way_ids;
+extern uint32_t  *grid_relation_ids;
+extern uint32_t   grid_way_ids_end;
+extern uint32_t   grid_way_ids_waste;
+extern uint32_t   grid_relation_ids_end;
+extern uint32_t   grid_relation_ids_waste;
+
+void grid_set_bits (uint32_t bits);
+
+uint32_t grid_bin (int32_t xy);
+
+GridCell *grid_cell (int32_t x, int32_t y);
+
+GridCell *grid_cell_find (uint32_t xbin, uint32_t ybin);
+
+uint32_t grid_cell_index (GridCell *cell);
+
+GridCell *grid_cell_at (uint32_t index);
+
+void grid_add_way (GridCell *cell, int32_t way_id);
+
+bool grid_remove_way (GridCell *cell, int32_t way_id);
+
+void grid_truncate_ways (GridCell *cell, uint32_t n_blocks, bool (*is_new)(int32_t way_id));
+
+void grid_truncate_tiles (uint32_t n_tiles);
+
+void grid_compact (uint32_t max_ways, uint32_t max_relations, uint32_t (*next_relation)(uint32_t relation_id));
+
+bool grid_compact_cells (uint32_t *cells, size_t n_cells, uint32_t max_ways, uint32_t max_relations,
+                         uint32_t (*next_relation)(uint32_t relation_id));
+
+#endif /* GRID_H_INCLUDED */
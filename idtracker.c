@@ -3,15 +3,16 @@
 
 /*
   A bitset intended for tracking usage of OSM IDs, which are 64 bit integers.
-  However most of that ID range is unused. If we just reserve one bit per ID that may be flagged,
-  we need something like 1GB of space. To keep this simple we just allocate all that space at
-  once and let the OS take care of paging. 
-  Note that the VM page size is typically 4 kBytes, so this is not as sparse as we'd ideally like.
-  But with one or more levels of indirection to dynamically allocated bins, the pointers to the 
-  bins are each 64 bits so the bins would need to be relatively large to be effective. It would
-  only really be advantageous if the bins were looked up in a dynamically resized hashtable rather
-  than a flat array, so it gets complicated quickly.
-  The approach used here is much more simple and much less prone to error.
+  Most of that ID range is unused, and an extract only sets the IDs of the elements it outputs, so
+  the bits are kept in a sparse tree whose size follows the IDs actually set rather than the largest
+  possible ID. The low LEAF_BITS of an ID select a bit in a small leaf bitmap, the next MID_BITS select
+  the leaf in a mid-level table of pointers, and the remaining high bits select the mid-level table in
+  a top-level directory. Leaves and tables are allocated the first time one of their IDs is set, and
+  the directory is grown to cover the highest ID set so far, so there is no fixed maximum ID. The
+  directory takes one pointer per 2^24 IDs, only 4 kbytes for node IDs approaching 2^33.
+  Nodes, ways and relations created together have nearby IDs, so the IDs in an extract tend to fall
+  in runs that share leaves. Resetting a tracker frees everything except the directory.
+  Several trackers may be used at once, for instance for nodes and for ways.
 */
 
 #include <stdint.h>
@@ -20,48 +21,154 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-// Warning: the maximum node ID is almost reaching 2^33 as of March 2021.
-#define MAX_ID (1L << 33)
-// Why are we using 64-bit wide bins instead of single bytes?
+/* Each leaf holds 4096 bits (512 bytes) in 64-bit wide bins. */
+#define LEAF_BITS 12
 #define BIN_BITS 6
-#define BIN_MASK ((1L << BIN_BITS) - 1)
-#define N_BINS (MAX_ID >> BIN_BITS)
+#define BIN_MASK ((1UL << BIN_BITS) - 1)
+#define N_LEAF_BINS (1UL << (LEAF_BITS - BIN_BITS))
+/* Each mid-level table holds 4096 leaf pointers (32 kbytes), covering 2^24 IDs. */
+#define MID_BITS 12
+#define MID_MASK ((1UL << MID_BITS) - 1)
+#define TOP_SHIFT (LEAF_BITS + MID_BITS)
 
-static uint64_t bins[N_BINS];
+typedef struct {
+    uint64_t bins[N_LEAF_BINS];
+} Leaf;
 
-void IDTracker_reset () {
-    memset (bins, 0, sizeof(bins));
+typedef struct {
+    Leaf *leaves[1UL << MID_BITS];
+} Mid;
+
+struct IDTracker {
+    Mid **mids;
+    size_t n_mids;
+};
+
+static void die (const char *msg) {
+    fprintf (stderr, "%s\n", msg);
+    exit (-12);
+}
+
+IDTracker *IDTracker_new () {
+    IDTracker *tracker = calloc (1, sizeof(IDTracker));
+    if (tracker == NULL) die ("Could not allocate ID tracker.");
+    return tracker;
+}
+
+void IDTracker_reset (IDTracker *tracker) {
+    for (size_t m = 0; m < tracker->n_mids; m++) {
+        Mid *mid = tracker->mids[m];
+        if (mid == NULL) continue;
+        for (size_t l = 0; l <= MID_MASK; l++) free (mid->leaves[l]);
+        free (mid);
+        tracker->mids[m] = NULL;
+    }
+}
+
+void IDTracker_free (IDTracker *tracker) {
+    IDTracker_reset (tracker);
+    free (tracker->mids);
+    free (tracker);
+}
+
+/* Grow the directory to at least double its size, so that rising IDs cost little copying. */
+static void grow_directory (IDTracker *tracker, uint64_t m) {
+    size_t n_mids = tracker->n_mids * 2;
+    if (n_mids <= m) n_mids = m + 1;
+    Mid **mids = realloc (tracker->mids, n_mids * sizeof(Mid *));
+    if (mids == NULL) die ("Could not grow ID tracker directory.");
+    memset (mids + tracker->n_mids, 0, (n_mids - tracker->n_mids) * sizeof(Mid *));
+    tracker->mids = mids;
+    tracker->n_mids = n_mids;
+}
+
+/* Find the leaf holding the given ID, allocating it and its mid-level table if asked to. */
+static Leaf *find_leaf (IDTracker *tracker, uint64_t id, bool allocate) {
+    uint64_t m = id >> TOP_SHIFT;
+    if (m >= tracker->n_mids) {
+        if (!allocate) return NULL;
+        grow_directory (tracker, m);
+    }
+    Mid *mid = tracker->mids[m];
+    if (mid == NULL) {
+        if (!allocate) return NULL;
+        mid = calloc (1, sizeof(Mid));
+        if (mid == NULL) die ("Could not allocate ID tracker table.");
+        tracker->mids[m] = mid;
+    }
+    Leaf **leaf = &(mid->leaves[(id >> LEAF_BITS) & MID_MASK]);
+    if (*leaf == NULL) {
+        if (!allocate) return NULL;
+        *leaf = calloc (1, sizeof(Leaf));
+        if (*leaf == NULL) die ("Could not allocate ID tracker leaf.");
+    }
+    return *leaf;
 }
 
-bool IDTracker_set (uint64_t id) {
-    int bin_index = id >> BIN_BITS;
-    int bit_index = id & BIN_MASK;
-    if (bin_index >= N_BINS) exit (-12);
-    uint64_t bit_flag = 1L << bit_index;
-    bool already_set = bins[bin_index] & bit_flag;
-    bins[bin_index] |= bit_flag;
+/* Set the bit for an ID, returning whether it was already set. */
+bool IDTracker_set (IDTracker *tracker, uint64_t id) {
+    Leaf *leaf = find_leaf (tracker, id, true);
+    uint64_t *bin = &(leaf->bins[(id >> BIN_BITS) & (N_LEAF_BINS - 1)]);
+    uint64_t bit_flag = 1UL << (id & BIN_MASK);
+    bool already_set = *bin & bit_flag;
+    *bin |= bit_flag;
     return already_set;
 }
 
-bool IDTracker_get (uint64_t id) {
-    int bin_index = id >> BIN_BITS;
-    int bit_index = id & BIN_MASK;
-    if (bin_index >= N_BINS) exit (-12);
-    uint64_t bit_flag = 1L << bit_index;
-    return bins[bin_index] & bit_flag;
+/*
+  Grow the directory to cover all IDs up to max_id. Trackers shared between threads must be reserved
+  before they are shared, because the directory cannot be replaced while other threads are using it.
+*/
+void IDTracker_reserve (IDTracker *tracker, uint64_t max_id) {
+    uint64_t m = max_id >> TOP_SHIFT;
+    if (m >= tracker->n_mids) grow_directory (tracker, m);
+}
+
+/* Install a newly allocated table or leaf unless another thread got there first, returning the winner. */
+static void *install (void **slot, size_t size) {
+    void *p = __atomic_load_n (slot, __ATOMIC_ACQUIRE);
+    if (p != NULL) return p;
+    void *fresh = calloc (1, size);
+    if (fresh == NULL) die ("Could not allocate ID tracker leaf.");
+    if (__atomic_compare_exchange_n (slot, &p, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return fresh;
+    free (fresh);
+    return p;
+}
+
+/*
+  Set the bit for an ID like IDTracker_set, but safely while other threads are setting bits in the
+  same tracker. Exactly one of several threads setting the same ID at once sees it as not already set.
+  The ID must be within the range given to IDTracker_reserve.
+*/
+bool IDTracker_set_shared (IDTracker *tracker, uint64_t id) {
+    uint64_t m = id >> TOP_SHIFT;
+    if (m >= tracker->n_mids) die ("ID is beyond the range reserved in a shared ID tracker.");
+    Mid *mid = install ((void **) &(tracker->mids[m]), sizeof(Mid));
+    Leaf *leaf = install ((void **) &(mid->leaves[(id >> LEAF_BITS) & MID_MASK]), sizeof(Leaf));
+    uint64_t *bin = &(leaf->bins[(id >> BIN_BITS) & (N_LEAF_BINS - 1)]);
+    uint64_t bit_flag = 1UL << (id & BIN_MASK);
+    return __atomic_fetch_or (bin, bit_flag, __ATOMIC_RELAXED) & bit_flag;
+}
+
+bool IDTracker_get (IDTracker *tracker, uint64_t id) {
+    Leaf *leaf = find_leaf (tracker, id, false);
+    if (leaf == NULL) return false;
+    uint64_t bit_flag = 1UL << (id & BIN_MASK);
+    return leaf->bins[(id >> BIN_BITS) & (N_LEAF_BINS - 1)] & bit_flag;
 }
 
 int main_test () {
 
-    IDTracker_reset ();
+    IDTracker *tracker = IDTracker_new ();
     for (int i = 0; i < 10000; i += 3) {
-        IDTracker_set (i);
+        IDTracker_set (tracker, i);
     }
     
     for (int i = 0; i < 10000; i++) {
-        bool set = IDTracker_get (i);
+        bool set = IDTracker_get (tracker, i);
         printf ("%d %s \n", i, set ? "SET" : "NO");
     }
+    IDTracker_free (tracker);
     return 0;
     
 }
@@ -6,10 +6,20 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-void IDTracker_reset ();
+typedef struct IDTracker IDTracker;
 
-bool IDTracker_set (uint64_t id);
+IDTracker *IDTracker_new ();
 
-bool IDTracker_get (uint64_t id);
+void IDTracker_free (IDTracker *tracker);
+
+void IDTracker_reset (IDTracker *tracker);
+
+bool IDTracker_set (IDTracker *tracker, uint64_t id);
+
+bool IDTracker_get (IDTracker *tracker, uint64_t id);
+
+void IDTracker_reserve (IDTracker *tracker, uint64_t max_id);
+
+bool IDTracker_set_shared (IDTracker *tracker, uint64_t id);
 
 #endif // IDTRACKER_H_INCLUDED
@@ -29,6 +29,9 @@
 
 /* From protobuf-c. Chopped down to only varint read/write functions. */
 
+#ifndef INTPACK_H_INCLUDED
+#define INTPACK_H_INCLUDED
+
 #include <stdint.h>
 #include <string.h>
 
@@ -50,10 +53,35 @@ uint64_pack(uint64_t value, uint8_t *out);
 size_t
 sint64_pack(int64_t value, uint8_t *out);
 
-
-
-
-
-
-
-
+/*
+  Read one varint at *pos and advance *pos past it. These are inline because the PBF reader calls them
+  once per field of every node. They do not check for running past the end of the buffer; callers
+  must only use them on input whose varints are known to end inside the buffer.
+*/
+static inline uint64_t
+varint_read(uint8_t **pos)
+{
+	uint8_t *p = *pos;
+	uint64_t value = *p & 0x7f;
+	unsigned shift = 7;
+	while (*p++ & 0x80) {
+		value |= ((uint64_t) (*p & 0x7f)) << shift;
+		shift += 7;
+	}
+	*pos = p;
+	return value;
+}
+
+static inline int64_t
+unzigzag64(uint64_t v)
+{
+	return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+static inline int64_t
+svarint_read(uint8_t **pos)
+{
+	return unzigzag64(varint_read(pos));
+}
+
+#endif /* INTPACK_H_INCLUDED */
@@ -0,0 +1,176 @@
+/* nodestore.c */
+#include "nodestore.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "intpack.h"
+
+/*
+  A flat array of coordinates indexed by node ID is simple and fast, but it takes 8 bytes for every
+  ID ever issued, including the many deleted ones, and relies on the filesystem handling huge sparse
+  files well. This store instead groups node IDs into blocks of NODE_BLOCK_SIZE, and writes each
+  block as a bitmap of the IDs present followed by their coordinates, each delta coded against the
+  previous node in the block as a zigzag varint. Nodes with consecutive IDs were usually created
+  together and lie close together, so most deltas take one or two bytes.
+
+  Blocks are addressed through a dense table of offsets into the block data, and are written whole:
+  nodes are gathered into a pending block, which is encoded and appended to the data when a node
+  from another block arrives (or on node_store_flush). A block that is changed later is rewritten
+  in place if it still fits, or appended again and its old copy abandoned, like replaced node refs.
+  Readers decode whole blocks into a small cache of their own, so a run of lookups within a few
+  blocks (as for the nodes of one way) decodes each block only once.
+
+  Only one thread may put nodes, and not while any other thread is getting them.
+*/
+
+static void die(const char *msg) {
+    fprintf(stderr, "%s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+uint64_t *node_blocks;
+uint8_t  *node_block_data;
+/* Start at one, so that a zero offset means a block has no nodes. */
+uint64_t  node_block_data_size = 1;
+
+static size_t max_node_blocks;
+static size_t node_block_data_capacity;
+
+/* An encoded block begins with its length and the bitmap of node IDs present. */
+#define BLOCK_HEADER_SIZE (sizeof(uint16_t) + NODE_BLOCK_SIZE / 8)
+/* A coordinate delta can take up to 33 bits, so five bytes as a varint. */
+#define MAX_ENCODED_BLOCK (BLOCK_HEADER_SIZE + NODE_BLOCK_SIZE * 2 * 5)
+
+/* A decoded block. Coordinates of absent nodes are zero, as in a flat array. */
+typedef struct {
+    int64_t block;
+    uint8_t present[NODE_BLOCK_SIZE / 8];
+    coord_t coords[NODE_BLOCK_SIZE];
+} DecodedBlock;
+
+/* The block nodes are being put into, and whether it has changed since it was last written. */
+static DecodedBlock pending = { .block = -1 };
+static bool pending_dirty = false;
+
+/* Each reading thread's cache of decoded blocks, allocated the first time the thread reads. */
+static __thread DecodedBlock *cache = NULL;
+
+void node_store_init (uint64_t *blocks, size_t max_blocks, uint8_t *data, size_t data_capacity) {
+    node_blocks = blocks;
+    max_node_blocks = max_blocks;
+    node_block_data = data;
+    node_block_data_capacity = data_capacity;
+}
+
+static uint16_t encoded_length (uint64_t offset) {
+    uint16_t length;
+    memcpy(&length, node_block_data + offset, sizeof(length));
+    return length;
+}
+
+/* Decode the given block into out, or leave it empty if the block has no nodes. */
+static void decode_block (int64_t block, DecodedBlock *out) {
+    out->block = block;
+    uint64_t offset = node_blocks[block];
+    if (offset == 0) {
+        memset(out->present, 0, sizeof(out->present));
+        memset(out->coords, 0, sizeof(out->coords));
+        return;
+    }
+    uint8_t *p = node_block_data + offset + sizeof(uint16_t);
+    memcpy(out->present, p, sizeof(out->present));
+    p += sizeof(out->present);
+    int64_t x = 0, y = 0;
+    for (int i = 0; i < NODE_BLOCK_SIZE; i++) {
+        if (out->present[i >> 3] & (1 << (i & 7))) {
+            x += svarint_read(&p);
+            y += svarint_read(&p);
+            out->coords[i].x = x;
+            out->coords[i].y = y;
+        } else {
+            out->coords[i].x = 0;
+            out->coords[i].y = 0;
+        }
+    }
+}
+
+/* Encode a decoded block into out, returning the encoded length. */
+static size_t encode_block (DecodedBlock *in, uint8_t *out) {
+    uint8_t *p = out + sizeof(uint16_t);
+    memcpy(p, in->present, sizeof(in->present));
+    p += sizeof(in->present);
+    int64_t x = 0, y = 0;
+    for (int i = 0; i < NODE_BLOCK_SIZE; i++) {
+        if (!(in->present[i >> 3] & (1 << (i & 7)))) continue;
+        p += sint64_pack((int64_t)in->coords[i].x - x, p);
+        p += sint64_pack((int64_t)in->coords[i].y - y, p);
+        x = in->coords[i].x;
+        y = in->coords[i].y;
+    }
+    uint16_t length = p - out;
+    memcpy(out, &length, sizeof(length));
+    return length;
+}
+
+/* Write the pending block out if it has changed, keeping it pending in case more of its nodes follow. */
+void node_store_flush () {
+    if (!pending_dirty) return;
+    uint8_t encoded[MAX_ENCODED_BLOCK];
+    size_t length = encode_block(&pending, encoded);
+    uint64_t offset = node_blocks[pending.block];
+    if (offset == 0 || encoded_length(offset) < length) {
+        offset = node_block_data_size;
+        if (offset + length > node_block_data_capacity) die("Node block data is larger than expected.");
+        node_block_data_size += length;
+    }
+    memcpy(node_block_data + offset, encoded, length);
+    node_blocks[pending.block] = offset;
+    pending_dirty = false;
+    /* This thread may have an older copy of the block in its cache. */
+    if (cache != NULL && cache[pending.block % NODE_CACHE_BLOCKS].block == pending.block)
+        cache[pending.block % NODE_CACHE_BLOCKS].block = -1;
+}
+
+/* The block currently pending, which a checkpoint must remember, or -1 if there is none. */
+int64_t node_store_pending_block () {
+    return pending.block;
+}
+
+/* Store the coordinates of a node. */
+void node_store_put (int64_t node_id, coord_t coord) {
+    int64_t block = node_id >> NODE_BLOCK_BITS;
+    if (block != pending.block) {
+        if (block < 0 || block >= max_node_blocks) die("Node ID is beyond the node block table.");
+        node_store_flush();
+        decode_block(block, &pending);
+    }
+    int i = node_id & (NODE_BLOCK_SIZE - 1);
+    pending.present[i >> 3] |= 1 << (i & 7);
+    pending.coords[i] = coord;
+    pending_dirty = true;
+}
+
+/* Get the coordinates of a node, which are zero if it is not stored or its ID is out of range. */
+coord_t node_store_get (int64_t node_id) {
+    int64_t block = node_id >> NODE_BLOCK_BITS;
+    if (block < 0 || block >= max_node_blocks) {
+        coord_t none = {0, 0};
+        return none;
+    }
+    int i = node_id & (NODE_BLOCK_SIZE - 1);
+    if (block == pending.block) return pending.coords[i];
+    if (cache == NULL) {
+        cache = malloc(NODE_CACHE_BLOCKS * sizeof(DecodedBlock));
+        if (cache == NULL) die("Could not allocate node block cache.");
+        for (int c = 0; c < NODE_CACHE_BLOCKS; c++) cache[c].block = -1;
+    }
+    DecodedBlock *cached = &(cache[block % NODE_CACHE_BLOCKS]);
+    if (cached->block != block) decode_block(block, cached);
+    return cached->coords[i];
+}
+
+/* Free the calling thread's cache of decoded blocks. Threads that read nodes call this before exiting. */
+void node_store_release_cache () {
+    free(cache);
+    cache = NULL;
+}
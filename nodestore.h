@@ -0,0 +1,42 @@
+/* nodestore.h : node coordinates, kept compressed in blocks of consecutive node IDs. */
+#ifndef NODESTORE_H_INCLUDED
+#define NODESTORE_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Compact geographic position. Latitude and longitude mapped to the signed 32-bit int range. */
+typedef struct {
+    int32_t x;
+    int32_t y;
+} coord_t;
+
+/* Each block covers this many bits of node ID space. */
+#define NODE_BLOCK_BITS 8
+#define NODE_BLOCK_SIZE (1 << NODE_BLOCK_BITS)
+
+/* The decoded-block cache of each reading thread holds this many blocks. */
+#define NODE_CACHE_BLOCKS 64
+
+/*
+  The offset table, holding the position in node_block_data of each block (zero if the block has no
+  nodes), and the encoded blocks themselves. node_block_data_size is where the next block is written.
+*/
+extern uint64_t *node_blocks;
+extern uint8_t  *node_block_data;
+extern uint64_t  node_block_data_size;
+
+void node_store_init (uint64_t *blocks, size_t max_blocks, uint8_t *data, size_t data_capacity);
+
+void node_store_put (int64_t node_id, coord_t coord);
+
+void node_store_flush ();
+
+int64_t node_store_pending_block ();
+
+coord_t node_store_get (int64_t node_id);
+
+void node_store_release_cache ();
+
+#endif /* NODESTORE_H_INCLUDED */
@@ -0,0 +1,326 @@
+/* osc.c */
+#include "osc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "zlib.h"
+
+/*
+  A deliberately small reader for OsmChange XML. It only understands the markup those files contain:
+  <create>, <modify> and <delete> sections holding <node>, <way> and <relation> elements, with <tag>,
+  <nd> and <member> children. Anything else (the XML declaration, comments, <bounds> and so on) is
+  skipped. Input is read through zlib, so the file may be plain or gzipped.
+*/
+
+static void die(const char *msg) {
+    fprintf(stderr, "%s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+/* Input is read in chunks of this size. One piece of markup must fit in a chunk. */
+#define OSC_BUFFER_SIZE (1024 * 1024)
+
+static gzFile in;
+static char *buf;
+static size_t buf_len;
+static size_t buf_pos;
+static bool at_eof;
+
+/* The element being assembled, and the capacities of the arrays behind it. */
+static OscElement element;
+static bool in_element;
+static OscAction action;
+static size_t refs_capacity, members_capacity, tags_capacity, strings_capacity;
+
+/* Decoded strings are packed into one buffer, so they are only pointed to once an element is complete. */
+static char *bytes;
+static size_t bytes_len, bytes_capacity;
+static size_t *string_offsets;
+static size_t n_strings;
+
+/* Grow an array to hold at least n elements of the given size, doubling its capacity. */
+static void *grow (void *array, size_t *capacity, size_t n, size_t size) {
+    if (n <= *capacity) return array;
+    size_t new_capacity = (*capacity < 64) ? 64 : *capacity;
+    while (new_capacity < n) new_capacity *= 2;
+    array = realloc(array, new_capacity * size);
+    if (array == NULL) die("Could not allocate memory while reading change file.");
+    *capacity = new_capacity;
+    return array;
+}
+
+/* Discard the buffer contents before keep, then read more input after what remains. */
+static void refill (size_t keep) {
+    memmove(buf, buf + keep, buf_len - keep);
+    buf_len -= keep;
+    buf_pos = 0;
+    if (buf_len == OSC_BUFFER_SIZE) die("Markup in change file is too long.");
+    int n = gzread(in, buf + buf_len, OSC_BUFFER_SIZE - buf_len);
+    if (n < 0) die("Error reading change file.");
+    if (n == 0) at_eof = true;
+    buf_len += n;
+}
+
+/* Find the '>' ending the markup that begins at p, which is just past a '<'. Quoted '>' are skipped. */
+static char *markup_end (char *p, char *end) {
+    if (end - p >= 3 && memcmp(p, "!--", 3) == 0) {
+        for (char *c = p + 3; c + 2 < end; c++) {
+            if (c[0] == '-' && c[1] == '-' && c[2] == '>') return c + 2;
+        }
+        return NULL;
+    }
+    char quote = 0;
+    for (; p < end; p++) {
+        if (quote) {
+            if (*p == quote) quote = 0;
+        } else if (*p == '"' || *p == '\'') {
+            quote = *p;
+        } else if (*p == '>') {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/* Return the next piece of markup (whatever is between '<' and '>') terminated in place, or NULL at the end. */
+static char *next_markup () {
+    while (true) {
+        char *start = memchr(buf + buf_pos, '<', buf_len - buf_pos);
+        size_t keep = buf_len; // text between elements is not needed
+        if (start != NULL) {
+            char *end = markup_end(start + 1, buf + buf_len);
+            if (end != NULL) {
+                *end = '\0';
+                buf_pos = end + 1 - buf;
+                return start + 1;
+            }
+            keep = start - buf;
+        }
+        if (at_eof) {
+            if (start != NULL) die("Change file ends in the middle of markup.");
+            return NULL;
+        }
+        refill(keep);
+    }
+}
+
+static bool is_space (char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/* Step through the attributes of a tag, terminating names and values in place. False when none remain. */
+static bool next_attribute (char **p, char **name, char **value) {
+    char *s = *p;
+    while (is_space(*s)) s++;
+    if (*s == '\0' || *s == '/' || *s == '?') return false;
+    *name = s;
+    while (*s != '\0' && *s != '=' && !is_space(*s)) s++;
+    char *name_end = s;
+    while (is_space(*s)) s++;
+    if (*s != '=') die("Malformed attribute in change file.");
+    s++;
+    while (is_space(*s)) s++;
+    char quote = *s;
+    if (quote != '"' && quote != '\'') die("Unquoted attribute value in change file.");
+    *value = ++s;
+    s = strchr(s, quote);
+    if (s == NULL) die("Unterminated attribute value in change file.");
+    *s = '\0';
+    *name_end = '\0';
+    *p = s + 1;
+    return true;
+}
+
+/* Append a code point to out as UTF-8, returning the new end of the output. */
+static char *put_utf8 (char *out, unsigned long c) {
+    if (c < 0x80) {
+        *(out++) = c;
+    } else if (c < 0x800) {
+        *(out++) = 0xC0 | (c >> 6);
+        *(out++) = 0x80 | (c & 0x3F);
+    } else if (c < 0x10000) {
+        *(out++) = 0xE0 | (c >> 12);
+        *(out++) = 0x80 | ((c >> 6) & 0x3F);
+        *(out++) = 0x80 | (c & 0x3F);
+    } else {
+        *(out++) = 0xF0 | (c >> 18);
+        *(out++) = 0x80 | ((c >> 12) & 0x3F);
+        *(out++) = 0x80 | ((c >> 6) & 0x3F);
+        *(out++) = 0x80 | (c & 0x3F);
+    }
+    return out;
+}
+
+/*
+  Add an attribute value to the element's strings, replacing XML entities. Returns its index.
+  A decoded entity is never longer than the entity itself, so the input length bounds the output.
+*/
+static uint32_t add_string (const char *s) {
+    size_t max = strlen(s);
+    // the tag encoder may compare the first few bytes of a short key, so leave some slack at the end
+    bytes = grow(bytes, &bytes_capacity, bytes_len + max + 8, 1);
+    element.strings = grow(element.strings, &strings_capacity, n_strings + 1, sizeof(ProtobufCBinaryData));
+    string_offsets = realloc(string_offsets, strings_capacity * sizeof(size_t));
+    if (string_offsets == NULL) die("Could not allocate memory while reading change file.");
+    char *start = bytes + bytes_len;
+    char *out = start;
+    while (*s != '\0') {
+        const char *semi;
+        if (*s != '&' || (semi = strchr(s, ';')) == NULL) {
+            *(out++) = *(s++);
+            continue;
+        }
+        const char *entity = s + 1;
+        size_t len = semi - entity;
+        if (len == 3 && memcmp(entity, "amp", 3) == 0) *(out++) = '&';
+        else if (len == 2 && memcmp(entity, "lt", 2) == 0) *(out++) = '<';
+        else if (len == 2 && memcmp(entity, "gt", 2) == 0) *(out++) = '>';
+        else if (len == 4 && memcmp(entity, "quot", 4) == 0) *(out++) = '"';
+        else if (len == 4 && memcmp(entity, "apos", 4) == 0) *(out++) = '\'';
+        else if (len > 1 && entity[0] == '#' && (entity[1] == 'x' || entity[1] == 'X'))
+            out = put_utf8(out, strtoul(entity + 2, NULL, 16));
+        else if (len > 1 && entity[0] == '#')
+            out = put_utf8(out, strtoul(entity + 1, NULL, 10));
+        else {
+            /* Not an entity we know, so keep it as it is. */
+            memcpy(out, s, len + 2);
+            out += len + 2;
+        }
+        s = semi + 1;
+    }
+    uint32_t index = n_strings++;
+    string_offsets[index] = bytes_len;
+    element.strings[index].len = out - start;
+    bytes_len += out - start;
+    return index;
+}
+
+/* Begin a new node, way or relation. */
+static void begin_element (int type, char *attrs) {
+    element.action = action;
+    element.type = type;
+    element.id = 0;
+    element.lat = 0;
+    element.lon = 0;
+    element.n_refs = 0;
+    element.n_members = 0;
+    element.n_tags = 0;
+    bytes_len = 0;
+    n_strings = 0;
+    in_element = true;
+    char *name, *value;
+    while (next_attribute(&attrs, &name, &value)) {
+        if (strcmp(name, "id") == 0) element.id = strtoll(value, NULL, 10);
+        else if (strcmp(name, "lat") == 0) element.lat = strtod(value, NULL);
+        else if (strcmp(name, "lon") == 0) element.lon = strtod(value, NULL);
+    }
+}
+
+/* Hand a complete element to the callback, once its strings have stopped moving. */
+static void end_element (OscCallback callback) {
+    for (size_t s = 0; s < n_strings; s++) {
+        element.strings[s].data = (uint8_t *)(bytes + string_offsets[s]);
+    }
+    in_element = false;
+    (*callback)(&element);
+}
+
+/* <tag k="..." v="..."/> */
+static void add_tag (char *attrs) {
+    char *name, *value, *key = NULL, *val = NULL;
+    while (next_attribute(&attrs, &name, &value)) {
+        if (strcmp(name, "k") == 0) key = value;
+        else if (strcmp(name, "v") == 0) val = value;
+    }
+    if (key == NULL || val == NULL) die("Tag without key or value in change file.");
+    element.keys = grow(element.keys, &tags_capacity, element.n_tags + 1, sizeof(uint32_t));
+    element.vals = realloc(element.vals, tags_capacity * sizeof(uint32_t));
+    if (element.vals == NULL) die("Could not allocate memory while reading change file.");
+    element.keys[element.n_tags] = add_string(key);
+    element.vals[element.n_tags] = add_string(val);
+    element.n_tags++;
+}
+
+/* <nd ref="..."/> */
+static void add_ref (char *attrs) {
+    char *name, *value;
+    while (next_attribute(&attrs, &name, &value)) {
+        if (strcmp(name, "ref") != 0) continue;
+        element.refs = grow(element.refs, &refs_capacity, element.n_refs + 1, sizeof(int64_t));
+        element.refs[element.n_refs++] = strtoll(value, NULL, 10);
+    }
+}
+
+/* <member type="..." ref="..." role="..."/> */
+static void add_member (char *attrs) {
+    char *name, *value, *role = "";
+    element.members = grow(element.members, &members_capacity, element.n_members + 1, sizeof(OscMember));
+    OscMember *member = &(element.members[element.n_members++]);
+    member->id = 0;
+    member->type = 0;
+    while (next_attribute(&attrs, &name, &value)) {
+        if (strcmp(name, "ref") == 0) {
+            member->id = strtoll(value, NULL, 10);
+        } else if (strcmp(name, "type") == 0) {
+            if (strcmp(value, "node") == 0) member->type = 0;
+            else if (strcmp(value, "way") == 0) member->type = 1;
+            else if (strcmp(value, "relation") == 0) member->type = 2;
+            else die("Unknown relation member type in change file.");
+        } else if (strcmp(name, "role") == 0) {
+            role = value;
+        }
+    }
+    member->role = add_string(role);
+}
+
+/*
+  Read an OsmChange file (plain or gzipped), calling back once for every node, way and relation in
+  the order they appear. Strings within the element are only valid until the callback returns.
+*/
+void osc_read (const char *filename, OscCallback callback) {
+    fprintf(stderr, "Reading change file '%s'.\n", filename);
+    in = gzopen(filename, "rb");
+    if (in == NULL) die("Could not open change file.");
+    if (buf == NULL) buf = malloc(OSC_BUFFER_SIZE + 1);
+    if (buf == NULL) die("Could not allocate change file buffer.");
+    buf_len = buf_pos = 0;
+    at_eof = false;
+    in_element = false;
+    action = OSC_MODIFY;
+    char *markup;
+    while ((markup = next_markup()) != NULL) {
+        if (markup[0] == '?' || markup[0] == '!') continue; // declarations and comments
+        bool closing = (markup[0] == '/');
+        if (closing) markup++;
+        char *attrs = markup;
+        while (*attrs != '\0' && *attrs != '/' && !is_space(*attrs)) attrs++;
+        size_t name_len = attrs - markup;
+        char *end = attrs + strlen(attrs);
+        while (end > attrs && is_space(end[-1])) end--;
+        bool empty = (end > attrs && end[-1] == '/');
+        #define IS(name) (name_len == sizeof(name) - 1 && memcmp(markup, name, name_len) == 0)
+        if (closing) {
+            if (in_element && (IS("node") || IS("way") || IS("relation"))) end_element(callback);
+        } else if (IS("create")) {
+            action = OSC_CREATE;
+        } else if (IS("modify")) {
+            action = OSC_MODIFY;
+        } else if (IS("delete")) {
+            action = OSC_DELETE;
+        } else if (IS("node") || IS("way") || IS("relation")) {
+            begin_element(IS("node") ? 0 : IS("way") ? 1 : 2, attrs);
+            if (empty) end_element(callback);
+        } else if (!in_element) {
+            continue;
+        } else if (IS("tag")) {
+            add_tag(attrs);
+        } else if (IS("nd")) {
+            add_ref(attrs);
+        } else if (IS("member")) {
+            add_member(attrs);
+        }
+        #undef IS
+    }
+    gzclose(in);
+}
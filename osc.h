@@ -0,0 +1,49 @@
+/* osc.h : reading OsmChange files, the XML format of the minutely, hourly and daily OSM diffs. */
+#ifndef OSC_H_INCLUDED
+#define OSC_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include "pbf.h" // for ProtobufCBinaryData
+
+/* What a change file asks to be done with an element. */
+typedef enum {
+    OSC_CREATE,
+    OSC_MODIFY,
+    OSC_DELETE
+} OscAction;
+
+/* A relation member. The type uses the PBF numbering (0 node, 1 way, 2 relation), like RelMember. */
+typedef struct {
+    int64_t id;
+    int type;
+    uint32_t role; // index into the element's strings
+} OscMember;
+
+/*
+  One node, way or relation from a change file, with the same type numbering as OscMember.
+  Tags and roles are indexes into strings, so that tag lists can be encoded exactly like those from
+  a PBF string table. Elements that are deleted may come with nothing but an ID.
+  Everything is only valid until the callback returns.
+*/
+typedef struct {
+    OscAction action;
+    int type;
+    int64_t id;
+    double lat;
+    double lon;
+    int64_t *refs;
+    size_t n_refs;
+    OscMember *members;
+    size_t n_members;
+    uint32_t *keys;
+    uint32_t *vals;
+    size_t n_tags;
+    ProtobufCBinaryData *strings;
+} OscElement;
+
+typedef void (*OscCallback) (OscElement *element);
+
+void osc_read (const char *filename, OscCallback callback);
+
+#endif /* OSC_H_INCLUDED */
@@ -0,0 +1,122 @@
+/* pagecache.c */
+#define _GNU_SOURCE // for sync_file_range
+#include "pagecache.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+  A load reads the input PBF once from front to back, and fills several database files (nodes,
+  node_refs, tags) mostly from front to back. Left alone, the kernel keeps all those finished pages 
+  cached at the expense of the pages the loader is still using at random, such as the grid and the
+  nodes looked up by ways. It also lets dirty pages pile up and then flushes them all at once, 
+  stalling the loader for seconds at a time. Here we tell it which ranges we are done with, and 
+  write them back steadily as they are finished.
+
+  All of this is driven from the thread delivering PBF blocks, and is not thread safe.
+*/
+
+/* Every written file being tracked, so the dirty budget can be enforced across all of them. */
+#define MAX_WRITTEN_FILES 64
+static DropBehind *written_files[MAX_WRITTEN_FILES];
+static int n_written_files = 0;
+
+static size_t dirty_budget = (size_t)DEFAULT_DIRTY_BUDGET_MB * 1024 * 1024;
+static size_t pending = 0; // total finished bytes not yet dropped, across all written files
+
+/* Declare that a mapping will be read sequentially, so the kernel reads ahead aggressively. */
+void pagecache_sequential (void *base, size_t len) {
+    madvise(base, len, MADV_SEQUENTIAL);
+}
+
+/* Set the number of bytes of finished pages that written files may hold in the page cache. */
+void pagecache_dirty_budget (size_t bytes) {
+    dirty_budget = bytes;
+}
+
+/* Writeback is started whenever a file has this many newly finished bytes. */
+static size_t writeback_step () {
+    size_t step = dirty_budget / 16;
+    return step < 1024 * 1024 ? 1024 * 1024 : step;
+}
+
+/* Start tracking a mapped file. A negative fd (as for shared memory objects) disables dropping. */
+void drop_behind_init (DropBehind *db, void *base, int fd, bool written) {
+    db->base = (fd < 0) ? NULL : base;
+    db->fd = fd;
+    db->written = written;
+    db->flushed = 0;
+    db->dropped = 0;
+    if (written && db->base != NULL) {
+        if (n_written_files == MAX_WRITTEN_FILES) {
+            fprintf(stderr, "Too many files for write-behind, leaving one to the kernel.\n");
+            db->base = NULL;
+            return;
+        }
+        written_files[n_written_files++] = db;
+    }
+}
+
+/* Ask the kernel to write back a range of a file without waiting for it. */
+static void start_writeback (DropBehind *db, size_t from, size_t to) {
+#ifdef SYNC_FILE_RANGE_WRITE
+    sync_file_range(db->fd, from, to - from, SYNC_FILE_RANGE_WRITE);
+#else
+    msync(db->base + from, to - from, MS_ASYNC);
+#endif
+}
+
+/* Drop a range of a file from our mapping and from the page cache, first waiting for writeback. */
+static void drop_range (DropBehind *db, size_t from, size_t to) {
+    if (to <= from) return;
+    if (db->written) {
+#ifdef SYNC_FILE_RANGE_WRITE
+        sync_file_range(db->fd, from, to - from,
+            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+        msync(db->base + from, to - from, MS_SYNC);
+#endif
+    }
+    madvise(db->base + from, to - from, MADV_DONTNEED);
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(db->fd, from, to - from, POSIX_FADV_DONTNEED);
+#endif
+}
+
+/* 
+  Drop the finished pages of whichever written files hold the most, until all of them together fit
+  within the budget again. Their writeback was started earlier, so waiting for it is normally brief.
+*/
+static void enforce_dirty_budget () {
+    while (pending > dirty_budget) {
+        DropBehind *largest = written_files[0];
+        for (int f = 1; f < n_written_files; f++) {
+            DropBehind *db = written_files[f];
+            if (db->flushed - db->dropped > largest->flushed - largest->dropped) largest = db;
+        }
+        drop_range(largest, largest->dropped, largest->flushed);
+        pending -= largest->flushed - largest->dropped;
+        largest->dropped = largest->flushed;
+    }
+}
+
+/*
+  Report that everything in the file below offset done is finished with. This is cheap to call
+  often, and only makes system calls once enough more of the file has been finished.
+*/
+void drop_behind (DropBehind *db, size_t done) {
+    if (db->base == NULL) return;
+    done &= ~((size_t)sysconf(_SC_PAGESIZE) - 1); // whole pages only
+    if (db->written) {
+        if (done < db->flushed + writeback_step()) return;
+        start_writeback(db, db->flushed, done);
+        pending += done - db->flushed;
+        db->flushed = done;
+        enforce_dirty_budget();
+    } else {
+        if (done < db->dropped + DROP_BEHIND_STEP) return;
+        drop_range(db, db->dropped, done);
+        db->dropped = db->flushed = done;
+    }
+}
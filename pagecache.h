@@ -0,0 +1,37 @@
+/* pagecache.h : keeps files that are read or written front to back from crowding the page cache. */
+#ifndef PAGECACHE_H_INCLUDED
+#define PAGECACHE_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* Pages of files that are only read are released in steps of this many bytes. */
+#define DROP_BEHIND_STEP (64 * 1024 * 1024)
+
+/* The default limit on finished but not yet released pages of written files, in megabytes. */
+#define DEFAULT_DIRTY_BUDGET_MB 256
+
+/*
+  Tracks how much of one mapped file has been finished with, from the beginning of the file up.
+  In written files, writeback of each finished range is started promptly in small steps, and the
+  pages are dropped (waiting for any writeback still in progress) only when the finished pages of
+  all written files together exceed the dirty budget.
+*/
+typedef struct {
+    uint8_t *base; // the mapping, or NULL if dropping is disabled
+    int fd;
+    bool written;
+    size_t flushed; // writeback has been started for everything below this offset
+    size_t dropped; // everything below this offset has been dropped from the page cache
+} DropBehind;
+
+void pagecache_sequential (void *base, size_t len);
+
+void pagecache_dirty_budget (size_t bytes);
+
+void drop_behind_init (DropBehind *db, void *base, int fd, bool written);
+
+void drop_behind (DropBehind *db, size_t done);
+
+#endif /* PAGECACHE_H_INCLUDED */
@@ -0,0 +1,238 @@
+/* pbf-dense.c */
+#include "pbf-dense.h"
+#include "intpack.h"
+#include <stdio.h>
+
+/*
+  Node blobs are about nine tenths of a planet file. Unpacking them with protobuf-c copies every
+  packed id, lat, lon and keys_vals entry into a freshly allocated array, only for the reader to walk
+  those arrays once more to undo the delta coding. Here we instead walk the wire format of the
+  PrimitiveBlock just far enough to find the string table and the packed DenseNodes columns, and
+  leave the varints where they are in the inflated buffer.
+
+  Any block that is not made purely of DenseNodes groups (ways, relations, non-dense nodes,
+  changesets) is rejected, and the caller falls back on the general protobuf-c unpacking.
+  See https://developers.google.com/protocol-buffers/docs/encoding for the wire format.
+*/
+
+#define WIRE_VARINT 0
+#define WIRE_64BIT  1
+#define WIRE_LENGTH 2
+#define WIRE_32BIT  5
+
+/* Field numbers from osmformat.proto */
+#define BLOCK_STRINGTABLE 1
+#define BLOCK_GROUP 2
+#define BLOCK_GRANULARITY 17
+#define BLOCK_LAT_OFFSET 19
+#define BLOCK_LON_OFFSET 20
+#define STRINGTABLE_S 1
+#define GROUP_DENSE 2
+#define DENSE_ID 1
+#define DENSE_LAT 8
+#define DENSE_LON 9
+#define DENSE_KEYS_VALS 10
+
+/* 
+  A bounds-checked varint read, used on message structure. The hot per-node varints are read later
+  with the unchecked intpack reader, once their packed field has been validated as a whole. 
+*/
+static bool read_varint (uint8_t **pos, uint8_t *end, uint64_t *value) {
+    uint64_t v = 0;
+    for (unsigned shift = 0; *pos < end && shift < 64; shift += 7) {
+        uint8_t b = *((*pos)++);
+        v |= ((uint64_t)(b & 0x7f)) << shift;
+        if ((b & 0x80) == 0) {
+            *value = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* 
+  Read one field key and, for length-delimited fields, the bounds of the field contents.
+  Fields of other wire types are left at *pos for the caller to read or skip.
+*/
+static bool read_field (uint8_t **pos, uint8_t *end, int *field, int *wire_type, PackedField *contents) {
+    uint64_t key, len;
+    if (!read_varint(pos, end, &key)) return false;
+    *field = key >> 3;
+    *wire_type = key & 7;
+    if (*wire_type == WIRE_LENGTH) {
+        if (!read_varint(pos, end, &len) || len > end - *pos) return false;
+        contents->pos = *pos;
+        contents->end = *pos + len;
+        *pos += len;
+    }
+    return true;
+}
+
+/* Skip over the value of a field that is not length-delimited. */
+static bool skip_value (uint8_t **pos, uint8_t *end, int wire_type) {
+    uint64_t ignored;
+    switch (wire_type) {
+        case WIRE_LENGTH: return true; // already skipped by read_field
+        case WIRE_VARINT: return read_varint(pos, end, &ignored);
+        case WIRE_64BIT:  *pos += 8; return *pos <= end;
+        case WIRE_32BIT:  *pos += 4; return *pos <= end;
+        default: return false;
+    }
+}
+
+/* Varints in a packed field must all end inside it, which is true whenever the last byte ends one. */
+static bool packed_ok (PackedField *f) {
+    return f->pos == f->end || (*(f->end - 1) & 0x80) == 0;
+}
+
+static bool parse_dense (PackedField msg, DenseGroup *group) {
+    PackedField empty = {msg.pos, msg.pos};
+    group->id = group->lat = group->lon = group->keys_vals = empty;
+    while (msg.pos < msg.end) {
+        int field, wire_type;
+        PackedField contents;
+        if (!read_field(&msg.pos, msg.end, &field, &wire_type, &contents)) return false;
+        if (wire_type != WIRE_LENGTH) {
+            if (!skip_value(&msg.pos, msg.end, wire_type)) return false;
+            continue;
+        }
+        if      (field == DENSE_ID)        group->id = contents;
+        else if (field == DENSE_LAT)       group->lat = contents;
+        else if (field == DENSE_LON)       group->lon = contents;
+        else if (field == DENSE_KEYS_VALS) group->keys_vals = contents;
+        // denseinfo (metadata) is ignored
+    }
+    return packed_ok(&group->id) && packed_ok(&group->lat) && packed_ok(&group->lon) &&
+        packed_ok(&group->keys_vals);
+}
+
+/* Returns false if the group contains anything other than a single DenseNodes message. */
+static bool parse_group (PackedField msg, DenseGroup *group) {
+    bool found_dense = false;
+    while (msg.pos < msg.end) {
+        int field, wire_type;
+        PackedField contents;
+        if (!read_field(&msg.pos, msg.end, &field, &wire_type, &contents)) return false;
+        if (field != GROUP_DENSE || wire_type != WIRE_LENGTH || found_dense) return false;
+        if (!parse_dense(contents, group)) return false;
+        found_dense = true;
+    }
+    return found_dense;
+}
+
+/* Count and then materialize the strings in the table, which point into the inflated buffer. */
+static bool parse_string_table (PackedField msg, ProtobufCAllocator *allocator, DenseBlock *block) {
+    size_t n = 0;
+    for (uint8_t *p = msg.pos; p < msg.end; n++) {
+        int field, wire_type;
+        PackedField s;
+        if (!read_field(&p, msg.end, &field, &wire_type, &s) || field != STRINGTABLE_S) return false;
+    }
+    block->n_strings = n;
+    block->string_table = allocator->alloc(allocator->allocator_data, n * sizeof(ProtobufCBinaryData));
+    if (block->string_table == NULL) return false;
+    for (size_t i = 0; i < n; i++) {
+        int field, wire_type;
+        PackedField s;
+        read_field(&msg.pos, msg.end, &field, &wire_type, &s);
+        block->string_table[i].data = s.pos;
+        block->string_table[i].len = s.end - s.pos;
+    }
+    return true;
+}
+
+/*
+  Locate the parts of an inflated PrimitiveBlock made entirely of DenseNodes groups.
+  Returns false if the block contains anything else or is malformed, in which case the caller 
+  should unpack it with protobuf-c instead.
+*/
+bool dense_block_parse (uint8_t *data, size_t len, ProtobufCAllocator *allocator, DenseBlock *block) {
+    uint8_t *pos = data;
+    uint8_t *end = data + len;
+    block->string_table = NULL;
+    block->n_strings = 0;
+    block->granularity = 100;
+    block->lat_offset = 0;
+    block->lon_offset = 0;
+    block->n_groups = 0;
+    PackedField string_table = {NULL, NULL};
+    while (pos < end) {
+        int field, wire_type;
+        PackedField contents;
+        uint64_t value;
+        if (!read_field(&pos, end, &field, &wire_type, &contents)) return false;
+        if (field == BLOCK_STRINGTABLE && wire_type == WIRE_LENGTH) {
+            string_table = contents;
+        } else if (field == BLOCK_GROUP && wire_type == WIRE_LENGTH) {
+            if (block->n_groups == MAX_DENSE_GROUPS) return false;
+            if (!parse_group(contents, &(block->groups[block->n_groups++]))) return false;
+        } else if (wire_type == WIRE_VARINT && 
+                  (field == BLOCK_GRANULARITY || field == BLOCK_LAT_OFFSET || field == BLOCK_LON_OFFSET)) {
+            if (!read_varint(&pos, end, &value)) return false;
+            if (field == BLOCK_GRANULARITY) block->granularity = (int32_t)value;
+            else if (field == BLOCK_LAT_OFFSET) block->lat_offset = (int64_t)value;
+            else block->lon_offset = (int64_t)value;
+        } else if (!skip_value(&pos, end, wire_type)) {
+            return false;
+        }
+    }
+    if (string_table.pos == NULL || block->n_groups == 0) return false;
+    return parse_string_table(string_table, allocator, block);
+}
+
+/* Count the varints in a packed field: every varint ends in exactly one byte with the high bit clear. */
+static size_t count_varints (PackedField f) {
+    size_t n = 0;
+    for (uint8_t *p = f.pos; p < f.end; p++) n += (*p < 0x80);
+    return n;
+}
+
+/*
+  Decode one DenseNodes group into the columns of a node batch, allocated with the given allocator.
+  Returns false if the allocator runs out of space.
+*/
+bool dense_group_batch (DenseBlock *block, DenseGroup *group, ProtobufCAllocator *allocator, PbfNodeBatch *batch) {
+    void *a = allocator->allocator_data;
+    size_t n = count_varints(group->id);
+    size_t n_kv = count_varints(group->keys_vals);
+    batch->n = n;
+    batch->ids = allocator->alloc(a, n * sizeof(int64_t));
+    batch->lat = allocator->alloc(a, n * sizeof(int64_t));
+    batch->lon = allocator->alloc(a, n * sizeof(int64_t));
+    batch->tag_offsets = allocator->alloc(a, (n + 1) * sizeof(uint32_t));
+    batch->keys = allocator->alloc(a, (n_kv / 2 + 1) * sizeof(uint32_t));
+    batch->vals = allocator->alloc(a, (n_kv / 2 + 1) * sizeof(uint32_t));
+    if (!batch->ids || !batch->lat || !batch->lon || !batch->tag_offsets || !batch->keys || !batch->vals)
+        return false;
+    PackedField id_col = group->id, lat_col = group->lat, lon_col = group->lon, kv_col = group->keys_vals;
+    int64_t granularity = block->granularity;
+    int64_t id = 0;
+    int64_t lat = block->lat_offset;
+    int64_t lon = block->lon_offset;
+    uint32_t n_tags = 0;
+    size_t i;
+    for (i = 0; i < n && lat_col.pos < lat_col.end && lon_col.pos < lon_col.end; i++) {
+        // Coordinates and IDs are delta coded
+        id  += svarint_read(&id_col.pos);
+        lat += svarint_read(&lat_col.pos) * granularity;
+        lon += svarint_read(&lon_col.pos) * granularity;
+        batch->ids[i] = id;
+        batch->lat[i] = lat;
+        batch->lon[i] = lon;
+        batch->tag_offsets[i] = n_tags;
+        // key-val list for each node is terminated with a zero-length string
+        while (kv_col.pos < kv_col.end) {
+            uint32_t k = varint_read(&kv_col.pos);
+            if (k >= block->n_strings || block->string_table[k].len == 0) break;
+            if (kv_col.pos == kv_col.end) break; // key without a value, malformed
+            uint32_t v = varint_read(&kv_col.pos);
+            if (v >= block->n_strings) continue;
+            batch->keys[n_tags] = k;
+            batch->vals[n_tags] = v;
+            n_tags++;
+        }
+    }
+    batch->n = i; // fewer than counted only if the columns have mismatched lengths
+    batch->tag_offsets[i] = n_tags;
+    return true;
+}
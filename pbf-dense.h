@@ -0,0 +1,45 @@
+/* pbf-dense.h : reads DenseNodes straight from the protobuf wire format. */
+#ifndef PBF_DENSE_H_INCLUDED
+#define PBF_DENSE_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "pbf.h"
+
+/* The bytes of one packed repeated field, still in wire format. */
+typedef struct {
+    uint8_t *pos;
+    uint8_t *end;
+} PackedField;
+
+/* The packed columns of one DenseNodes message. */
+typedef struct {
+    PackedField id;
+    PackedField lat;
+    PackedField lon;
+    PackedField keys_vals;
+} DenseGroup;
+
+/* Blocks are normally one group. Anything with more groups goes through protobuf-c. */
+#define MAX_DENSE_GROUPS 8
+
+/*
+  A PrimitiveBlock made only of DenseNodes groups, located within its inflated buffer.
+  Only the string table is materialized (in the caller's allocator). The ids, coordinates and
+  tags are left packed so they can be decoded in a single streaming pass as they are delivered.
+*/
+typedef struct {
+    ProtobufCBinaryData *string_table;
+    size_t n_strings;
+    int32_t granularity;
+    int64_t lat_offset;
+    int64_t lon_offset;
+    int n_groups;
+    DenseGroup groups[MAX_DENSE_GROUPS];
+} DenseBlock;
+
+bool dense_block_parse (uint8_t *data, size_t len, ProtobufCAllocator *allocator, /*OUT*/ DenseBlock *block);
+
+bool dense_group_batch (DenseBlock *block, DenseGroup *group, ProtobufCAllocator *allocator, /*OUT*/ PbfNodeBatch *batch);
+
+#endif /* PBF_DENSE_H_INCLUDED */
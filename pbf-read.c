@@ -3,6 +3,8 @@
 #include "fileformat.pb-c.h"
 #include "osmformat.pb-c.h"
 #include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <string.h>
@@ -12,8 +14,13 @@
 #include <limits.h>
 #include <arpa/inet.h>
 #include <stdbool.h>
-#include "zlib.h"
+#include <pthread.h>
 #include "slab.h"
+#include "pbf-dense.h"
+#include "intpack.h"
+#include "delta.h"
+#include "codec.h"
+#include "pagecache.h"
 
 // sudo apt-get install protobuf-c-compiler libprotobuf-c0-dev zlib1g-dev
 // then compile the protobuf with:
@@ -36,61 +43,82 @@ static int phase;
 
 static void *map;
 static size_t map_size;
+static time_t map_mtime;
+static int map_fd = -1;
+static bool streaming; // input is a pipe or other unmappable file, read sequentially by stream_reader
+static DropBehind map_behind; // releases the pages of the mapped input once they have been delivered
 
+/* Map the input file, or if it is "-" (stdin) or not a regular file, prepare to stream it instead. */
 static void pbf_map(const char *filename) {
-    int fd = open(filename, O_RDONLY);
+    int fd = (strcmp(filename, "-") == 0) ? STDIN_FILENO : open(filename, O_RDONLY);
     if (fd == -1)
         die("could not find input file");
     struct stat st;
-    if (stat(filename, &st) == -1)
+    if (fstat(fd, &st) == -1)
         die("could not stat input file");
+    map_fd = fd;
+    streaming = !S_ISREG(st.st_mode);
+    if (streaming) {
+        map = NULL;
+        map_size = 0;
+        map_mtime = 0;
+        return;
+    }
     map = mmap((void*)0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
     map_size = st.st_size;
+    map_mtime = st.st_mtime;
     if (map == (void*)(-1))
         die("could not map input file");
+    /* The input is read once, front to back. Keep it from evicting the database from the page cache. */
+    pagecache_sequential(map, map_size);
+    drop_behind_init(&map_behind, map, fd, false);
 }
 
 static void pbf_unmap() {
-    munmap(map, map_size);
+    if (!streaming) munmap(map, map_size);
+    if (map_fd != STDIN_FILENO) close(map_fd);
+    map_fd = -1;
 }
 
 // "The uncompressed length of a Blob *should* be less than 16 MiB (16*1024*1024 bytes)
 // and *must* be less than 32 MiB."
-#define MAX_BLOB_SIZE_UNCOMPRESSED 32 * 1024 * 1024
-static unsigned char zbuf[MAX_BLOB_SIZE_UNCOMPRESSED];
-
-// ZLIB has utility (un)compress functions that work on buffers.
-static int zinflate(ProtobufCBinaryData *in, unsigned char *out) {
-    int ret;
-
-    /* initialize inflate state */
-    z_stream strm;
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    strm.avail_in = 0;
-    strm.next_in = Z_NULL;
-    ret = inflateInit(&strm);
-    if (ret != Z_OK)
-        die("zlib init failed");
+#define MAX_BLOB_SIZE_UNCOMPRESSED (32 * 1024 * 1024)
 
-    /* ProtobufCBinaryData is {size_t len; uint8_t *data} */
-    strm.avail_in = in->len;
-    strm.next_in = in->data;
-    strm.avail_out = MAX_BLOB_SIZE_UNCOMPRESSED;
-    strm.next_out = out;
-
-    ret = inflate(&strm, Z_NO_FLUSH);
-    // check ret
-    (void)inflateEnd(&strm);
-    return MAX_BLOB_SIZE_UNCOMPRESSED - strm.avail_out;
-
-}
+/* Whether any callback, single-element or batch, wants each element type. */
+#define WANTS_NODES(c) ((c)->node != NULL || (c)->node_batch != NULL)
+#define WANTS_WAYS(c)  ((c)->way != NULL || (c)->way_batch != NULL)
+#define WANTS_RELATIONS(c) ((c)->relation != NULL)
 
 /* 
-  Enforce (node, way, relation) ordering, and bail out early when possible. 
+  Advance the phase to the given element type, and bail out early when possible. 
   Returns true if loading should terminate due to incorrect ordering or just to save time.
 */
+static bool advance_phase (int element_type, PbfReadCallbacks *callbacks) {
+    if (element_type < phase) {
+        fprintf (stderr, "ERROR: PBF blocks did not follow the order nodes, ways, relations.\n");
+        return true;
+    }
+    if (element_type > phase) {
+        phase = element_type;
+        if (phase == PHASE_NODE && 
+            !WANTS_NODES(callbacks) && !WANTS_WAYS(callbacks) && !WANTS_RELATIONS(callbacks)) {
+            fprintf (stderr, "Skipping the rest of the PBF file, no callbacks were defined.\n");
+            return true;
+        } 
+        if (phase == PHASE_WAY && !WANTS_WAYS(callbacks) && !WANTS_RELATIONS(callbacks)) {
+            fprintf (stderr, "Skipping the rest of the PBF file, only a way callback was defined.\n");
+            return true;
+        } 
+        if (phase == PHASE_RELATION && !WANTS_RELATIONS(callbacks)) {
+            fprintf (stderr, "Skipping the end of the PBF file, no relation callback is defined.\n");
+            return true;
+        } 
+    }
+    /* Phase stayed the same or advanced without triggering an early exit. */
+    return false;
+}
+
+/* Enforce (node, way, relation) ordering for one group, which must hold a single element type. */
 static bool enforce_ordering (OSMPBF__PrimitiveGroup *group, PbfReadCallbacks *callbacks) {
     int n_element_types = 0;
     int element_type = -1;
@@ -110,33 +138,118 @@ static bool enforce_ordering (OSMPBF__PrimitiveGroup *group, PbfReadCallbacks *c
         fprintf (stderr, "ERROR: Block should contain only one element type (nodes, ways, or relations).\n");
         return true;
     }
-    if (element_type < phase) {
-        fprintf (stderr, "ERROR: PBF blocks did not follow the order nodes, ways, relations.\n");
-        return true;
+    return advance_phase (element_type, callbacks);
+}
+
+/* The batches prepared for one group of a block, either of which may be NULL. */
+typedef struct {
+    PbfNodeBatch *nodes;
+    PbfWayBatch *ways;
+} GroupBatches;
+
+/* Batch columns are allocated in the slot's slab along with the block they were decoded from. */
+static void *batch_alloc (ProtobufCAllocator *allocator, size_t size) {
+    void *p = allocator->alloc(allocator->allocator_data, size);
+    if (p == NULL) die("could not allocate batch columns in slab");
+    return p;
+}
+
+/* Copy the tags of one element onto the end of a batch's key and value columns. */
+static uint32_t batch_tags (uint32_t *keys, uint32_t *vals, uint32_t n_tags, 
+                            uint32_t *src_keys, uint32_t *src_vals, size_t n) {
+    for (size_t t = 0; t < n; t++, n_tags++) {
+        keys[n_tags] = src_keys[t];
+        vals[n_tags] = src_vals[t];
     }
-    if (element_type > phase) {
-        phase = element_type;
-        if (phase == PHASE_NODE && 
-            callbacks->node == NULL && callbacks->way == NULL && callbacks->relation == NULL) {
-            fprintf (stderr, "Skipping the rest of the PBF file, no callbacks were defined.\n");
-            return true;
-        } 
-        if (phase == PHASE_WAY && callbacks->way == NULL && callbacks->relation == NULL) {
-            fprintf (stderr, "Skipping the rest of the PBF file, only a way callback was defined.\n");
-            return true;
-        } 
-        if (phase == PHASE_RELATION && callbacks->relation == NULL) {
-            fprintf (stderr, "Skipping the end of the PBF file, no relation callback is defined.\n");
-            return true;
-        } 
+    return n_tags;
+}
+
+/* Build a node batch from a group unpacked by protobuf-c, holding either plain or dense nodes. */
+static PbfNodeBatch *node_batch_from_group (OSMPBF__PrimitiveBlock *block, OSMPBF__PrimitiveGroup *group, 
+                                            ProtobufCAllocator *allocator) {
+    int64_t granularity = block->has_granularity ? block->granularity : 100;
+    int64_t lat_offset = block->has_lat_offset ? block->lat_offset : 0;
+    int64_t lon_offset = block->has_lon_offset ? block->lon_offset : 0;
+    OSMPBF__DenseNodes *dense = group->dense;
+    size_t n = dense ? dense->n_id : group->n_nodes;
+    size_t n_tags_max = 0;
+    if (dense) n_tags_max = dense->n_keys_vals / 2;
+    else for (size_t i = 0; i < n; i++) n_tags_max += group->nodes[i]->n_keys;
+    PbfNodeBatch *batch = batch_alloc(allocator, sizeof(PbfNodeBatch));
+    batch->n = n;
+    batch->ids = batch_alloc(allocator, n * sizeof(int64_t));
+    batch->lat = batch_alloc(allocator, n * sizeof(int64_t));
+    batch->lon = batch_alloc(allocator, n * sizeof(int64_t));
+    batch->tag_offsets = batch_alloc(allocator, (n + 1) * sizeof(uint32_t));
+    batch->keys = batch_alloc(allocator, (n_tags_max + 1) * sizeof(uint32_t));
+    batch->vals = batch_alloc(allocator, (n_tags_max + 1) * sizeof(uint32_t));
+    ProtobufCBinaryData *string_table = block->stringtable->s;
+    uint32_t n_tags = 0;
+    if (dense) {
+        int64_t id = 0, lat = lat_offset, lon = lon_offset;
+        size_t kv = 0;
+        for (size_t i = 0; i < n; i++) {
+            // Coordinates and IDs are delta coded
+            batch->ids[i] = id += dense->id[i];
+            batch->lat[i] = lat += dense->lat[i] * granularity;
+            batch->lon[i] = lon += dense->lon[i] * granularity;
+            batch->tag_offsets[i] = n_tags;
+            // key-val list for each node is terminated with a zero-length string
+            while (kv + 1 < dense->n_keys_vals && string_table[dense->keys_vals[kv]].len > 0) {
+                batch->keys[n_tags] = dense->keys_vals[kv++];
+                batch->vals[n_tags] = dense->keys_vals[kv++];
+                n_tags++;
+            }
+            kv++; // skip zero length string indicating end of k-v pairs for this node
+        }
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            OSMPBF__Node *node = group->nodes[i];
+            batch->ids[i] = node->id;
+            batch->lat[i] = lat_offset + (node->lat * granularity);
+            batch->lon[i] = lon_offset + (node->lon * granularity);
+            batch->tag_offsets[i] = n_tags;
+            n_tags = batch_tags(batch->keys, batch->vals, n_tags, node->keys, node->vals, node->n_keys);
+        }
     }
-    /* Phase stayed the same or advanced without triggering an early exit. */
-    return false;
+    batch->tag_offsets[n] = n_tags;
+    return batch;
+}
+
+/* Build a way batch from a group unpacked by protobuf-c, whose refs decode_slot has made absolute. */
+static PbfWayBatch *way_batch_from_group (OSMPBF__PrimitiveGroup *group, ProtobufCAllocator *allocator) {
+    size_t n = group->n_ways;
+    size_t n_refs = 0, n_tags_max = 0;
+    for (size_t w = 0; w < n; w++) {
+        n_refs += group->ways[w]->n_refs;
+        n_tags_max += group->ways[w]->n_keys;
+    }
+    PbfWayBatch *batch = batch_alloc(allocator, sizeof(PbfWayBatch));
+    batch->n = n;
+    batch->ids = batch_alloc(allocator, n * sizeof(int64_t));
+    batch->ref_offsets = batch_alloc(allocator, (n + 1) * sizeof(uint32_t));
+    batch->refs = batch_alloc(allocator, (n_refs + 1) * sizeof(int64_t));
+    batch->tag_offsets = batch_alloc(allocator, (n + 1) * sizeof(uint32_t));
+    batch->keys = batch_alloc(allocator, (n_tags_max + 1) * sizeof(uint32_t));
+    batch->vals = batch_alloc(allocator, (n_tags_max + 1) * sizeof(uint32_t));
+    uint32_t r = 0, n_tags = 0;
+    for (size_t w = 0; w < n; w++) {
+        OSMPBF__Way *way = group->ways[w];
+        batch->ids[w] = way->id;
+        batch->ref_offsets[w] = r;
+        if (way->n_refs > 0) memcpy(&(batch->refs[r]), way->refs, way->n_refs * sizeof(int64_t));
+        r += way->n_refs;
+        batch->tag_offsets[w] = n_tags;
+        n_tags = batch_tags(batch->keys, batch->vals, n_tags, way->keys, way->vals, way->n_keys);
+    }
+    batch->ref_offsets[n] = r;
+    batch->tag_offsets[n] = n_tags;
+    return batch;
 }
 
 /* Tags are stored in a string table at the PrimitiveBlock level. */
 #define MAX_TAGS 256
-static bool handle_primitive_block(OSMPBF__PrimitiveBlock *block, PbfReadCallbacks *callbacks) {
+static bool handle_primitive_block(OSMPBF__PrimitiveBlock *block, PbfReadCallbacks *callbacks, GroupBatches *batches) {
     ProtobufCBinaryData *string_table = block->stringtable->s;
     int32_t granularity = block->has_granularity ? block->granularity : 100;
     int64_t lat_offset = block->has_lat_offset ? block->lat_offset : 0;
@@ -150,7 +263,12 @@ static bool handle_primitive_block(OSMPBF__PrimitiveBlock *block, PbfReadCallbac
         }
         // fprintf(stderr, "pgroup with %d nodes, %d dense nodes, %d ways, %d relations\n",  group->n_nodes,
         //     group->dense ? group->dense->n_id : 0, group->n_ways, group->n_relations);
-        if (callbacks->way) {
+        if (batches[g].ways != NULL) {
+            (*(callbacks->way_batch))(batches[g].ways, string_table);
+        } else if (batches[g].nodes != NULL) {
+            (*(callbacks->node_batch))(batches[g].nodes, string_table);
+            continue; // nodes only, relations are never in the same group
+        } else if (callbacks->way) {
             for (int w = 0; w < group->n_ways; ++w) {
                 OSMPBF__Way *way = group->ways[w];
                 (*(callbacks->way))(way, string_table);
@@ -219,92 +337,762 @@ static bool handle_primitive_block(OSMPBF__PrimitiveBlock *block, PbfReadCallbac
     return false; // signal not to break iteration, loading should continue
 }
 
-// TODO break out open, read, and close into separate functions
-// TODO store PBF file offsets to each entity type when they are found, allowing repeated calls
-// TODO pbf_read_nodes, pbf_read_ways, pbf_read_relations convenience functions
+/*
+  Deliver the nodes of a block that dense_block_parse located in the inflated buffer, decoding the
+  packed varints and undoing the delta coding in a single pass as each node is handed over.
+*/
+static bool handle_dense_block(DenseBlock *block, PbfReadCallbacks *callbacks, GroupBatches *batches) {
+    ProtobufCBinaryData *string_table = block->string_table;
+    size_t n_strings = block->n_strings;
+    int32_t granularity = block->granularity;
+    for (int g = 0; g < block->n_groups; ++g) {
+        if (advance_phase (PHASE_NODE, callbacks)) {
+            return true; // signal early exit due to improper ordering or callbacks were exhausted
+        }
+        if (batches[g].nodes != NULL) {
+            (*(callbacks->node_batch))(batches[g].nodes, string_table);
+            continue;
+        }
+        if (callbacks->node == NULL) continue;
+        DenseGroup *dense = &(block->groups[g]);
+        PackedField id_col = dense->id, lat_col = dense->lat, lon_col = dense->lon, kv_col = dense->keys_vals;
+        OSMPBF__Node node; // struct reused to carry the data from each dense node
+        uint32_t keys[MAX_TAGS]; // keys and vals reused for string table references
+        uint32_t vals[MAX_TAGS];
+        node.keys = keys;
+        node.vals = vals;
+        int64_t id  = 0;
+        // lat and lon are passed into node callback function in nanodegrees.
+        // offsets are also in nanodegrees.
+        int64_t lat = block->lat_offset;
+        int64_t lon = block->lon_offset;
+        while (id_col.pos < id_col.end && lat_col.pos < lat_col.end && lon_col.pos < lon_col.end) {
+            // Coordinates and IDs are delta coded
+            id  += svarint_read(&id_col.pos);
+            lat += svarint_read(&lat_col.pos) * granularity;
+            lon += svarint_read(&lon_col.pos) * granularity;
+            node.id  = id;
+            node.lat = lat;
+            node.lon = lon;
+            // key-val list for each node is terminated with a zero-length string
+            // blocks without any tags have no keys_vals at all
+            int kv1 = 0; // index into target keys and values array
+            while (kv_col.pos < kv_col.end) {
+                uint32_t k = varint_read(&kv_col.pos);
+                if (k >= n_strings || string_table[k].len == 0) break;
+                if (kv_col.pos == kv_col.end) break; // key without a value, malformed
+                uint32_t v = varint_read(&kv_col.pos);
+                if (v >= n_strings) continue;
+                if (kv1 < MAX_TAGS) { // target buffers are reused and fixed-length
+                    keys[kv1] = k;
+                    vals[kv1] = v;
+                    kv1++;
+                } else {
+                    fprintf (stderr, "skipping tags after number %d.\n", MAX_TAGS);
+                }
+            }
+            node.n_keys = kv1;
+            node.n_vals = kv1;
+            (*(callbacks->node))(&node, string_table);
+        }
+    }
+    return false; // signal not to break iteration, loading should continue
+}
 
-/* Externally visible function. */
-void pbf_read (const char *filename, PbfReadCallbacks *callbacks) {
+/*
+  Decoding blobs (decompression then protobuf unpack) is where loading spends most of its CPU time,
+  and every blob can be decoded independently of the others. So we keep a ring of slots, each with
+  its own inflate buffer and slab, and let a pool of worker threads decode the blobs in those slots
+  while the calling thread delivers finished blocks to the callbacks strictly in file order.
+  With zero worker threads the calling thread decodes each slot itself, one at a time.
+*/
+#define SLOT_EMPTY    0 // available to receive the next blob from the file
+#define SLOT_PENDING  1 // holds a blob waiting for a worker
+#define SLOT_DECODING 2 // a worker is inflating and unpacking the blob
+#define SLOT_DECODED  3 // holds a PrimitiveBlock ready to hand to the callbacks
+
+/*
+  Each slot holds an inflate buffer and a slab, about 40MB, so the ring is capped at about 1GB
+  however many workers there are. More workers than slots would have nothing to decode.
+*/
+#define MAX_READ_SLOTS 24
+
+typedef struct {
+    int state;
+    uint8_t *data; // the packed Blob message, pointing into the input file or owned
+    size_t size;
+    uint8_t *owned; // when streaming, the buffer the slot took from the stream and holds data
+    size_t owned_capacity;
+    uint64_t offset; // where the blob begins in the file, for the index
+    uint32_t total_size;
+    unsigned char *zbuf; // decompressed payload, MAX_BLOB_SIZE_UNCOMPRESSED bytes
+    Slab slab; // holds the unpacked Blob and PrimitiveBlock until they are delivered
+    bool is_dense; // whether the block was located by dense_block_parse instead of unpacked
+    DenseBlock dense;
+    OSMPBF__PrimitiveBlock *block;
+    GroupBatches *batches; // one per group
+} ReadSlot;
+
+/* The callbacks of the read in progress, which tell the workers whether to prepare batches. */
+static PbfReadCallbacks *read_callbacks;
+
+/* Shared state of one threaded read. Slot i holds blob number i modulo the number of slots. */
+static ReadSlot *slots;
+static int n_slots;
+static long next_decode; // the next slot number a worker should take
+static long next_fill;   // the next slot number the reader will fill from the file
+static bool shutting_down;
+static pthread_mutex_t slot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  slot_pending = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  slot_decoded = PTHREAD_COND_INITIALIZER;
+
+/* Decompress (if necessary) and unpack the blob in a slot. Safe to call from any thread. */
+static void decode_slot (ReadSlot *slot) {
+    ProtobufCAllocator *allocator = &(slot->slab.allocator);
+    OSMPBF__Blob *blob = osmpbf__blob__unpack(allocator, slot->size, slot->data);
+    if (blob == NULL)
+        die("error unpacking blob data");
+    uint8_t *bdata;
+    size_t bsize = codec_decode_blob(blob, slot->zbuf, MAX_BLOB_SIZE_UNCOMPRESSED, &bdata);
+    /* Pure DenseNodes blocks are left packed. Everything else goes through protobuf-c. */
+    slot->is_dense = dense_block_parse(bdata, bsize, allocator, &(slot->dense));
+    if (!slot->is_dense) {
+        slot->block = osmpbf__primitive_block__unpack(allocator, bsize, bdata);
+        if (slot->block == NULL)
+            die("error unpacking primitive block");
+    }
+    /* Node refs are delta coded within each way. Make them absolute here on the worker. */
+    if (!slot->is_dense) {
+        for (int g = 0; g < slot->block->n_primitivegroup; g++) {
+            OSMPBF__PrimitiveGroup *group = slot->block->primitivegroup[g];
+            for (int w = 0; w < group->n_ways; w++) {
+                delta_decode(group->ways[w]->refs, group->ways[w]->n_refs, 0);
+            }
+        }
+    }
+    /* Decode columns for any batch callbacks here on the worker, sparing the delivering thread. */
+    int n_groups = slot->is_dense ? slot->dense.n_groups : slot->block->n_primitivegroup;
+    slot->batches = batch_alloc(allocator, n_groups * sizeof(GroupBatches));
+    for (int g = 0; g < n_groups; g++) {
+        GroupBatches *gb = &(slot->batches[g]);
+        gb->nodes = NULL;
+        gb->ways = NULL;
+        if (slot->is_dense) {
+            if (read_callbacks->node_batch == NULL) continue;
+            gb->nodes = batch_alloc(allocator, sizeof(PbfNodeBatch));
+            if (!dense_group_batch(&(slot->dense), &(slot->dense.groups[g]), allocator, gb->nodes))
+                die("could not allocate node batch");
+            continue;
+        }
+        OSMPBF__PrimitiveGroup *group = slot->block->primitivegroup[g];
+        if (read_callbacks->node_batch != NULL && (group->dense || group->n_nodes > 0))
+            gb->nodes = node_batch_from_group(slot->block, group, allocator);
+        if (read_callbacks->way_batch != NULL && group->n_ways > 0)
+            gb->ways = way_batch_from_group(group, allocator);
+    }
+}
+
+/* Worker thread main loop: claim pending slots in order and decode them until told to stop. */
+static void *decode_worker (void *arg) {
+    pthread_mutex_lock(&slot_mutex);
+    while (true) {
+        while (next_decode == next_fill && !shutting_down)
+            pthread_cond_wait(&slot_pending, &slot_mutex);
+        if (next_decode == next_fill) break; // shutting down and no work remains
+        ReadSlot *slot = &(slots[next_decode % n_slots]);
+        next_decode++;
+        slot->state = SLOT_DECODING;
+        pthread_mutex_unlock(&slot_mutex);
+        decode_slot(slot);
+        pthread_mutex_lock(&slot_mutex);
+        slot->state = SLOT_DECODED;
+        pthread_cond_broadcast(&slot_decoded);
+    }
+    pthread_mutex_unlock(&slot_mutex);
+    return NULL;
+}
+
+/* 
+  Read one blob header at buf, returning the position of the following blob header. 
+  The type and location of the packed blob message are returned in the out-parameters.
+  The blob header is unpacked into the shared slab, which the caller must reset.
+*/
+static void *read_blob_header (void *buf, /*OUT*/ char **type, /*OUT*/ uint8_t **data, /*OUT*/ size_t *size) {
+    // header prefixed with 4-byte contain network (big-endian) order message length
+    int32_t msg_length = ntohl(*((int32_t*)buf));
+    buf += sizeof(int32_t);
+    OSMPBF__BlobHeader *blobh = osmpbf__blob_header__unpack(&slabAllocator, msg_length, buf);
+    buf += msg_length;
+    if (blobh == NULL)
+        die("error unpacking blob header");
+    *type = blobh->type;
+    *data = buf;
+    *size = blobh->datasize;
+    return buf + blobh->datasize;
+}
+
+/* The first blob must contain the file header. It is decoded immediately on the calling thread. */
+static OSMPBF__HeaderBlock *read_header_block (uint8_t *data, size_t size) {
+    OSMPBF__Blob *blob = osmpbf__blob__unpack(&slabAllocator, size, data);
+    if (blob == NULL)
+        die("error unpacking blob data");
+    uint8_t *buf = malloc(MAX_BLOB_SIZE_UNCOMPRESSED);
+    if (buf == NULL)
+        die("could not allocate header blob buffer");
+    uint8_t *bdata;
+    size_t bsize = codec_decode_blob(blob, buf, MAX_BLOB_SIZE_UNCOMPRESSED, &bdata);
+    // Header block NOT allocated in slab, as we want it to survive accross iterations.
+    OSMPBF__HeaderBlock *header = osmpbf__header_block__unpack(NULL, bsize, bdata);
+    if (header == NULL)
+        die("failed to read OSM header message from header blob");
+    free(buf);
+    return header;
+}
+
+/*
+  Streaming input, for pipes and stdin which cannot be mapped. A read-ahead thread reads each blob
+  header and blob into the next of a small ring of buffers, so reading overlaps with decoding and
+  delivery. The main thread takes each buffer in turn. An OSMData blob is not copied into its read
+  slot: the slot swaps an empty buffer of its own for the full one, and keeps it until delivery.
+*/
+#define STREAM_BUFFERS 2 // double buffering
+#define MAX_BLOB_HEADER_SIZE (64 * 1024)
+#define MAX_BLOB_SIZE (32 * 1024 * 1024)
+
+typedef struct {
+    char type[32];
+    uint8_t *data;      // the packed Blob message
+    size_t size;
+    size_t capacity;
+    uint64_t offset;    // where the blob header began in the stream
+    uint32_t total_size;
+    bool eof;           // the stream ended cleanly before this buffer
+} StreamBuffer;
+
+static StreamBuffer stream_buffers[STREAM_BUFFERS];
+static long stream_filled; // number of buffers filled by the reader thread
+static long stream_taken;  // number of buffers released by the main thread
+static bool stream_stop;
+static pthread_t stream_thread;
+static pthread_mutex_t stream_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  stream_not_full = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  stream_not_empty = PTHREAD_COND_INITIALIZER;
+
+/* Read exactly len bytes unless the input ends first. Returns the number of bytes read. */
+static size_t read_fully (int fd, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, buf + done, len - done);
+        if (n == 0) break;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            die("error reading PBF input stream");
+        }
+        done += n;
+    }
+    return done;
+}
+
+/* Read one blob header and blob from the stream into a buffer. Returns false at the end of input. */
+static bool stream_read_blob (StreamBuffer *sb, uint64_t offset, Slab *slab) {
+    static uint8_t header_buf[MAX_BLOB_HEADER_SIZE];
+    uint32_t msg_length;
+    size_t got = read_fully(map_fd, &msg_length, sizeof(msg_length));
+    if (got == 0) return false;
+    if (got < sizeof(msg_length))
+        die("PBF input stream ended inside a blob header");
+    msg_length = ntohl(msg_length);
+    if (msg_length > MAX_BLOB_HEADER_SIZE)
+        die("blob header in PBF input stream is too big");
+    if (read_fully(map_fd, header_buf, msg_length) < msg_length)
+        die("PBF input stream ended inside a blob header");
+    OSMPBF__BlobHeader *blobh = osmpbf__blob_header__unpack(&(slab->allocator), msg_length, header_buf);
+    if (blobh == NULL)
+        die("error unpacking blob header");
+    if (blobh->datasize < 0 || blobh->datasize > MAX_BLOB_SIZE)
+        die("blob in PBF input stream is too big");
+    snprintf(sb->type, sizeof(sb->type), "%s", blobh->type);
+    sb->size = blobh->datasize;
+    slab_clear(slab);
+    if (sb->capacity < sb->size) {
+        free(sb->data);
+        sb->data = malloc(sb->size);
+        sb->capacity = sb->size;
+        if (sb->data == NULL) die("could not allocate stream buffer");
+    }
+    if (read_fully(map_fd, sb->data, sb->size) < sb->size)
+        die("PBF input stream ended inside a blob");
+    sb->offset = offset;
+    sb->total_size = sizeof(msg_length) + msg_length + sb->size;
+    return true;
+}
+
+/* The read-ahead thread. It can only be cancelled while blocked reading, never holding the mutex. */
+static void *stream_reader (void *arg) {
+    Slab slab; // blob headers are unpacked here, as the shared slab belongs to the main thread
+    slab_open(&slab, MAX_BLOB_HEADER_SIZE * 4);
+    pthread_cleanup_push((void (*)(void*)) &slab_close, &slab);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    uint64_t offset = 0;
+    while (true) {
+        pthread_mutex_lock(&stream_mutex);
+        while (stream_filled - stream_taken == STREAM_BUFFERS && !stream_stop)
+            pthread_cond_wait(&stream_not_full, &stream_mutex);
+        bool stop = stream_stop;
+        pthread_mutex_unlock(&stream_mutex);
+        if (stop) break;
+        StreamBuffer *sb = &(stream_buffers[stream_filled % STREAM_BUFFERS]);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        sb->eof = !stream_read_blob(sb, offset, &slab);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        offset += sb->eof ? 0 : sb->total_size;
+        pthread_mutex_lock(&stream_mutex);
+        stream_filled++;
+        pthread_cond_signal(&stream_not_empty);
+        pthread_mutex_unlock(&stream_mutex);
+        if (sb->eof) break;
+    }
+    pthread_cleanup_pop(1); // close the slab
+    return NULL;
+}
+
+static void stream_open () {
+    memset(stream_buffers, 0, sizeof(stream_buffers));
+    stream_filled = stream_taken = 0;
+    stream_stop = false;
+    if (pthread_create(&stream_thread, NULL, &stream_reader, NULL) != 0)
+        die("could not start read-ahead thread");
+    fprintf(stderr, "Streaming PBF input with read-ahead.\n");
+}
+
+/* Wait for the next buffer from the read-ahead thread. Returns NULL at the end of the input. */
+static StreamBuffer *stream_next () {
+    pthread_mutex_lock(&stream_mutex);
+    while (stream_filled == stream_taken)
+        pthread_cond_wait(&stream_not_empty, &stream_mutex);
+    pthread_mutex_unlock(&stream_mutex);
+    StreamBuffer *sb = &(stream_buffers[stream_taken % STREAM_BUFFERS]);
+    return sb->eof ? NULL : sb;
+}
+
+/* Hand the buffer returned by stream_next back to the read-ahead thread for refilling. */
+static void stream_release () {
+    pthread_mutex_lock(&stream_mutex);
+    stream_taken++;
+    pthread_cond_signal(&stream_not_full);
+    pthread_mutex_unlock(&stream_mutex);
+}
+
+/* Stop the read-ahead thread, even if it is blocked on a pipe after an early exit, and free the buffers. */
+static void stream_close () {
+    pthread_mutex_lock(&stream_mutex);
+    stream_stop = true;
+    pthread_cond_broadcast(&stream_not_full);
+    pthread_mutex_unlock(&stream_mutex);
+    pthread_cancel(stream_thread);
+    pthread_join(stream_thread, NULL);
+    for (int b = 0; b < STREAM_BUFFERS; b++) free(stream_buffers[b].data);
+}
+
+/*
+  A sidecar index of the OSMData blobs in a PBF file, saved next to it as <filename>.vexidx.
+  Each entry records where a blob is, which element types it holds and the range of IDs it covers.
+  It is built as a side effect of the first read of a file that runs to its end, which is any read
+  with a relation callback. Later reads that only define
+  callbacks for some element types use it to jump straight to the first blob they need and stop 
+  after the last one, so for example a way-only pass never reads or inflates a single node blob.
+*/
+typedef struct {
+    uint64_t offset;  // position of the blob's length prefix in the file
+    uint32_t size;    // total bytes of length prefix, blob header and blob
+    uint8_t  types;   // bit flags (1 << PHASE_X) for each element type present
+    int64_t  min_id;
+    int64_t  max_id;
+} BlobIndexEntry;
+
+#define INDEX_MAGIC "VEXIDX01"
+
+/* The header of the index file. The size and mtime of the PBF file detect stale indexes. */
+typedef struct {
+    char magic[8];
+    uint64_t pbf_size;
+    int64_t pbf_mtime;
+    uint64_t n_entries;
+} BlobIndexHeader;
+
+static BlobIndexEntry *index_entries;
+static size_t n_index_entries;
+static size_t index_capacity;
+
+static char *index_filename (const char *filename) {
+    static char buf[PATH_MAX];
+    if (snprintf(buf, sizeof(buf), "%s.vexidx", filename) >= sizeof(buf))
+        die("PBF file name too long");
+    return buf;
+}
+
+/* Load the index for the currently mapped file. Returns false if there is none or it is stale. */
+static bool index_load (const char *filename) {
+    n_index_entries = 0;
+    FILE *f = fopen(index_filename(filename), "rb");
+    if (f == NULL) return false;
+    BlobIndexHeader h;
+    bool ok = fread(&h, sizeof(h), 1, f) == 1 && memcmp(h.magic, INDEX_MAGIC, 8) == 0
+        && h.pbf_size == map_size && h.pbf_mtime == map_mtime;
+    /* A file with no data blobs has an empty index, which has nothing to allocate or read. */
+    if (ok && h.n_entries == 0) {
+        n_index_entries = 0;
+    } else if (ok) {
+        BlobIndexEntry *entries = realloc(index_entries, h.n_entries * sizeof(BlobIndexEntry));
+        ok = entries != NULL;
+        if (ok) {
+            index_entries = entries;
+            index_capacity = h.n_entries;
+            ok = fread(index_entries, sizeof(BlobIndexEntry), h.n_entries, f) == h.n_entries;
+        }
+        n_index_entries = ok ? h.n_entries : 0;
+    }
+    if (!ok) fprintf(stderr, "Ignoring stale or damaged PBF index.\n");
+    fclose(f);
+    return ok;
+}
+
+/* Save the index entries collected during a complete read. Failure only costs speed later. */
+static void index_save (const char *filename) {
+    FILE *f = fopen(index_filename(filename), "wb");
+    if (f == NULL) {
+        fprintf(stderr, "Could not save PBF index, continuing without one.\n");
+        return;
+    }
+    BlobIndexHeader h;
+    memcpy(h.magic, INDEX_MAGIC, 8);
+    h.pbf_size = map_size;
+    h.pbf_mtime = map_mtime;
+    h.n_entries = n_index_entries;
+    if (fwrite(&h, sizeof(h), 1, f) != 1 ||
+        fwrite(index_entries, sizeof(BlobIndexEntry), n_index_entries, f) != n_index_entries)
+        fprintf(stderr, "Error writing PBF index.\n");
+    fclose(f);
+    fprintf(stderr, "Saved index of %zu PBF blobs.\n", n_index_entries);
+}
+
+/* Append a new index entry for a blob, with no element types or IDs seen yet. */
+static BlobIndexEntry *index_add (uint64_t offset, uint32_t size) {
+    if (n_index_entries == index_capacity) {
+        index_capacity = index_capacity ? index_capacity * 2 : 4096;
+        index_entries = realloc(index_entries, index_capacity * sizeof(BlobIndexEntry));
+        if (index_entries == NULL) die("could not grow PBF index");
+    }
+    BlobIndexEntry *e = &(index_entries[n_index_entries++]);
+    e->offset = offset;
+    e->size = size;
+    e->types = 0;
+    e->min_id = INT64_MAX;
+    e->max_id = INT64_MIN;
+    return e;
+}
+
+static void index_see (BlobIndexEntry *e, int element_type, int64_t id) {
+    e->types |= (1 << element_type);
+    if (id < e->min_id) e->min_id = id;
+    if (id > e->max_id) e->max_id = id;
+}
+
+/* Record the element types and ID range of a block unpacked by protobuf-c. */
+static void index_see_block (BlobIndexEntry *e, OSMPBF__PrimitiveBlock *block) {
+    for (int g = 0; g < block->n_primitivegroup; ++g) {
+        OSMPBF__PrimitiveGroup *group = block->primitivegroup[g];
+        for (int n = 0; n < group->n_nodes; ++n) index_see(e, PHASE_NODE, group->nodes[n]->id);
+        for (int w = 0; w < group->n_ways; ++w) index_see(e, PHASE_WAY, group->ways[w]->id);
+        for (int r = 0; r < group->n_relations; ++r) index_see(e, PHASE_RELATION, group->relations[r]->id);
+        if (group->dense) {
+            int64_t id = 0;
+            for (int n = 0; n < group->dense->n_id; ++n) index_see(e, PHASE_NODE, id += group->dense->id[n]);
+        }
+    }
+}
+
+/* Record the ID range of a block of dense nodes that is still in wire format. */
+static void index_see_dense (BlobIndexEntry *e, DenseBlock *block) {
+    for (int g = 0; g < block->n_groups; ++g) {
+        PackedField ids = block->groups[g].id;
+        int64_t id = 0;
+        while (ids.pos < ids.end) index_see(e, PHASE_NODE, id += svarint_read(&ids.pos));
+    }
+}
+
+/*
+  Use the index to find the range of the file holding the element types that have callbacks.
+  Returns false (leaving the whole file to be read) if there are no callbacks at all.
+*/
+static bool index_range (PbfReadCallbacks *callbacks, /*OUT*/ uint64_t *begin, /*OUT*/ uint64_t *end) {
+    int first_phase = -1, last_phase = -1;
+    if (WANTS_NODES(callbacks))     { if (first_phase < 0) first_phase = PHASE_NODE;     last_phase = PHASE_NODE; }
+    if (WANTS_WAYS(callbacks))      { if (first_phase < 0) first_phase = PHASE_WAY;      last_phase = PHASE_WAY; }
+    if (WANTS_RELATIONS(callbacks)) { if (first_phase < 0) first_phase = PHASE_RELATION; last_phase = PHASE_RELATION; }
+    if (first_phase < 0) return false;
+    uint8_t from_mask = 0xFF << first_phase; // any type at or after the first wanted phase
+    uint8_t upto_mask = (1 << (last_phase + 1)) - 1; // any type at or before the last wanted phase
+    *begin = *end = map_size;
+    for (size_t i = 0; i < n_index_entries; i++) {
+        if (index_entries[i].types & from_mask) {
+            *begin = index_entries[i].offset;
+            break;
+        }
+    }
+    for (size_t i = n_index_entries; i > 0; i--) {
+        BlobIndexEntry *e = &(index_entries[i - 1]);
+        if (e->types & upto_mask) {
+            *end = e->offset + e->size;
+            break;
+        }
+    }
+    if (*end < *begin) *end = *begin;
+    return true;
+}
+
+/* 
+  Externally visible function. Read the file, decoding blobs on n_threads worker threads.
+  Blocks are always handed to the callbacks on the calling thread, in the order they appear in the file.
+  If the file has an up-to-date index, only the blobs containing element types that have callbacks
+  are read. Otherwise the file is read until the callbacks are done, and if that was its end an index
+  is saved for next time.
+*/
+void pbf_read_threaded (const char *filename, PbfReadCallbacks *callbacks, int n_threads) {
+    pbf_read_threaded_from(filename, callbacks, n_threads, 0);
+}
+
+/*
+  Externally visible function. As pbf_read_threaded, but skipping the data blobs before the given
+  file offset, which must be one passed to blob_done by an earlier read of the same file.
+  The header blob is still read. A stream cannot seek, so it is read and discarded up to the offset.
+*/
+void pbf_read_threaded_from (const char *filename, PbfReadCallbacks *callbacks, int n_threads, uint64_t offset) {
     pbf_map(filename);
     slab_init();
+    /* A stream can be neither indexed nor skipped through, so it is always read in full. 
+       A read that skips the beginning of the file cannot build an index either. */
+    bool have_index = !streaming && index_load(filename);
+    bool building_index = !streaming && !have_index && offset == 0;
+    uint64_t begin = 0, end = map_size;
+    if (have_index && index_range(callbacks, &begin, &end)) {
+        fprintf(stderr, "Index allows reading PBF from %ldMB to %ldMB.\n", begin / 1024 / 1024, end / 1024 / 1024);
+    }
+    if (offset > begin) {
+        begin = offset;
+        fprintf(stderr, "Resuming PBF read at %ldMB.\n", begin / 1024 / 1024);
+    }
+    if (streaming) stream_open();
+    if (n_threads < 0) n_threads = 0;
+    /* Two slots per worker keep every worker busy while blocks wait their turn for delivery. */
+    n_slots = (n_threads == 0) ? 1 : n_threads * 2;
+    if (n_slots > MAX_READ_SLOTS) n_slots = MAX_READ_SLOTS;
+    if (n_threads > n_slots) n_threads = n_slots;
+    slots = calloc(n_slots, sizeof(ReadSlot));
+    if (slots == NULL) die("could not allocate read slots");
+    for (int s = 0; s < n_slots; s++) {
+        slots[s].state = SLOT_EMPTY;
+        slots[s].zbuf = malloc(MAX_BLOB_SIZE_UNCOMPRESSED);
+        if (slots[s].zbuf == NULL) die("could not allocate inflate buffer");
+        slab_open(&(slots[s].slab), SLAB_SIZE);
+    }
+    next_decode = next_fill = 0;
+    shutting_down = false;
+    read_callbacks = callbacks;
+    pthread_t *workers = malloc(n_threads * sizeof(pthread_t));
+    for (int t = 0; t < n_threads; t++) {
+        if (pthread_create(&(workers[t]), NULL, &decode_worker, NULL) != 0)
+            die("could not start decoder thread");
+    }
+    if (n_threads > 0)
+        fprintf(stderr, "Decoding PBF blobs on %d threads.\n", n_threads);
+
     OSMPBF__HeaderBlock *header = NULL;
-    int blobcount = 0;
+    long blobcount = 0;
+    long next_deliver = 0;
     phase = PHASE_NODE;
     bool break_iteration = false;
-    for (void *buf = map; buf < map + map_size; ++blobcount) {
-        if (blobcount % 1000 == 0) {
-            fprintf(stderr, "Loading PBF blob %dk (position %ldMB)\n", blobcount/1000, (buf - map) / 1024 / 1024);
+    bool input_done = false; // the end of the file, or the end of the range the index says we need
+    void *buf = map;
+    while (true) {
+        /* Fill every free slot with the next blobs from the file, handing them to the workers. */
+        while (!break_iteration && !input_done) {
+            pthread_mutex_lock(&slot_mutex);
+            bool full = (next_fill - next_deliver == n_slots);
+            pthread_mutex_unlock(&slot_mutex);
+            if (full) break;
+            char *type;
+            uint8_t *data;
+            size_t size;
+            uint64_t blob_offset;
+            uint32_t blob_total_size;
+            StreamBuffer *sb = NULL;
+            if (streaming) {
+                sb = stream_next();
+                if (sb == NULL) {
+                    input_done = true;
+                    break;
+                }
+                type = sb->type;
+                data = sb->data;
+                size = sb->size;
+                blob_offset = sb->offset;
+                blob_total_size = sb->total_size;
+            } else {
+                if (buf >= map + end) {
+                    input_done = true;
+                    break;
+                }
+                void *blob_start = buf;
+                buf = read_blob_header(buf, &type, &data, &size);
+                blob_offset = blob_start - map;
+                blob_total_size = buf - blob_start;
+            }
+            if (blobcount % 1000 == 0) {
+                fprintf(stderr, "Loading PBF blob %ldk (position %ldMB)\n", blobcount/1000, blob_offset / 1024 / 1024);
+            }
+            blobcount++;
+            /* get header block from first blob */
+            if (header == NULL) {
+                if (strcmp(type, "OSMHeader") != 0)
+                    die("expected first blob to be a header");
+                header = read_header_block(data, size);
+                /* Skip over any blobs the index tells us contain nothing we need. */
+                if (!streaming && buf < map + begin) buf = map + begin;
+            } else if (strcmp(type, "OSMData") != 0) {
+                fprintf(stderr, "skipping unrecognized blob type\n");
+            } else if (blob_offset < begin) {
+                /* Only a stream gets here, reading its way up to where a resumed read begins. */
+            } else {
+                /* get an OSM primitive block from subsequent blobs */
+                ReadSlot *slot = &(slots[next_fill % n_slots]);
+                if (streaming) {
+                    /* Take the stream's full buffer, giving it the slot's spare one to refill. */
+                    uint8_t *spare = slot->owned;
+                    size_t spare_capacity = slot->owned_capacity;
+                    slot->owned = sb->data;
+                    slot->owned_capacity = sb->capacity;
+                    sb->data = spare;
+                    sb->capacity = spare_capacity;
+                }
+                slot->data = data;
+                slot->size = size;
+                slot->offset = blob_offset;
+                slot->total_size = blob_total_size;
+                pthread_mutex_lock(&slot_mutex);
+                slot->state = SLOT_PENDING;
+                next_fill++;
+                pthread_cond_signal(&slot_pending);
+                pthread_mutex_unlock(&slot_mutex);
+            }
+            if (streaming) stream_release();
+            slab_reset();
         }
-        /* read blob header */
-        OSMPBF__BlobHeader *blobh;
-        // header prefixed with 4-byte contain network (big-endian) order message length
-        int32_t msg_length = ntohl(*((int*)buf)); // TODO shouldn't this be an exact-width type cast?
-        buf += sizeof(int32_t);
-        blobh = osmpbf__blob_header__unpack(&slabAllocator, msg_length, buf);
-        buf += msg_length;
-        if (blobh == NULL)
-            die("error unpacking blob header");
-
-        /* read blob data */
-        OSMPBF__Blob *blob;
-        blob = osmpbf__blob__unpack(&slabAllocator, blobh->datasize, buf);
-        buf += blobh->datasize;
-        if (blobh == NULL)
-            die("error unpacking blob data");
-
-        /* check if the blob is raw or compressed */
-        uint8_t* bdata;
-        size_t bsize;
-        if (blob->has_zlib_data) {
-            bdata = zbuf;
-            bsize = blob->raw_size;
-            int inflated_size = zinflate(&(blob->zlib_data), zbuf);
-            if (inflated_size != bsize)
-                die("inflated blob size does not match expected size");
-        } else if (blob->has_raw) {
-            fprintf(stderr, "uncompressed\n");
-            bdata = blob->raw.data;
-            bsize = blob->raw.len;
-        } else
-            die("neither compressed nor raw data present in blob");
-
-        /* get header block from first blob */
-        if (header == NULL) {
-            if (strcmp(blobh->type, "OSMHeader") != 0)
-                die("expected first blob to be a header");
-						// Header block NOT allocated in slab, as we want it to survive accross iterations.
-            header = osmpbf__header_block__unpack(NULL, bsize, bdata);
-            if (header == NULL)
-                die("failed to read OSM header message from header blob");
-            goto free_blob;
+        if (next_deliver == next_fill) break; // nothing decoding and nothing left to read
+        /* Deliver the oldest slot, waiting for it to be decoded if necessary. */
+        ReadSlot *slot = &(slots[next_deliver % n_slots]);
+        if (n_threads == 0) {
+            next_decode++;
+            decode_slot(slot);
+        } else {
+            pthread_mutex_lock(&slot_mutex);
+            while (slot->state != SLOT_DECODED)
+                pthread_cond_wait(&slot_decoded, &slot_mutex);
+            pthread_mutex_unlock(&slot_mutex);
         }
-
-        /* get an OSM primitive block from subsequent blobs */
-        if (strcmp(blobh->type, "OSMData") != 0) {
-            fprintf(stderr, "skipping unrecognized blob type\n");
-            goto free_blob;
+        /* After an early exit is signaled, in-flight slots are still waited on but not handled. */
+        if (!break_iteration) {
+            break_iteration = slot->is_dense ? handle_dense_block(&(slot->dense), callbacks, slot->batches)
+                                             : handle_primitive_block(slot->block, callbacks, slot->batches);
+            /* A block whose handler asked to stop may not have been handled completely. */
+            if (!break_iteration && callbacks->blob_done != NULL)
+                (*callbacks->blob_done)(slot->offset + slot->total_size);
+        }
+        if (building_index && !break_iteration) {
+            BlobIndexEntry *e = index_add(slot->offset, slot->total_size);
+            if (slot->is_dense) index_see_dense(e, &(slot->dense));
+            else index_see_block(e, slot->block);
         }
-        
-        OSMPBF__PrimitiveBlock *block;
-        block = osmpbf__primitive_block__unpack(&slabAllocator, bsize, bdata);
-        if (block == NULL)
-            die("error unpacking primitive block");
-        break_iteration = handle_primitive_block(block, callbacks);
-        osmpbf__primitive_block__free_unpacked(block, &slabAllocator);
-
         /* post-iteration cleanup */
-        free_blob:
-        osmpbf__blob_header__free_unpacked(blobh, &slabAllocator);
-        osmpbf__blob__free_unpacked(blob, &slabAllocator);
-        slab_reset();
-        if (break_iteration) break;
+        slab_clear(&(slot->slab));
+        /* Blocks are delivered in file order, so everything up to the end of this one is finished. */
+        if (!streaming) drop_behind(&map_behind, slot->offset + slot->total_size);
+        pthread_mutex_lock(&slot_mutex);
+        slot->state = SLOT_EMPTY;
+        next_deliver++;
+        pthread_mutex_unlock(&slot_mutex);
     }
+
+    /* Stop the workers, which by now are all idle, and release the slots. */
+    pthread_mutex_lock(&slot_mutex);
+    shutting_down = true;
+    pthread_cond_broadcast(&slot_pending);
+    pthread_mutex_unlock(&slot_mutex);
+    for (int t = 0; t < n_threads; t++) pthread_join(workers[t], NULL);
+    free(workers);
+    /* Report how much arena space decoding a block really took, to guide the choice of SLAB_SIZE. */
+    size_t high_water = 0, arena_size = 0;
+    long n_overflows = 0;
+    for (int s = 0; s < n_slots; s++) {
+        Slab *slab = &(slots[s].slab);
+        if (slab->high_water > high_water) high_water = slab->high_water;
+        if (slab->size > arena_size) arena_size = slab->size;
+        n_overflows += slab->n_overflows;
+    }
+    fprintf(stderr, "Decode arenas peaked at %.1fMB per block (%zuMB each now, grown %ld times).\n",
+        high_water / 1024.0 / 1024.0, arena_size / 1024 / 1024, n_overflows);
+    for (int s = 0; s < n_slots; s++) {
+        free(slots[s].zbuf);
+        free(slots[s].owned);
+        slab_close(&(slots[s].slab));
+    }
+    free(slots);
+    if (streaming) stream_close();
+    /* An index is only worth saving if it covers every blob, so a read that stopped early saves none. */
+    if (building_index && !break_iteration && buf >= map + map_size) index_save(filename);
 		// The only thing not allocated by the slab allocator, use default malloc/free.
-    osmpbf__header_block__free_unpacked(header, NULL); 
+    if (header != NULL) osmpbf__header_block__free_unpacked(header, NULL); 
     pbf_unmap();
     slab_done();
 }
 
+/* Read only the given element type, passing on the callbacks for it and dropping all the others. */
+static void pbf_read_only (const char *filename, PbfReadCallbacks *callbacks, int n_threads, int element_type) {
+    PbfReadCallbacks only = *callbacks;
+    if (element_type != PHASE_NODE) {
+        only.node = NULL;
+        only.node_batch = NULL;
+    }
+    if (element_type != PHASE_WAY) {
+        only.way = NULL;
+        only.way_batch = NULL;
+    }
+    if (element_type != PHASE_RELATION) only.relation = NULL;
+    pbf_read_threaded(filename, &only, n_threads);
+}
+
+/*
+  Externally visible functions. Read a single element type, ignoring callbacks for the other two.
+  With an up-to-date index only the blobs holding that type are read. Without one, a node or way pass
+  still stops where the next type begins, but must decode everything before it to get there.
+*/
+void pbf_read_nodes (const char *filename, PbfReadCallbacks *callbacks, int n_threads) {
+    pbf_read_only(filename, callbacks, n_threads, PHASE_NODE);
+}
+
+void pbf_read_ways (const char *filename, PbfReadCallbacks *callbacks, int n_threads) {
+    pbf_read_only(filename, callbacks, n_threads, PHASE_WAY);
+}
+
+void pbf_read_relations (const char *filename, PbfReadCallbacks *callbacks, int n_threads) {
+    pbf_read_only(filename, callbacks, n_threads, PHASE_RELATION);
+}
+
+/* Externally visible function. Read the whole file, decoding all blobs on the calling thread. */
+void pbf_read (const char *filename, PbfReadCallbacks *callbacks) {
+    pbf_read_threaded(filename, callbacks, 0);
+}
+
 /* Example way callback that just counts node references. */
 static long noderefs = 0;
 static void handle_way(OSMPBF__Way *way, ProtobufCBinaryData *string_table) {
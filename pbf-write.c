@@ -13,7 +13,8 @@
 #include <stdio.h>
 #include <limits.h>
 #include <arpa/inet.h>
-#include "zlib.h"
+#include <pthread.h>
+#include "codec.h"
 #include "tags.h"
 #include "dedup.h"
 
@@ -41,141 +42,293 @@ Each OSMData blob contains some optionally zlib-compressed bytes, which contain
 (an independently decompressible block of 8k entities).
 
 We should be able to provide the DenseNodes, and perhaps Sort.Type_then_ID features.
+
+Elements are gathered into blocks by a PbfWriter. Several writers can fill blocks at once on
+different threads, which is how extracts run in parallel. The pbf_write_* functions use a single
+writer belonging to the output file.
+
+Compressing a block takes far longer than filling it, so finished blocks go through a pipeline.
+A block is packed straight into a slot of a ring of blob slots, each with its own payload and output
+buffers, and takes the next sequence number. A pool of compressor threads compresses slots as they
+are filled, while the writers go on filling their next blocks, and blobs are written out strictly in
+sequence order by whichever thread finds the next one ready. So the output has the same blocks in
+the same order as if each block were written as soon as it was filled, and a stage that finishes all
+its blocks before the next stage begins still precedes it in the output. A slot is reused once its
+blob has been written, so a writer only waits when all the slots are in flight. Without compressor
+threads each writer compresses its own blocks, as they were before.
 */
 
 static FILE *out = NULL;
 
-/* Buffers for protobuf packed and zlib compresed data. Max sizes are given by the PBF spec. */
-static uint8_t blob_buffer[16*1024*1024];
-static uint8_t zlib_buffer[16*1024*1024];
-static uint8_t blob_header_buffer[64*1024];
+/* The codec and level used for every blob written. zlib is what all PBF readers understand. */
+static BlobCompression compression = { CODEC_ZLIB, false, 0 };
+
+/* A blob on its way through the pipeline. */
+typedef enum { SLOT_FREE, SLOT_FILLING, SLOT_FILLED, SLOT_COMPRESSING, SLOT_COMPRESSED } SlotState;
+
+typedef struct {
+    SlotState state;
+    uint64_t seq;
+    char *type;
+    size_t payload_len;
+    size_t blob_len;
+    size_t blob_header_len;
+    /* Used to hold the packed version of a header block or data block, passed to the blob encoder. */
+    uint8_t payload_buffer[32*1024*1024];
+    /* Buffers for protobuf packed and compressed data. Max sizes are given by the PBF spec. */
+    uint8_t blob_buffer[16*1024*1024];
+    uint8_t zlib_buffer[16*1024*1024];
+    uint8_t blob_header_buffer[64*1024];
+} BlobSlot;
 
 /*
-  Provide an uncompressed payload.
-  The first blob in the stream should be a header_blob.
-  Its payload is a packed HeaderBlock rather than a packed PrimitiveBlock.
+  Each slot takes up to 64MB once its buffers are touched, so the pipeline has at most this many
+  however many writers and compressors are asked for.
 */
-static void write_one_blob (uint8_t *payload, uint64_t payload_len, char *type, FILE *out) {
-
-    /* Compress the payload. */
-    ProtobufCBinaryData zbd;
-    zbd.data = zlib_buffer;
-    zbd.len = sizeof(zlib_buffer);
-    if (compress(zlib_buffer, &(zbd.len), payload, payload_len) != Z_OK) {
-        fprintf(stderr, "Error while compressing PBF blob payload.");
-        exit(-1);
-    }
+#define MAX_BLOB_SLOTS 24
+
+static BlobSlot **slots = NULL;
+static int n_slots = 0;
+static uint64_t next_seq;   // the sequence number of the next block to be filled
+static uint64_t next_write; // the sequence number of the next blob to be written out
+static bool writing;        // whether some thread is writing blobs out
+static pthread_mutex_t pipeline_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  slot_freed  = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  slot_filled = PTHREAD_COND_INITIALIZER;
+
+/* The compressor pool, and the sizes requested for the pipeline started by pbf_write_begin. */
+static pthread_t *compressors = NULL;
+static int n_compressors = 0;
+static bool compressors_stop;
+static int pipeline_compressors = 0;
+static int pipeline_writers = 1;
+
+/* Blocks of PBF Node and Way structs for creating primitive blocks. */
+#define PBF_BLOCK_SIZE 8000
+
+/* An array of string table indexes to store all the keys and vals in a block. */
+#define MAX_KEYS_VALS 1024 * 1024
 
-    /* Create and pack the blob itself. */
+struct PbfWriter {
+    OSMPBF__Node      node_block   [PBF_BLOCK_SIZE];
+    OSMPBF__Node     *node_block_p [PBF_BLOCK_SIZE];
+    OSMPBF__Way       way_block    [PBF_BLOCK_SIZE];
+    OSMPBF__Way      *way_block_p  [PBF_BLOCK_SIZE];
+    OSMPBF__Relation  rel_block    [PBF_BLOCK_SIZE];
+    OSMPBF__Relation *rel_block_p  [PBF_BLOCK_SIZE];
+
+    /* Number of nodes/ways/relations now stored in each block. */
+    uint32_t node_block_count;
+    uint32_t way_block_count;
+    uint32_t rel_block_count;
+
+    uint32_t kv_buff[MAX_KEYS_VALS];
+    size_t kv_n;
+
+    /* The string table of the block being filled. */
+    Dedup *dedup;
+};
+
+/* The writer used by the pbf_write_* functions. */
+static PbfWriter *writer = NULL;
+
+/* Compress a slot's payload into a blob, and pack the blob and its header. */
+static void compress_slot (BlobSlot *slot) {
+
+    /* Create the blob, compressing the payload into it, and pack it. */
     OSMPBF__Blob blob;
     osmpbf__blob__init(&blob);
-    blob.zlib_data = zbd;
-    blob.has_zlib_data = true;
-    blob.raw_size = payload_len;  // spec: "Only set when compressed, to the uncompressed size"
-    blob.has_raw_size = true;
-    size_t blob_packed_length = osmpbf__blob__pack(&blob, blob_buffer);
+    codec_encode_blob(&compression, slot->payload_buffer, slot->payload_len,
+                      slot->zlib_buffer, sizeof(slot->zlib_buffer), &blob);
+    slot->blob_len = osmpbf__blob__pack(&blob, slot->blob_buffer);
 
     /* Make a header for this blob. */
     OSMPBF__BlobHeader blob_header;
     osmpbf__blob_header__init(&blob_header);
-    blob_header.type = type;
-    blob_header.datasize = blob_packed_length; // spec: "serialized size of the subsequent Blob message"
+    blob_header.type = slot->type;
+    blob_header.datasize = slot->blob_len; // spec: "serialized size of the subsequent Blob message"
     // TODO check packed size before packing
-    size_t blob_header_packed_length = osmpbf__blob_header__pack(&blob_header, blob_header_buffer);
-
-    /* Write the basic recurring PBF unit: blob header length, blob header, blob. */
-    uint32_t bhpl_net = htonl(blob_header_packed_length);
-    fwrite(&bhpl_net, 4, 1, out);
-    fwrite(&blob_header_buffer, blob_header_packed_length, 1, out);
-    fwrite(&blob_buffer, blob_packed_length, 1, out);
+    slot->blob_header_len = osmpbf__blob_header__pack(&blob_header, slot->blob_header_buffer);
 
     /*
     fprintf(stderr, "%s blob written:\n", type);
     fprintf(stderr, "payload length (raw)     %ld\n", payload_len);
-    fprintf(stderr, "payload length (zipped)  %ld\n", zbd.len);
     fprintf(stderr, "packed length of body    %zd\n", blob_packed_length);
     fprintf(stderr, "packed length of header  %zd\n", blob_header_packed_length);
     */
 
 }
 
-/* Blocks of PBF Node and Way structs for creating primitive blocks. */
-#define PBF_BLOCK_SIZE 8000
-static OSMPBF__Node      node_block   [PBF_BLOCK_SIZE];
-static OSMPBF__Node     *node_block_p [PBF_BLOCK_SIZE];
-static OSMPBF__Way       way_block    [PBF_BLOCK_SIZE];
-static OSMPBF__Way      *way_block_p  [PBF_BLOCK_SIZE];
-static OSMPBF__Relation  rel_block    [PBF_BLOCK_SIZE];
-static OSMPBF__Relation *rel_block_p  [PBF_BLOCK_SIZE];
-
-/* Number of nodes/ways/relations now stored in each block. */
-static uint32_t node_block_count;
-static uint32_t way_block_count;
-static uint32_t rel_block_count;
+/*
+  Write out every compressed blob that is next in sequence, unless another thread is already doing so.
+  Called with the pipeline mutex held, which is released while writing.
+*/
+static void write_ready_blobs () {
+    if (writing) return;
+    writing = true;
+    while (true) {
+        BlobSlot *slot = slots[next_write % n_slots];
+        if (slot->state != SLOT_COMPRESSED || slot->seq != next_write) break;
+        pthread_mutex_unlock(&pipeline_mutex);
+        /* Write the basic recurring PBF unit: blob header length, blob header, blob. */
+        uint32_t bhpl_net = htonl(slot->blob_header_len);
+        fwrite(&bhpl_net, 4, 1, out);
+        fwrite(slot->blob_header_buffer, slot->blob_header_len, 1, out);
+        fwrite(slot->blob_buffer, slot->blob_len, 1, out);
+        pthread_mutex_lock(&pipeline_mutex);
+        slot->state = SLOT_FREE;
+        next_write++;
+        pthread_cond_broadcast(&slot_freed);
+    }
+    writing = false;
+}
+
+/* Take the slot for the next block in sequence, waiting until the blob last in it has been written. */
+static BlobSlot *take_slot () {
+    pthread_mutex_lock(&pipeline_mutex);
+    uint64_t seq = next_seq++;
+    BlobSlot *slot = slots[seq % n_slots];
+    while (slot->state != SLOT_FREE) pthread_cond_wait(&slot_freed, &pipeline_mutex);
+    slot->state = SLOT_FILLING;
+    slot->seq = seq;
+    pthread_mutex_unlock(&pipeline_mutex);
+    return slot;
+}
+
+/*
+  Provide an uncompressed payload, packed into the given slot.
+  The first blob in the stream should be a header_blob.
+  Its payload is a packed HeaderBlock rather than a packed PrimitiveBlock.
+*/
+static void write_one_blob (BlobSlot *slot, uint64_t payload_len, char *type) {
+    slot->type = type;
+    slot->payload_len = payload_len;
+    if (n_compressors == 0) {
+        compress_slot(slot);
+        pthread_mutex_lock(&pipeline_mutex);
+        slot->state = SLOT_COMPRESSED;
+        write_ready_blobs();
+    } else {
+        pthread_mutex_lock(&pipeline_mutex);
+        slot->state = SLOT_FILLED;
+        pthread_cond_signal(&slot_filled);
+    }
+    pthread_mutex_unlock(&pipeline_mutex);
+}
+
+/* Compressor thread main loop: compress filled slots, earliest first, until told to stop. */
+static void *compressor (void *arg) {
+    pthread_mutex_lock(&pipeline_mutex);
+    while (true) {
+        BlobSlot *slot = NULL;
+        for (int s = 0; s < n_slots; s++) {
+            if (slots[s]->state == SLOT_FILLED && (slot == NULL || slots[s]->seq < slot->seq)) slot = slots[s];
+        }
+        if (slot == NULL) {
+            if (compressors_stop) break;
+            pthread_cond_wait(&slot_filled, &pipeline_mutex);
+            continue;
+        }
+        slot->state = SLOT_COMPRESSING;
+        pthread_mutex_unlock(&pipeline_mutex);
+        compress_slot(slot);
+        pthread_mutex_lock(&pipeline_mutex);
+        slot->state = SLOT_COMPRESSED;
+        write_ready_blobs();
+    }
+    pthread_mutex_unlock(&pipeline_mutex);
+    return NULL;
+}
+
+/* Allocate the blob slots and start the compressor pool. Untouched slot buffers take no memory. */
+static void start_pipeline () {
+    n_compressors = pipeline_compressors;
+    /* Room for every writer to fill a block while each compressor has one in hand and one waiting. */
+    n_slots = pipeline_writers + 2 * n_compressors;
+    if (n_slots > MAX_BLOB_SLOTS) n_slots = MAX_BLOB_SLOTS;
+    /* Writers beyond the number of slots wait their turn for one, but spare compressors would idle. */
+    if (n_compressors > n_slots / 2) n_compressors = n_slots / 2;
+    slots = malloc(n_slots * sizeof(BlobSlot *));
+    if (slots == NULL) exit(EXIT_FAILURE);
+    for (int s = 0; s < n_slots; s++) {
+        slots[s] = malloc(sizeof(BlobSlot));
+        if (slots[s] == NULL) {
+            fprintf(stderr, "Could not allocate PBF blob buffers.\n");
+            exit(EXIT_FAILURE);
+        }
+        slots[s]->state = SLOT_FREE;
+    }
+    next_seq = 0;
+    next_write = 0;
+    writing = false;
+    compressors_stop = false;
+    if (n_compressors > 0) {
+        compressors = malloc(n_compressors * sizeof(pthread_t));
+        if (compressors == NULL) exit(EXIT_FAILURE);
+        for (int t = 0; t < n_compressors; t++) {
+            if (pthread_create(&(compressors[t]), NULL, &compressor, NULL) != 0) {
+                fprintf(stderr, "Could not start PBF compressor thread.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+}
 
 /* protobuf-c API takes arrays of pointers to structs. Initialize those arrays once at startup. */
-static void initialize_pointer_arrays() {
-    OSMPBF__Way      *wp = &(way_block[0]);
-    OSMPBF__Node     *np = &(node_block[0]);
-    OSMPBF__Relation *rp = &(rel_block[0]);
+static void initialize_pointer_arrays(PbfWriter *w) {
+    OSMPBF__Way      *wp = &(w->way_block[0]);
+    OSMPBF__Node     *np = &(w->node_block[0]);
+    OSMPBF__Relation *rp = &(w->rel_block[0]);
     for (int i = 0; i < PBF_BLOCK_SIZE; i++) {
-        way_block_p[i]  = wp++;
-        node_block_p[i] = np++;
-        rel_block_p[i]  = rp++;
+        w->way_block_p[i]  = wp++;
+        w->node_block_p[i] = np++;
+        w->rel_block_p[i]  = rp++;
     }
-    node_block_count = 0;
-    way_block_count = 0;
+    w->node_block_count = 0;
+    w->way_block_count = 0;
 }
 
 /* Free all dynamically allocated arrays, and reset the block length to zero. */
-static void reset_node_block() {
-    node_block_count = 0;
+static void reset_node_block(PbfWriter *w) {
+    w->node_block_count = 0;
 }
 
 /* Free all dynamically allocated node reference arrays, and reset the block length to zero. */
-static void reset_way_block() {
-    for (int w = 0; w < node_block_count; w++) {
-        // per-way references array dynamically allocated in pbf_write_way
-        free(way_block[w].refs); 
+static void reset_way_block(PbfWriter *w) {
+    for (int i = 0; i < w->way_block_count; i++) {
+        // per-way references array dynamically allocated in pbf_writer_way
+        free(w->way_block[i].refs);
     }
-    way_block_count = 0;
+    w->way_block_count = 0;
 }
 
 /* Free all dynamically allocated relation member arrays, and reset the block length to zero. */
-static void reset_rel_block () {
-    for (int r = 0; r < rel_block_count; r++) {
-        // These per-relation arrays are all dynamically allocated in pbf_write_relation
-        free (rel_block[r].roles_sid);
-        free (rel_block[r].memids);
-        free (rel_block[r].types);
+static void reset_rel_block (PbfWriter *w) {
+    for (int r = 0; r < w->rel_block_count; r++) {
+        // These per-relation arrays are all dynamically allocated in pbf_writer_relation
+        free (w->rel_block[r].roles_sid);
+        free (w->rel_block[r].memids);
+        free (w->rel_block[r].types);
     }
-    rel_block_count = 0;
+    w->rel_block_count = 0;
 }
 
-/* An array of string table indexes to store all the keys and vals in a block. */
-#define MAX_KEYS_VALS 1024 * 1024
-static uint32_t kv_buff[MAX_KEYS_VALS];
-static size_t kv_n = 0;
-
 /* Allocate a chunk of n string pointers for tag keys or values. A suballocator, in fact. */
-static uint32_t *kv_alloc(size_t n) {
-    if (kv_n + n > MAX_KEYS_VALS) {
+static uint32_t *kv_alloc(PbfWriter *w, size_t n) {
+    if (w->kv_n + n > MAX_KEYS_VALS) {
         fprintf(stderr, "too many key/val string table references in a block.\n");
         return NULL;
     }
-    uint32_t *ret = &(kv_buff[kv_n]);
-    kv_n += n;
+    uint32_t *ret = &(w->kv_buff[w->kv_n]);
+    w->kv_n += n;
     return ret;
 }
 
 /* Free all allocated tag key/value string pointers. */
-static void kv_free_all() {
-    kv_n = 0;
+static void kv_free_all(PbfWriter *w) {
+    w->kv_n = 0;
 }
 
-/* Used to hold the packed version of a header block or data block, passed to the blob encoder. */
-static uint8_t payload_buffer[32*1024*1024];
-
 static void write_pbf_header_blob () {
 
     /* First blob is a header blob (payload is a HeaderBlock). */
@@ -185,14 +338,15 @@ static void write_pbf_header_blob () {
     hblock.required_features = features;
     hblock.n_required_features = 2;
     hblock.writingprogram = "VEX";
-    size_t payload_len = osmpbf__header_block__pack(&hblock, payload_buffer);
-    write_one_blob (payload_buffer, payload_len, "OSMHeader", out);
+    BlobSlot *slot = take_slot();
+    size_t payload_len = osmpbf__header_block__pack(&hblock, slot->payload_buffer);
+    write_one_blob (slot, payload_len, "OSMHeader");
 
 }
 
 /* Write one data blob containing any buffered ways, nodes, or relations. */
 // TODO make entity types mutually exclusive (write only one type per block) so enum rather than bool
-static void write_pbf_data_blob (bool nodes, bool ways, bool rels) {
+static void write_pbf_data_blob (PbfWriter *w, bool nodes, bool ways, bool rels) {
 
     OSMPBF__PrimitiveBlock pblock;
     osmpbf__primitive_block__init(&pblock);
@@ -204,35 +358,36 @@ static void write_pbf_data_blob (bool nodes, bool ways, bool rels) {
     pgroups[0] = &pgroup;
     pblock.primitivegroup = pgroups;
     pblock.n_primitivegroup = 1;
-    pblock.stringtable = Dedup_string_table(); // table will be deallocated by Dedup_clear call
+    pblock.stringtable = Dedup_string_table(w->dedup); // table will be deallocated by Dedup_clear call
     // We don't use any of the other block-level features (offsets, granularity, etc.)
 
-    if (nodes && node_block_count > 0) {
+    if (nodes && w->node_block_count > 0) {
         fprintf(stderr, "Writing data blob containing nodes.\n");
-        pgroup.nodes = node_block_p;
-        pgroup.n_nodes = node_block_count;
+        pgroup.nodes = w->node_block_p;
+        pgroup.n_nodes = w->node_block_count;
     }
-    if (ways && way_block_count > 0) {
+    if (ways && w->way_block_count > 0) {
         fprintf(stderr, "Writing data blob containing ways.\n");
-        pgroup.ways = way_block_p;
-        pgroup.n_ways = way_block_count;
+        pgroup.ways = w->way_block_p;
+        pgroup.n_ways = w->way_block_count;
     }
-    if (rels && rel_block_count > 0) {
+    if (rels && w->rel_block_count > 0) {
         fprintf(stderr, "Writing data blob containing relations.\n");
-        pgroup.relations = rel_block_p;
-        pgroup.n_relations = rel_block_count;
+        pgroup.relations = w->rel_block_p;
+        pgroup.n_relations = w->rel_block_count;
     }
 
-    size_t payload_len = osmpbf__primitive_block__pack(&pblock, payload_buffer);
-    write_one_blob (payload_buffer, payload_len, "OSMData", out);
+    BlobSlot *slot = take_slot();
+    size_t payload_len = osmpbf__primitive_block__pack(&pblock, slot->payload_buffer);
+    write_one_blob (slot, payload_len, "OSMData");
 
     /* We always produce one pgroup per pblock, one pblock per data blob. */
-    //Dedup_print();
-    Dedup_clear(); // restart a new string table for each blob
-    if (nodes) reset_node_block();
-    if (ways) reset_way_block();
-    if (rels) reset_rel_block();
-    kv_free_all(); 
+    //Dedup_print(w->dedup);
+    Dedup_clear(w->dedup); // restart a new string table for each blob
+    if (nodes) reset_node_block(w);
+    if (ways) reset_way_block(w);
+    if (rels) reset_rel_block(w);
+    kv_free_all(w); 
     // FIXME this is freeing the kv table even when only one of nodes/ways has been written...
     // We should force one entity type per block throughout vex.
 }
@@ -241,7 +396,7 @@ static void write_pbf_data_blob (bool nodes, bool ways, bool rels) {
 // TODO clearly there can be only one file at a time, just make that a static variable
 
 /* Return the number of tags loaded. Save string table indexes into the arrays in the last two params. */
-static size_t load_tags(uint8_t *coded_tags, /*OUT*/ uint32_t **keys, /*OUT*/ uint32_t **vals) {
+static size_t load_tags(PbfWriter *w, uint8_t *coded_tags, /*OUT*/ uint32_t **keys, /*OUT*/ uint32_t **vals) {
 
     /* First count tags. */
     size_t n_tags = 0;
@@ -255,15 +410,15 @@ static size_t load_tags(uint8_t *coded_tags, /*OUT*/ uint32_t **keys, /*OUT*/ ui
     // or we should prefix the list with a varint length.
 
     /* Then copy string table indexes of keys and values into a subsection of the kv buffer. */
-    uint32_t *kbuf = kv_alloc(n_tags);
-    uint32_t *vbuf = kv_alloc(n_tags);
+    uint32_t *kbuf = kv_alloc(w, n_tags);
+    uint32_t *vbuf = kv_alloc(w, n_tags);
     n_tags = 0;
     t = (char*) coded_tags;
     while (*t != INT8_MAX) {
         KeyVal kv;
         t += decode_tag(t, &kv);
-        kbuf[n_tags] = Dedup_dedup(kv.key);
-        vbuf[n_tags] = Dedup_dedup(kv.val);
+        kbuf[n_tags] = Dedup_dedup(w->dedup, kv.key);
+        vbuf[n_tags] = Dedup_dedup(w->dedup, kv.val);
         n_tags++;
     }
 
@@ -274,92 +429,142 @@ static size_t load_tags(uint8_t *coded_tags, /*OUT*/ uint32_t **keys, /*OUT*/ ui
 }
 
 
+/*
+  PUBLIC Choose the compression for blobs written from now on, given as "codec" or "codec:level",
+  for example "zstd:9". Returns false if the codec is unknown or not compiled into this build.
+*/
+bool pbf_write_compression (const char *spec) {
+    return codec_parse(spec, &compression);
+}
+
+/*
+  PUBLIC Make a writer gathering elements into blocks of its own, for use by one thread at a time.
+  The buffers are large, but allocated untouched, so only the parts actually used take up memory.
+*/
+PbfWriter *pbf_writer_new () {
+    PbfWriter *w = calloc(1, sizeof(PbfWriter));
+    if (w == NULL) {
+        fprintf(stderr, "Could not allocate PBF writer.\n");
+        exit(EXIT_FAILURE);
+    }
+    initialize_pointer_arrays(w);
+    w->dedup = Dedup_new();
+    return w;
+}
+
+/* PUBLIC Free a writer, which must have been flushed. */
+void pbf_writer_free (PbfWriter *w) {
+    Dedup_free(w->dedup);
+    free(w);
+}
+
+/*
+  PUBLIC Compress blobs on n_compressors threads while the blocks after them are filled, with room
+  for n_writers writers to fill blocks at once. Takes effect at the next pbf_write_begin. With no
+  compressor threads, each block is compressed by the thread that filled it.
+*/
+void pbf_write_pipeline (int n_compressors, int n_writers) {
+    pipeline_compressors = (n_compressors > 0) ? n_compressors : 0;
+    pipeline_writers = (n_writers > 1) ? n_writers : 1;
+}
+
 /* PUBLIC Begin writing a PBF file, and perform some setup. */
 void pbf_write_begin (FILE *out_file) {
     out = out_file;
-    initialize_pointer_arrays();
+    if (writer == NULL) writer = pbf_writer_new();
+    start_pipeline();
     write_pbf_header_blob();
-    Dedup_init();
+}
+
+/*
+  PUBLIC Wait for every blob to be written out, and stop the compressor pool. Call after the last
+  flush of every writer, and before closing the output file.
+*/
+void pbf_write_end () {
+    pthread_mutex_lock(&pipeline_mutex);
+    while (next_write < next_seq) pthread_cond_wait(&slot_freed, &pipeline_mutex);
+    compressors_stop = true;
+    pthread_cond_broadcast(&slot_filled);
+    pthread_mutex_unlock(&pipeline_mutex);
+    for (int t = 0; t < n_compressors; t++) pthread_join(compressors[t], NULL);
+    free(compressors);
+    compressors = NULL;
+    n_compressors = 0;
+    for (int s = 0; s < n_slots; s++) free(slots[s]);
+    free(slots);
+    slots = NULL;
+    n_slots = 0;
 }
 
 
 /* PUBLIC Write out a block for any objects remaining in the buffer. Call at the end of output. */
-void pbf_write_flush() {
-    if (node_block_count > 0 || way_block_count > 0 || rel_block_count > 0) {
-        write_pbf_data_blob (true, true, true);
+void pbf_writer_flush(PbfWriter *w) {
+    if (w->node_block_count > 0 || w->way_block_count > 0 || w->rel_block_count > 0) {
+        write_pbf_data_blob (w, true, true, true);
     }
 }
 
 
 /* PUBLIC Write one way in a buffered fashion, writing out a blob as needed (every 8k objects). */
-void pbf_write_way (int64_t way_id, int64_t *refs, uint8_t *coded_tags) {
+void pbf_writer_way (PbfWriter *w, int64_t way_id, int64_t *refs, size_t n_refs, uint8_t *coded_tags) {
 
     /*
-      We must copy the refs list, and cannot use it directly:
-      It contains negative sentinel values and is not delta coded.
-      First, count number of node refs in this way.
+      We must copy the refs list, and cannot use it directly: it is not delta coded, and it
+      belongs to the caller, which may reuse it before the block is written.
     */
-    size_t n_refs = 1;
-    for (int64_t *r = refs; *r >= 0; r++) {
-        n_refs++;
-    }
-
-    /* Delta code refs, copying them into a dynamically allocated buffer. */
     int64_t *refs_buf = malloc(n_refs * sizeof(int64_t)); // deallocated in reset_way_block
     if (refs_buf == NULL) exit (-1);
     int64_t prev_ref = 0;
     for (int i = 0; i < n_refs; i++) {
-        int64_t ref = refs[i];
-        if (ref < 0) ref = -ref; // should only happen on the last ref in the list
-        refs_buf[i] = ref - prev_ref; // refs within a way are delta coded
-        prev_ref = ref;
+        refs_buf[i] = refs[i] - prev_ref; // refs within a way are delta coded
+        prev_ref = refs[i];
     }
 
     /* Grab an unused OSMPBF Way struct from the block. */
-    OSMPBF__Way *way = &(way_block[way_block_count]);
+    OSMPBF__Way *way = &(w->way_block[w->way_block_count]);
     osmpbf__way__init(way);
     way->id = way_id;
     way->refs = refs_buf;
     way->n_refs = n_refs;
 
     /* Load Tags */
-    size_t n_tags = load_tags(coded_tags, &(way->keys), &(way->vals));
+    size_t n_tags = load_tags(w, coded_tags, &(way->keys), &(way->vals));
     way->n_keys = n_tags;
     way->n_vals = n_tags;
 
     /* Write out a block if we've filled the buffer. */
-    way_block_count++;
-    if (way_block_count == PBF_BLOCK_SIZE) {
-        write_pbf_data_blob(false, true, false);
+    w->way_block_count++;
+    if (w->way_block_count == PBF_BLOCK_SIZE) {
+        write_pbf_data_blob(w, false, true, false);
     }
 
 }
 
 
 /* PUBLIC Write one node in a buffered fashion, writing out a blob as needed (every 8k objects). */
-void pbf_write_node (int64_t node_id, double lat, double lon, uint8_t *coded_tags) {
+void pbf_writer_node (PbfWriter *w, int64_t node_id, double lat, double lon, uint8_t *coded_tags) {
 
-    OSMPBF__Node *node = &(node_block[node_block_count]);
+    OSMPBF__Node *node = &(w->node_block[w->node_block_count]);
     osmpbf__node__init(node);
     node->id = node_id;
     // lat and lon are in nanodegrees, and default granularity grid is 100 nanodegrees
     node->lat = (int64_t)(lat * 10000000);
     node->lon = (int64_t)(lon * 10000000);
 
-    size_t n_tags = load_tags(coded_tags, &(node->keys), &(node->vals));
+    size_t n_tags = load_tags(w, coded_tags, &(node->keys), &(node->vals));
     node->n_keys = n_tags;
     node->n_vals = n_tags;
 
     /* Write out a block if we've filled the buffer. */
-    node_block_count++;
-    if (node_block_count == PBF_BLOCK_SIZE) {
-        write_pbf_data_blob (true, false, false);
+    w->node_block_count++;
+    if (w->node_block_count == PBF_BLOCK_SIZE) {
+        write_pbf_data_blob (w, true, false, false);
     }
 
 }
 
 /* PUBLIC Write one relation in a buffered fashion, writing one blob as needed (8k objects). */
-void pbf_write_relation (int64_t rel_id, RelMember *members, uint8_t *coded_tags) {
+void pbf_writer_relation (PbfWriter *w, int64_t rel_id, RelMember *members, uint8_t *coded_tags) {
 
     /* Count the number of members in this relation, assuming there is at least one. */
     size_t n_members = 1;
@@ -383,12 +588,12 @@ void pbf_write_relation (int64_t rel_id, RelMember *members, uint8_t *coded_tags
         // Member IDs within a relation are delta coded in PBF output
         memid_buf[i] = id - last_id; 
         last_id = id;
-        roles_sid_buf[i] = Dedup_dedup (decode_role (m->role));
+        roles_sid_buf[i] = Dedup_dedup (w->dedup, decode_role (m->role));
         types_buf[i] = m->element_type;
     }
 
     /* Grab an unused OSMPBF Relation struct from the block. */
-    OSMPBF__Relation *rel = &(rel_block[rel_block_count]);
+    OSMPBF__Relation *rel = &(w->rel_block[w->rel_block_count]);
     osmpbf__relation__init (rel);
 
     /* The parallel member arrays in the OSMPBF relation struct are all the same length. */
@@ -399,16 +604,32 @@ void pbf_write_relation (int64_t rel_id, RelMember *members, uint8_t *coded_tags
     rel->roles_sid = roles_sid_buf;
     
     /* Decode the tags for this relation into Protobuf-c parallel arrays. */
-    size_t n_tags = load_tags (coded_tags, &(rel->keys), &(rel->vals));
+    size_t n_tags = load_tags (w, coded_tags, &(rel->keys), &(rel->vals));
     rel->n_keys = n_tags;
     rel->n_vals = n_tags;
 
     /* Write out a block if we've filled the buffer. */
-    rel_block_count++;
-    if (rel_block_count == PBF_BLOCK_SIZE) {
-        write_pbf_data_blob (false, false, true);
+    w->rel_block_count++;
+    if (w->rel_block_count == PBF_BLOCK_SIZE) {
+        write_pbf_data_blob (w, false, false, true);
     }
     
 } 
 
+/* PUBLIC The same operations on the output file's own writer. */
+void pbf_write_flush() {
+    pbf_writer_flush (writer);
+}
+
+void pbf_write_way (int64_t way_id, int64_t *refs, size_t n_refs, uint8_t *coded_tags) {
+    pbf_writer_way (writer, way_id, refs, n_refs, coded_tags);
+}
+
+void pbf_write_node (int64_t node_id, double lat, double lon, uint8_t *coded_tags) {
+    pbf_writer_node (writer, node_id, lat, lon, coded_tags);
+}
+
+void pbf_write_relation (int64_t rel_id, RelMember *members, uint8_t *coded_tags) {
+    pbf_writer_relation (writer, rel_id, members, coded_tags);
+}
 
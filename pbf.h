@@ -4,12 +4,53 @@
 #include "fileformat.pb-c.h"
 #include "osmformat.pb-c.h"
 #include <stdio.h> // for FILE
+#include <stdbool.h>
 
-/* This bundles together callback functions for reading the three main OSM element types. */
+/*
+  A whole PrimitiveGroup of nodes as parallel columns, with all delta coding already undone.
+  lat and lon are in nanodegrees. The tags of node i are the string table indexes in keys and vals
+  from tag_offsets[i] up to (not including) tag_offsets[i + 1].
+*/
+typedef struct {
+    size_t n;
+    int64_t *ids;
+    int64_t *lat;
+    int64_t *lon;
+    uint32_t *tag_offsets; // n + 1 entries
+    uint32_t *keys;
+    uint32_t *vals;
+} PbfNodeBatch;
+
+/*
+  A whole PrimitiveGroup of ways as parallel columns. The absolute node IDs referenced by way i are
+  refs[ref_offsets[i]] up to refs[ref_offsets[i + 1]], and its tags are found as for nodes.
+*/
+typedef struct {
+    size_t n;
+    int64_t *ids;
+    uint32_t *ref_offsets; // n + 1 entries
+    int64_t *refs;
+    uint32_t *tag_offsets; // n + 1 entries
+    uint32_t *keys;
+    uint32_t *vals;
+} PbfWayBatch;
+
+/* 
+  This bundles together callback functions for reading the three main OSM element types. 
+  The optional batch callbacks receive a whole group of nodes or ways at once, and take the place of
+  the single-element callback for that type when both are defined. Set unused callbacks to NULL.
+  The refs of every way are absolute node IDs by the time they reach a callback, not delta coded.
+  The optional blob_done callback is called after each data blob has been handed to the others, with
+  the file offset of the next blob, from which a read that stopped there could later be resumed. It is
+  not called for a blob whose callback stopped the read, which may not have been handled completely.
+*/
 typedef struct {
     void (*way)      (OSMPBF__Way*,      ProtobufCBinaryData *string_table);
     void (*node)     (OSMPBF__Node*,     ProtobufCBinaryData *string_table);
     void (*relation) (OSMPBF__Relation*, ProtobufCBinaryData *string_table);
+    void (*node_batch) (PbfNodeBatch*,   ProtobufCBinaryData *string_table);
+    void (*way_batch)  (PbfWayBatch*,    ProtobufCBinaryData *string_table);
+    void (*blob_done)  (uint64_t next_offset);
 } PbfReadCallbacks;
 
 /* This bundles together callback functions for writing the three main OSM element types. (incomplete) */
@@ -35,12 +76,32 @@ typedef struct {
 
 /* PUBLIC READ FUNCTIONS */
 void pbf_read(const char *filename, PbfReadCallbacks *callbacks);
+void pbf_read_threaded(const char *filename, PbfReadCallbacks *callbacks, int n_threads);
+void pbf_read_threaded_from(const char *filename, PbfReadCallbacks *callbacks, int n_threads, uint64_t offset);
+void pbf_read_nodes(const char *filename, PbfReadCallbacks *callbacks, int n_threads);
+void pbf_read_ways(const char *filename, PbfReadCallbacks *callbacks, int n_threads);
+void pbf_read_relations(const char *filename, PbfReadCallbacks *callbacks, int n_threads);
 
 /* PUBLIC WRITE FUNCTIONS */
+bool pbf_write_compression(const char *spec);
+void pbf_write_pipeline(int n_compressors, int n_writers);
 void pbf_write_begin(FILE *out);
-void pbf_write_way(int64_t way_id, int64_t *refs, uint8_t *coded_tags);
+void pbf_write_way(int64_t way_id, int64_t *refs, size_t n_refs, uint8_t *coded_tags);
 void pbf_write_node(int64_t node_id, double lat, double lon, uint8_t *coded_tags);
 void pbf_write_relation(int64_t relation_id, RelMember *members, uint8_t *coded_tags);
 void pbf_write_flush();
+void pbf_write_end();
+
+/*
+  A PbfWriter gathers elements into blocks of its own, so that several threads can each fill one
+  and write out whole blobs to the same output file. Only the pbf_write_begin output is supported.
+*/
+typedef struct PbfWriter PbfWriter;
+PbfWriter *pbf_writer_new();
+void pbf_writer_free(PbfWriter *w);
+void pbf_writer_way(PbfWriter *w, int64_t way_id, int64_t *refs, size_t n_refs, uint8_t *coded_tags);
+void pbf_writer_node(PbfWriter *w, int64_t node_id, double lat, double lon, uint8_t *coded_tags);
+void pbf_writer_relation(PbfWriter *w, int64_t relation_id, RelMember *members, uint8_t *coded_tags);
+void pbf_writer_flush(PbfWriter *w);
 
 #endif /* PBF_H_INCLUDED */
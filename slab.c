@@ -4,50 +4,142 @@
    All sub-allocations are freed at once by simply moving the pointer back to the beginning of the slab.
    This works well in a loop where the number of allocations is bounded and they all go out of scope at once.
    Anecdotally gives a ~10% speedup on Protobuf decoding.
+
+   When the main block is not big enough, further chunks are chained on as needed and freed at the
+   next clear, which then also enlarges the main block so that the same load fits next time.
+   The high-water mark of each slab shows what size it really needs.
 */
 
 #include <stdlib.h>
+#include <stdio.h>
 #include "pbf.h"
+#include "slab.h"
 
-// Allocate 8MB once and slice it up.
-#define SLAB_SIZE (8 * 1024 * 1024)
+// All allocations are rounded up to keep the next one aligned for any protobuf-c field type.
+#define SLAB_ALIGN 8
 
-static void *slab;
-static void *next;
-static void *limit;
+/* 
+  Chain a new chunk onto the slab, big enough for at least size bytes. Requests bigger than the main 
+  block get a chunk to themselves, leaving the current chunk in use for the allocations that follow.
+*/
+static void *slab_grow (Slab *slab, size_t size) {
+    bool dedicated = size >= slab->size;
+    size_t chunk_size = dedicated ? size : slab->size;
+    SlabChunk *chunk = malloc(sizeof(SlabChunk) + chunk_size);
+    if (chunk == NULL) return NULL;
+    chunk->prev = slab->chunks;
+    chunk->size = chunk_size;
+    slab->chunks = chunk;
+    void *mem = chunk + 1;
+    if (dedicated) {
+        slab->spilled += size;
+    } else {
+        slab->spilled += slab->next - slab->start;
+        slab->start = mem;
+        slab->next = mem + size;
+        slab->limit = mem + chunk_size;
+    }
+    return mem;
+}
 
-void slab_init () {
-    slab = malloc(SLAB_SIZE);
-	limit = slab + SLAB_SIZE;
-    next = slab;
+static void *slab_alloc (void *allocator_data, size_t size) {
+    Slab *slab = allocator_data;
+    size = (size + SLAB_ALIGN - 1) & ~((size_t)SLAB_ALIGN - 1);
+    if (size > slab->limit - slab->next) {
+        return slab_grow(slab, size);
+    }
+    void *ret = slab->next;
+    slab->next += size;
+    return ret;
 }
 
-void slab_reset () {
+static void slab_free (void *allocator_data, void *pointer) {
+    // Do nothing. All allocations will be freed at once.
+}
+
+/* Allocate the backing memory for a slab, and point its protobuf-c allocator at it. */
+void slab_open (Slab *slab, size_t size) {
+    slab->base = malloc(size);
+    if (slab->base == NULL) {
+        fprintf(stderr, "Could not allocate slab.\n");
+        exit(EXIT_FAILURE);
+    }
+    slab->size = size;
+    slab->start = slab->next = slab->base;
+    slab->limit = slab->base + size;
+    slab->chunks = NULL;
+    slab->spilled = 0;
+    slab->high_water = 0;
+    slab->n_clears = 0;
+    slab->n_overflows = 0;
+    slab->allocator.alloc = &slab_alloc;
+    slab->allocator.free = &slab_free;
+    slab->allocator.allocator_data = slab;
+}
+
+/* The number of bytes allocated from the slab since it was last cleared. */
+size_t slab_used (Slab *slab) {
+    return slab->spilled + (slab->next - slab->start);
+}
+
+/* Free the chained chunks, if any, and return the main block to its original state. */
+static void slab_release_chunks (Slab *slab) {
+    while (slab->chunks != NULL) {
+        SlabChunk *prev = slab->chunks->prev;
+        free(slab->chunks);
+        slab->chunks = prev;
+    }
+    slab->spilled = 0;
+    slab->start = slab->next = slab->base;
+    slab->limit = slab->base + slab->size;
+}
+
+void slab_clear (Slab *slab) {
+    size_t used = slab_used(slab);
+    if (used > slab->high_water) slab->high_water = used;
+    slab->n_clears++;
+    if (slab->chunks != NULL) {
+        slab->n_overflows++;
+        slab_release_chunks(slab);
+        /* Replace the main block with one that would have held everything. Keep the old one on failure. */
+        size_t size = slab->size;
+        while (size < used) size *= 2;
+        void *bigger = malloc(size);
+        if (bigger != NULL) {
+            free(slab->base);
+            slab->base = bigger;
+            slab->size = size;
+        }
+    }
     // Bulk free of all allocations.
-    next = slab;
-}   
- 
-void slab_done () {
+    slab->start = slab->next = slab->base;
+    slab->limit = slab->base + slab->size;
+}
+
+void slab_close (Slab *slab) {
 	// Clean up be freeing the slab itself.
-    free(slab);
+    slab_release_chunks(slab);
+    free(slab->base);
+    slab->base = slab->start = slab->next = slab->limit = NULL;
 }
 
-static void *slab_alloc (void *allocator_data, size_t size) {
-	if (next >= limit) {
-		return NULL;
-	}
-    void *ret = next;
-    next += size;
-    return ret;
+/* The shared slab, used through the slabAllocator below. */
+static Slab shared;
+
+void slab_init () {
+    slab_open(&shared, SLAB_SIZE);
 }
 
-static void slab_free (void *allocator_data, void *pointer) {
-    // Do nothing. All allocations will be freed at once.
+void slab_reset () {
+    slab_clear(&shared);
+}   
+ 
+void slab_done () {
+    slab_close(&shared);
 }
 
 ProtobufCAllocator slabAllocator = {
     .alloc = &slab_alloc, 
     .free = &slab_free, 
-    .allocator_data = NULL
+    .allocator_data = &shared
 };
-
@@ -1,7 +1,48 @@
 /* slab.h */
+#ifndef SLAB_H_INCLUDED
+#define SLAB_H_INCLUDED
 
 #include "pbf.h"
 
+// Allocate 8MB once and slice it up.
+#define SLAB_SIZE (8 * 1024 * 1024)
+
+/* An extra chunk of memory chained onto a slab that ran out of room, followed by its contents. */
+typedef struct SlabChunk {
+    struct SlabChunk *prev;
+    size_t size;
+} SlabChunk;
+
+/*
+  One arena. The ProtobufCAllocator embedded in each slab carries a pointer back to the slab,
+  so protobuf-c (un)packing can be pointed at any number of independent arenas, one per thread.
+  When the main block fills up, extra chunks are chained on until the next slab_clear.
+*/
+typedef struct {
+    void *base;
+    size_t size;       // size of the main block at base
+    void *start;       // beginning of the block or chunk allocations are currently taken from
+    void *next;
+    void *limit;
+    SlabChunk *chunks; // most recently added extra chunk, or NULL
+    size_t spilled;    // bytes allocated before the current chunk, since the last clear
+    /* Usage statistics, accumulated over the life of the slab. */
+    size_t high_water; // most bytes in use at once
+    long n_clears;
+    long n_overflows;  // clears at which extra chunks had been needed
+    ProtobufCAllocator allocator;
+} Slab;
+
+void slab_open (Slab *slab, size_t size);
+
+void slab_clear (Slab *slab);
+
+void slab_close (Slab *slab);
+
+size_t slab_used (Slab *slab);
+
+/* A single shared slab for code that only ever decodes on one thread. */
+
 void slab_init ();
 
 void slab_reset ();
@@ -9,3 +50,5 @@ void slab_reset ();
 void slab_done ();
 
 extern ProtobufCAllocator slabAllocator;
+
+#endif /* SLAB_H_INCLUDED */
@@ -5,11 +5,16 @@
 #include <sys/file.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <google/protobuf-c/protobuf-c.h> // contains varint functions
@@ -17,14 +22,12 @@
 #include "pbf.h"
 #include "tags.h"
 #include "idtracker.h"
-
-// 14 bits -> 1.7km at 45 degrees
-// 13 bits -> 3.4km at 45 degrees
-// at 45 degrees cos(pi/4)~=0.7
-// TODO maybe shift one more bit off of y to make bins more square
-#define GRID_BITS 14
-/* The width and height of the grid root is 2^bits. */
-#define GRID_DIM (1 << GRID_BITS)
+#include "pagecache.h"
+#include "grid.h"
+#include "osc.h"
+#include "map.h"
+#include "nodestore.h"
+#include "delta.h"
 
 /*
   https://taginfo.openstreetmap.org/reports/database_statistics
@@ -44,21 +47,41 @@
 #define MAX_REL_MEMBERS  100000000
 #define MAX_REL_ID        20000000
 
-/* Assume there are as many active node references as there are active and deleted nodes. */
-// This is going to fail - many nodes are referenced twice, and our node ref offsets are uint32s.
-// These could be addressed in blocks like ways, which can be referenced from both ways and grid cells.
-// Or the ID space of ways can be partitioned, yielding multiple node_refs files.
-#define MAX_NODE_REFS MAX_NODE_ID
-
-/* Way reference block size is based on the typical number of ways per grid cell. */
-#define WAY_BLOCK_SIZE 32
+/* Ways are indexed in every grid cell they touch, on average fewer than two. */
+#define MAX_INDEXED_WAYS (2 * MAX_WAY_ID)
 
-/* Assume one-fifth as many blocks as cells in the grid. Observed number is ~15000000 blocks. */
-#define MAX_WAY_BLOCKS (GRID_DIM * GRID_DIM / 5)
+/*
+  Assume there are as many active node references as there are active and deleted nodes. They are
+  stored as varint deltas between neighbouring nodes of a way, which are usually one to three bytes,
+  so leave room for four bytes per reference.
+*/
+#define MAX_NODE_REFS MAX_NODE_ID
+#define MAX_NODE_REF_BYTES (MAX_NODE_REFS * 4)
+
+/* Only about 2.5% of nodes have tags, so leave room for 10% of the node ID space to be tagged. */
+#define MAX_NODE_TAGS (MAX_NODE_ID / 10)
+/* The sparse node tag index has one directory entry per this many bits of node ID space. */
+#define NODE_TAG_BLOCK_BITS 8
+#define MAX_NODE_TAG_BLOCKS ((MAX_NODE_ID >> NODE_TAG_BLOCK_BITS) + 1)
+/* Nodes that gain tags through applied changes, and so could not be placed in ID order. */
+#define MAX_NODE_TAG_OVERFLOW 100000000
+
+/* The reverse index from relation members to relations has one directory entry per block of member IDs. */
+#define NODE_PARENT_BLOCK_BITS 8
+#define WAY_PARENT_BLOCK_BITS 4
+#define MAX_NODE_PARENT_BLOCKS ((MAX_NODE_ID >> NODE_PARENT_BLOCK_BITS) + 1)
+#define MAX_WAY_PARENT_BLOCKS ((MAX_WAY_ID >> WAY_PARENT_BLOCK_BITS) + 1)
+
+/* The block node store, with room for six bytes of compressed coordinates per node ID. */
+#define MAX_NODE_BLOCKS ((MAX_NODE_ID >> NODE_BLOCK_BITS) + 1)
+#define MAX_NODE_BLOCK_DATA (MAX_NODE_ID * 6)
 
 /* If true, then loaded file should not be persisted to disk. */
 static bool in_memory;
 
+/* If true, the database is only being read, and its files are opened and mapped read-only. */
+static bool read_only;
+
 /*
   Define the sequence in which elements are read and written, while allowing element types as
   function parameters and array indexes.
@@ -70,12 +93,6 @@ static bool in_memory;
 /* The location where we will save all files. This can be set using a command line parameter. */
 static const char *database_path;
 
-/* Compact geographic position. Latitude and longitude mapped to the signed 32-bit int range. */
-typedef struct {
-    int32_t x;
-    int32_t y;
-} coord_t;
-
 /* Convert double-precision floating point latitude and longitude to internal representation. */
 static void to_coord (/*OUT*/ coord_t *coord, double lat, double lon) {
     coord->x = (lon * INT32_MAX) / 180;
@@ -92,37 +109,32 @@ static double get_lon (coord_t *coord) {
     return ((double) coord->x) * 180 / INT32_MAX;
 }
 
-/* 
-  A block of way references. Chained together to record which ways begin in each grid cell. 
-  Way references can still be stored in signed 32 bit integers since there are not as many of 
-  them as there are nodes. If the last reference in a block is negative, it indicates how many
-  slots are unused at the end of the block. New empty way blocks for a particular grid cell are 
-  inserted at the head of the list, so even when the head block is not completely full it may
-  point to a next block.
-*/
-typedef struct {
-    int32_t refs[WAY_BLOCK_SIZE];
-    uint32_t next; // the index of the next way block in the chain, or zero if there is no next way block.
-} WayBlock;
-
 /*
-  A single OSM node. An array of 2^64 these serves as a map from node ids to nodes.
-  OSM assigns node IDs sequentially, so you only need about the first 2^32 entries as of 2014.
+  OSM nodes are stored as two structures. An array of coords indexed by node ID gives every node's
+  position (or, in databases loaded with VEX_NODE_STORE=blocks, the block compressed node store). OSM assigns node IDs sequentially, so you only need about the first 2^32 entries as of 2014.
   Note that when nodes are deleted their IDs are not reused, so there are holes in
   this range, but sparse file support in the filesystem should take care of that.
   "Deleted node ids must not be reused, unless a former node is now undeleted."
+  Only a few nodes have tags, so their tag offsets are kept apart in a sparse index of NodeTags
+  sorted by node ID, rather than padding every coord with an offset that is almost always zero.
 */
 typedef struct {
-    coord_t coord; // compact internal representation of latitude and longitude
+    uint32_t id;   // the low 32 bits of the node ID, the rest being implied by its place in the index
     uint32_t tags; // byte offset into the packed tags array where this node's tag list begins
-} Node;
+} NodeTag;
+
+/* A node tag offset that had to be stored outside the sorted index. */
+typedef struct {
+    int64_t id;
+    uint32_t tags;
+} NodeTagOverflow;
 
 /*
   A single OSM way. Like nodes, way IDs are assigned sequentially, so a zero-indexed array of these
   serves as a map from way IDs to ways.
 */
 typedef struct {
-    uint32_t node_ref_offset; // the index of the first node in this way's node list
+    uint64_t node_ref_offset; // the byte offset of this way's encoded node list in node_refs
     uint32_t tags; // byte offset into the packed tags array where this node's tag list begins
 } Way;
 
@@ -135,25 +147,60 @@ typedef struct {
     uint32_t member_offset; // the index of the first member in this relation's member list
     uint32_t tags; // byte offset into the packed tags array where this relation's tag list begins
     uint32_t next; // the index of the next relation in this grid cell
+    uint32_t cell; // one plus the grid_cell_index of the grid cell listing this relation, or zero if none
 } Relation;
 
-/* Indexes for the first block of nodes and the first relation in each grid cell. */
+/*
+  An entry in the reverse index from member nodes and ways to the relations holding them. Each entry
+  is in a chain through the entries for all the members in one block of IDs, so it records which
+  member it is for.
+*/
 typedef struct {
-    uint32_t head_way_block;
-    uint32_t head_relation;
-} GridCell;
+    uint32_t relation; // the ID of the relation holding the member
+    uint32_t member;   // the ID of the member node or way
+    uint32_t next;     // the index of the next entry in the chain, or zero at its end
+} RelParent;
 
 /*
-  The spatial index grid. A node's grid bin is determined by right-shifting its coordinates.
-  Initially this was a multi-level grid, but it turns out to work fine as a single level.
-  Rather than being directly composed of way reference blocks, there is a level of indirection
-  because the grid is mostly empty due to ocean and wilderness. 
-  TODO eliminate coastlines etc.
-  TODO struct is no longer necessary because this is not a compound type.
+  A bounding box of a way or relation, quantized to 2^16 steps in each direction (about 600m at the
+  equator) so that it takes only eight bytes. Each edge is the step containing the extreme coordinate,
+  so the quantized box always contains the real one. Extracts use these to skip ways and relations
+  in the cells along the edges of the requested area that do not reach into it.
 */
 typedef struct {
-    GridCell cells[GRID_DIM][GRID_DIM]; // contains indexes to way_blocks and relations
-} Grid;
+    uint16_t min_x;
+    uint16_t min_y;
+    uint16_t max_x;
+    uint16_t max_y;
+} BBox;
+
+static const BBox bbox_empty = { UINT16_MAX, UINT16_MAX, 0, 0 };
+static const BBox bbox_world = { 0, 0, UINT16_MAX, UINT16_MAX };
+
+/* The step containing an x or y coordinate. Unlike grid bins, steps increase with signed coordinates. */
+static uint16_t bbox_step (int32_t xy) {
+    return ((uint32_t)(xy) ^ 0x80000000) >> 16;
+}
+
+static void bbox_add_coord (BBox *bbox, coord_t coord) {
+    uint16_t x = bbox_step(coord.x);
+    uint16_t y = bbox_step(coord.y);
+    if (x < bbox->min_x) bbox->min_x = x;
+    if (y < bbox->min_y) bbox->min_y = y;
+    if (x > bbox->max_x) bbox->max_x = x;
+    if (y > bbox->max_y) bbox->max_y = y;
+}
+
+static void bbox_add_bbox (BBox *bbox, BBox *other) {
+    if (other->min_x < bbox->min_x) bbox->min_x = other->min_x;
+    if (other->min_y < bbox->min_y) bbox->min_y = other->min_y;
+    if (other->max_x > bbox->max_x) bbox->max_x = other->max_x;
+    if (other->max_y > bbox->max_y) bbox->max_y = other->max_y;
+}
+
+static bool bbox_intersects (BBox *a, BBox *b) {
+    return a->min_x <= b->max_x && b->min_x <= a->max_x && a->min_y <= b->max_y && b->min_y <= a->max_y;
+}
 
 /* Print human readable representation based on multiples of 1024 into a static buffer. */
 static char human_buffer[128];
@@ -210,6 +257,32 @@ static char *make_db_path (const char *name, uint32_t subfile) {
     return path_buf;
 }
 
+/* The descriptors of all files mapped so far, which are kept open so they can be flushed. */
+#define MAX_MAPPED_FILES 64
+static int mapped_fds[MAX_MAPPED_FILES];
+static int n_mapped_fds = 0;
+
+/*
+  Map an existing database file read-only, at the size it has on disk rather than the size a writer
+  would reserve, which it can never exceed. Nothing is created or resized, so the database can be
+  on a read-only mount or snapshot, and any number of processes can extract from it at once,
+  sharing its pages in the page cache.
+*/
+static void *map_file_read_only (const char *name, uint32_t subfile, size_t size, /*OUT*/ int *fd_out) {
+    make_db_path (name, subfile);
+    int fd = in_memory ? shm_open(path_buf, O_RDONLY, 0) : open(path_buf, O_RDONLY);
+    if (fd == -1) die ("Could not open database file. Was the database loaded completely?");
+    struct stat st;
+    if (fstat(fd, &st) != 0) die ("Could not get database file size.");
+    if (st.st_size == 0 || st.st_size >= size) die ("Database file does not have the expected size.");
+    fprintf(stderr, "Mapping file '%s' of size %sB read-only.\n", path_buf, human(st.st_size));
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+        die("Could not memory map file.");
+    if (fd_out != NULL) *fd_out = -1; // there are no written pages to manage
+    return base;
+}
+
 /*
   Map a file in the database directory into memory, letting the OS handle paging.
   Note that we cannot reliably re-map a file to the same memory address, so the files should not
@@ -229,7 +302,8 @@ static char *make_db_path (const char *name, uint32_t subfile) {
   Creating 100GB of empty file by calling truncate() does not increase the disk usage.
   The files appear to have their full size using 'ls', but 'du' reveals that no blocks are in use.
 */
-void *map_file(const char *name, uint32_t subfile, size_t size) {
+void *map_file_fd(const char *name, uint32_t subfile, size_t size, /*OUT*/ int *fd_out) {
+    if (read_only) return map_file_read_only(name, subfile, size, fd_out);
     make_db_path (name, subfile);
     int fd;
     if (in_memory) {
@@ -245,9 +319,30 @@ void *map_file(const char *name, uint32_t subfile, size_t size) {
         die("Could not memory map file.");
     if (ftruncate (fd, size - 1)) // resize file
         die ("Error resizing file.");
+    /* Shared memory objects have no backing file, so there is nothing to manage in the page cache. */
+    if (fd_out != NULL) *fd_out = in_memory ? -1 : fd;
+    if (!in_memory) {
+        if (n_mapped_fds == MAX_MAPPED_FILES) die ("Too many mapped files.");
+        mapped_fds[n_mapped_fds++] = fd;
+    }
     return base;
 }
 
+/*
+  Flush every mapped file to disk. On Linux this includes the pages that were written through the
+  mappings, so everything stored so far survives even if the system goes down.
+*/
+static void sync_mapped_files () {
+    for (int f = 0; f < n_mapped_fds; f++) {
+        if (fdatasync(mapped_fds[f]) != 0) die ("Could not flush database file to disk.");
+    }
+}
+
+/* Map a file without keeping track of its descriptor, which stays open until exit. */
+void *map_file(const char *name, uint32_t subfile, size_t size) {
+    return map_file_fd(name, subfile, size, NULL);
+}
+
 /* Open a buffered FILE in the current working directory for writing, performing some checks. */
 FILE *open_output_file(const char *name, uint8_t subfile) {
     fprintf(stderr, "Opening file '%s' for binary writing.\n", name);
@@ -257,45 +352,227 @@ FILE *open_output_file(const char *name, uint8_t subfile) {
 }
 
 /* Arrays of memory-mapped structs. This is where we store the bulk of our data. */
-Grid      *grid;
-Node      *nodes;
+coord_t   *coords;
+NodeTag   *node_tags;
+uint32_t  *node_tag_dir;     // the index in node_tags of the first node in or after each block of node IDs
+NodeTagOverflow *node_tag_overflow;
 Way       *ways;
-WayBlock  *way_blocks;
 Relation  *relations;
 RelMember *rel_members;
-int64_t   *node_refs;        // A negative node_ref marks the end of a list of refs.
+BBox      *way_bboxes;       // The bounding box of each way, indexed by way ID.
+BBox      *relation_bboxes;  // The bounding box of each relation, indexed by relation ID.
+RelParent *rel_parents;      // The reverse index from relation members to relations, see link_relation_parents.
+uint32_t  *node_parent_dir;  // The first entry in rel_parents for each block of node IDs.
+uint32_t  *way_parent_dir;   // The first entry in rel_parents for each block of way IDs.
+uint8_t   *node_refs;        // The encoded node lists of all ways, see node_refs_encode.
 uint32_t  n_rel_members = 1; // The number of relation members currently used. start at 1 since zero marks the end of lists.
-uint32_t  n_node_refs = 0;   // The number of node refs currently used.
-// FIXME n_node_refs will eventually overflow. The fact that it's unsigned gives us a little slack.
+uint32_t  n_rel_parents = 1; // The number of reverse index entries used, also starting at 1.
+uint64_t  n_node_ref_bytes = 1; // The number of bytes of node_refs used. start at 1 so a zero offset means no way.
+uint32_t  n_node_tags = 0;   // The number of entries in the node tag index.
+uint32_t  n_node_tag_blocks = 0; // The number of blocks of node IDs whose directory entries are set.
+uint32_t  n_node_tag_overflow = 0;
 // FIXME the n_vars were not initialized before?
 
+/* Whether node coordinates are kept in the block compressed node store rather than the coords array. */
+static bool node_store_blocks = false;
+
+static coord_t node_coord (int64_t node_id) {
+    return node_store_blocks ? node_store_get (node_id) : coords[node_id];
+}
+
+/* Set the coordinates of a node outside the parallel node ingest. */
+static void set_node_coord (int64_t node_id, coord_t coord) {
+    if (node_store_blocks) node_store_put (node_id, coord);
+    else coords[node_id] = coord;
+}
+
+/*
+  The sparse node tag index. Tagged nodes are appended in ID order while loading, and the directory
+  records where each block of 2^NODE_TAG_BLOCK_BITS node IDs begins in the index, so finding a node
+  means scanning the handful of tagged nodes in its block. A directory entry is set once the first
+  tagged node in or after its block has been appended, so blocks beyond n_node_tag_blocks are known
+  to be empty, and the last block set extends to the end of the index.
+  Applying changes can give tags to nodes that had none, which cannot then be inserted in ID order.
+  They are appended to an overflow file instead, which is read into a hash map whenever the database
+  is opened after a load.
+*/
+static Map *node_tag_map = NULL;
+static int64_t last_tagged_node = -1; // the ID of the last node in the index, once it is known
+
+/* Get the ID of the last node in the index, from the directory and the low bits stored with it. */
+static int64_t node_tag_last_id () {
+    if (last_tagged_node < 0 && n_node_tags > 0) {
+        uint32_t mask = (1 << NODE_TAG_BLOCK_BITS) - 1;
+        last_tagged_node = ((int64_t)(n_node_tag_blocks - 1) << NODE_TAG_BLOCK_BITS) 
+                         | (node_tags[n_node_tags - 1].id & mask);
+    }
+    return last_tagged_node;
+}
+
+/*
+  Reserve places at the end of the index for a run of tagged nodes, in the order given, and set up
+  the directory for them. Returns the index of the first place, which the caller (or a worker the
+  caller hands the run to) fills in for each tagged node in turn.
+*/
+static uint32_t node_tags_reserve (int64_t *ids, size_t n) {
+    uint32_t first = n_node_tags;
+    for (size_t i = 0; i < n; i++) {
+        if (ids[i] <= node_tag_last_id()) die ("Tagged nodes must be sorted by ID in the input file.");
+        if (n_node_tags >= MAX_NODE_TAGS) die ("There are more tagged nodes than expected.");
+        uint32_t block = ids[i] >> NODE_TAG_BLOCK_BITS;
+        while (n_node_tag_blocks <= block) node_tag_dir[n_node_tag_blocks++] = n_node_tags;
+        last_tagged_node = ids[i];
+        n_node_tags++;
+    }
+    return first;
+}
+
+/* Find the place of a node in the sorted index, or return UINT32_MAX if it is not there. */
+static uint32_t node_tag_index (int64_t node_id) {
+    uint64_t block = node_id >> NODE_TAG_BLOCK_BITS;
+    if (block >= n_node_tag_blocks) return UINT32_MAX;
+    uint32_t end = (block + 1 < n_node_tag_blocks) ? node_tag_dir[block + 1] : n_node_tags;
+    for (uint32_t i = node_tag_dir[block]; i < end; i++) {
+        if (node_tags[i].id == (uint32_t)node_id) return i;
+    }
+    return UINT32_MAX;
+}
+
+/* Get the byte offset of the tag list of the given node, which is zero if it has no tags. */
+static uint32_t node_tags_get (int64_t node_id) {
+    if (node_tag_map != NULL) {
+        uint32_t tags = Map_get (node_tag_map, node_id);
+        if (tags != VAL_NONE) return tags;
+    }
+    uint32_t i = node_tag_index (node_id);
+    return (i == UINT32_MAX) ? 0 : node_tags[i].tags;
+}
+
+/* Read the overflow file into a hash map. Later entries for the same node replace earlier ones. */
+static void node_tags_open_overflow () {
+    node_tag_map = Map_new (n_node_tag_overflow * 2 + 4096);
+    for (uint32_t i = 0; i < n_node_tag_overflow; i++) {
+        Map_put (node_tag_map, node_tag_overflow[i].id, node_tag_overflow[i].tags);
+    }
+}
+
+/* Set the tag offset of a node outside a load, after node_tags_open_overflow. */
+static void node_tags_set (int64_t node_id, uint32_t tags) {
+    uint32_t i = node_tag_index (node_id);
+    if (i != UINT32_MAX) {
+        node_tags[i].tags = tags;
+    } else if (node_id > node_tag_last_id() && !Map_contains_key (node_tag_map, node_id)) {
+        /* A node newer than any in the index, as created nodes usually are, can still go at the end. */
+        if (tags == 0) return;
+        i = node_tags_reserve (&node_id, 1);
+        node_tags[i].id = (uint32_t)node_id;
+        node_tags[i].tags = tags;
+    } else if (tags != 0 || Map_contains_key (node_tag_map, node_id)) {
+        if (n_node_tag_overflow >= MAX_NODE_TAG_OVERFLOW) die ("There are more overflowing node tags than expected.");
+        node_tag_overflow[n_node_tag_overflow].id = node_id;
+        node_tag_overflow[n_node_tag_overflow].tags = tags;
+        n_node_tag_overflow++;
+        Map_put (node_tag_map, node_id, tags);
+    }
+}
+
+/*
+  Node lists of ways. Each is stored as its length followed by the node IDs, each as the zigzag varint
+  difference from the one before it (the first from zero), as in PBF files. Neighbouring nodes of a
+  way usually have nearby IDs, so this takes a fraction of the eight bytes per reference of a plain
+  array, and the lists are addressed by 64-bit byte offsets so that they never run out of address space.
+*/
+
+/* The number of bytes taken by a varint encoding of the given value. */
+static inline size_t varint_size (uint64_t value) {
+    return (70 - __builtin_clzll(value | 1)) / 7;
+}
+
+/* The number of bytes node_refs_encode will take for the given list. */
+static size_t node_refs_size (int64_t *refs, size_t n_refs) {
+    size_t size = varint_size(n_refs);
+    int64_t prev = 0;
+    for (size_t r = 0; r < n_refs; r++) {
+        size += varint_size(zigzag64(refs[r] - prev));
+        prev = refs[r];
+    }
+    return size;
+}
+
+static void node_refs_encode (int64_t *refs, size_t n_refs, uint8_t *out) {
+    out += uint64_pack(n_refs, out);
+    int64_t prev = 0;
+    for (size_t r = 0; r < n_refs; r++) {
+        out += sint64_pack(refs[r] - prev, out);
+        prev = refs[r];
+    }
+}
+
+/*
+  Buffers belonging to each thread, grown as needed by way_node_refs, way_cells, cell_ways and
+  cell_relations. Worker threads release them with free_thread_buffers before they exit.
+*/
+typedef struct {
+    int64_t *refs;
+    size_t refs_capacity;
+    GridCell **cells;
+    size_t cells_capacity;
+    int32_t *way_ids;
+    size_t way_ids_capacity;
+    uint32_t *relation_ids;
+    size_t relation_ids_capacity;
+} ThreadBuffers;
+
+static __thread ThreadBuffers thread_buffers;
+
+static void free_thread_buffers () {
+    ThreadBuffers *tb = &thread_buffers;
+    free(tb->refs);
+    free(tb->cells);
+    free(tb->way_ids);
+    free(tb->relation_ids);
+    memset(tb, 0, sizeof(ThreadBuffers));
+}
+
 /*
-  The number of way reference blocks currently allocated.
-  Sparse files appear to be full of zeros until you write to them. Therefore we skip way block zero
-  so we can use the zero index to mean "no way block".
+  Decode the node list of a way into a buffer belonging to the calling thread, which stays valid until
+  its next call, and return the number of nodes.
 */
-uint32_t way_block_count = 1;
-static uint32_t new_way_block() {
-    if (way_block_count % 100000 == 0)
-        fprintf(stderr, "%dk way blocks in use out of %dk.\n", way_block_count/1000, MAX_WAY_BLOCKS/1000);
-    if (way_block_count >= MAX_WAY_BLOCKS)
-        die("More way reference blocks are used than expected.");
-    // A negative value in the last ref entry gives the number of free slots in this block.
-    way_blocks[way_block_count].refs[WAY_BLOCK_SIZE-1] = -WAY_BLOCK_SIZE;
-    // Also set the next block index to 0 to indicate no next block
-    way_blocks[way_block_count].next = 0; 
-    // fprintf(stderr, "created way block %d\n", way_block_count);
-    return way_block_count++;
+static size_t way_node_refs (Way *way, int64_t **refs_out) {
+    ThreadBuffers *tb = &thread_buffers;
+    uint8_t *p = node_refs + way->node_ref_offset;
+    size_t n_refs = varint_read(&p);
+    if (n_refs > tb->refs_capacity) {
+        tb->refs_capacity = n_refs * 2;
+        tb->refs = realloc(tb->refs, tb->refs_capacity * sizeof(int64_t));
+        if (tb->refs == NULL) die("Could not allocate node ref buffer.");
+    }
+    int64_t *refs = tb->refs;
+    /* The refs are delta coded, mostly in single bytes, which the bulk decoder takes 16 at a time.
+       Most ways are shorter than that, and a plain loop is faster for them. */
+    if (n_refs >= 16) {
+        delta_unpack_sint64(p, n_refs, refs, 0);
+    } else {
+        int64_t ref = 0;
+        for (size_t r = 0; r < n_refs; r++) {
+            ref += svarint_read(&p);
+            refs[r] = ref;
+        }
+    }
+    *refs_out = refs;
+    return n_refs;
 }
 
-/* Get the x or y bin for the given x or y coordinate. */
-static uint32_t bin (int32_t xy) {
-    return ((uint32_t)(xy)) >> (32 - GRID_BITS); // unsigned: logical shift
+/* The first node of a way, which decides the grid cell it is indexed in. */
+static int64_t way_first_node (Way *way) {
+    uint8_t *p = node_refs + way->node_ref_offset;
+    varint_read(&p);
+    return svarint_read(&p);
 }
 
 /* Get the address of the grid cell for the given internal coord. */
 static GridCell *get_grid_cell_for_coord (coord_t coord) {
-    return &(grid->cells[bin(coord.x)][bin(coord.y)]);
+    return grid_cell (coord.x, coord.y);
 }
 
 /* Return the GridCell containing the first member of the given relation. */
@@ -306,11 +583,11 @@ static GridCell *get_grid_cell_for_relation (Relation *r) {
         return NULL;
     }
     if (first_member.element_type == NODE) {
-        return get_grid_cell_for_coord (nodes[first_member.id].coord);
+        return get_grid_cell_for_coord (node_coord(first_member.id));
     } else if (first_member.element_type == WAY) {
-        Way way = ways[first_member.id];
-        Node first_node = nodes[way.node_ref_offset];
-        return get_grid_cell_for_coord (first_node.coord);
+        Way *way = &(ways[first_member.id]);
+        if (way->node_ref_offset == 0) return NULL; // the way is not loaded
+        return get_grid_cell_for_coord (node_coord(way_first_node(way)));
     } else { 
         // (first_member.element_type == RELATION) {
         // TODO recurse... but the referenced relation may not be loaded.
@@ -319,28 +596,11 @@ static GridCell *get_grid_cell_for_relation (Relation *r) {
     }
 }
 
-/*
-  Given a Node struct, return the index of the way reference block at the head of the Node's grid
-  cell, creating a new way reference block if the grid cell is currently empty.
-*/
-static uint32_t get_grid_way_block (Node *node) {
-    GridCell *cell = get_grid_cell_for_coord (node->coord);
-    if (cell->head_way_block == 0) {
-        cell->head_way_block = new_way_block();
-    }
-    return cell->head_way_block;
-}
-
-/* TODO make this insert a new block at the list head instead of just setting the grid cell contents. */
-static void set_grid_way_block (Node *node, uint32_t way_block_index) {
-    GridCell *cell = get_grid_cell_for_coord (node->coord);
-    cell->head_way_block = way_block_index;
-}
-
 /* A memory block holding tags for a sub-range of the OSM ID space. */
 typedef struct {
     uint8_t *data;
-    size_t pos;
+    size_t pos;        // the end of the space written or reserved by writers
+    DropBehind behind; // tags are only ever appended, see tags_drop_behind for what is finished
 } TagSubfile;
 
 // MAX_SUBFILES must be larger than MAX_WAY_ID divided by the number of IDs per partition, 15 at present.
@@ -369,24 +629,40 @@ static uint32_t subfile_index_for_id (int64_t osmid, int entity_type) {
     return subfile;
 }
 
-/* Get the subfile in which the tags for the given OSM entity should be stored. */
-static TagSubfile *tag_subfile_for_id (int64_t osmid, int entity_type) {
-    uint32_t subfile = subfile_index_for_id (osmid, entity_type);
-    if (subfile >= MAX_SUBFILES) die ("Need more subfiles than expected.");
+/* Get a tag subfile, mapping it if this is the first time it is needed. */
+static TagSubfile *map_tag_subfile (uint32_t subfile) {
     TagSubfile *ts = &(tag_subfiles[subfile]);
     if (ts->data == NULL) {
         /* Lazy-map a subfile the first time it is needed. */
-        ts->data = map_file("tags", subfile, UINT32_MAX); // all files are 4GB sparse maps
+        int fd;
+        ts->data = map_file_fd("tags", subfile, UINT32_MAX, &fd); // all files are 4GB sparse maps
+        drop_behind_init(&(ts->behind), ts->data, fd, true);
         /* 
           Store a tag list terminator byte at the beginning of each file. This empty list will 
           be shared by all entities that do not have any tags, which all have tag offset zero.
         */
-        ts->data[0] = INT8_MAX; 
-        ts->pos = 1;
+        if (ts->pos == 0 && !read_only) {
+            ts->data[0] = INT8_MAX; 
+            ts->pos = 1;
+        }
     }
     return ts;
 }
 
+/* Get the subfile in which the tags for the given OSM entity should be stored. */
+static TagSubfile *tag_subfile_for_id (int64_t osmid, int entity_type) {
+    uint32_t subfile = subfile_index_for_id (osmid, entity_type);
+    if (subfile >= MAX_SUBFILES) die ("Need more subfiles than expected.");
+    return map_tag_subfile (subfile);
+}
+
+/* Map every tag subfile holding any tags, so that threads reading tags never map one lazily at once. */
+static void map_tag_subfiles () {
+    for (uint32_t s = 0; s < MAX_SUBFILES; s++) {
+        if (tag_subfiles[s].pos > 0) map_tag_subfile (s);
+    }
+}
+
 /*
   Grab a pointer to tag subfile data directly. Convenience method to avoid manually dereferencing.
   This does not seek to the element within the tag file, it returns the beginning adress.
@@ -396,29 +672,40 @@ static uint8_t *tag_data_for_id (int64_t osmid, int entity_type) {
     return tag_subfile_for_id(osmid, entity_type)->data;
 }
 
-/* Write a ProtobufCBinaryData out to a TagSubfile, updating the subfile position accordingly. */
-static void ts_write(ProtobufCBinaryData *bd, TagSubfile *ts) {
-    uint8_t *dst = ts->data + ts->pos;
-    uint8_t *src = bd->data;
-    for (int i = 0; i < bd->len; i++) *(dst++) = *(src++);
-    ts->pos += bd->len;
+/*
+  Get the tag list at the given offset for an entity, without touching the tag subfiles for entities
+  that have none. Only subfiles holding some tags are ever mapped this way.
+*/
+static uint8_t *tag_list (int64_t osmid, int entity_type, uint32_t tags) {
+    static uint8_t no_tags = INT8_MAX;
+    return (tags == 0) ? &no_tags : tag_data_for_id (osmid, entity_type) + tags;
+}
+
+/* Get the tag list of a node, without touching the tag subfiles for the many nodes that have none. */
+static uint8_t *node_tag_list (int64_t node_id) {
+    return tag_list (node_id, NODE, node_tags_get (node_id));
 }
 
-/* Write a single char out to a TagSubfile, updating the subfile position accordingly. */
-static void ts_putc(char c, TagSubfile *ts) {
-    ts->data[(ts->pos)++] = c;
+/* Copy a ProtobufCBinaryData to out if it is not NULL, returning the number of bytes it takes. */
+static size_t tag_write (uint8_t *out, ProtobufCBinaryData *bd) {
+    if (out != NULL) memcpy(out, bd->data, bd->len);
+    return bd->len;
+}
+
+/* Write a single char to out if it is not NULL, returning the number of bytes it takes. */
+static size_t tag_putc (uint8_t *out, char c) {
+    if (out != NULL) *out = c;
+    return 1;
 }
 
 /*
   Given parallel tag key and value arrays of length n containing string table indexes,
-  write compacted lists of key=value pairs to a file which do not require the string table.
-  Returns the byte offset of the beginning of the new tag list within that file.
+  encode a compacted list of key=value pairs which does not require the string table.
+  Returns the number of bytes in the list, or 0 if there are no tags worth keeping. The list is only
+  measured when out is NULL, so space can be reserved for it before writing it out for real.
 */
-static uint32_t write_tags (uint32_t *keys, uint32_t *vals, int n, ProtobufCBinaryData *string_table, TagSubfile *ts) {
-    /* If there are no tags, point to index 0, which contains a single tag list terminator char. */
-    if (n == 0) return 0;
-    uint64_t position = ts->pos;
-    if (position > UINT32_MAX) die ("A tag file index has overflowed.");
+static size_t encode_tags (uint8_t *out, uint32_t *keys, uint32_t *vals, int n, ProtobufCBinaryData *string_table) {
+    size_t size = 0;
     int n_tags_written = 0;
     for (int t = 0; t < n; t++) {
         ProtobufCBinaryData key = string_table[keys[t]];
@@ -433,221 +720,1579 @@ static uint32_t write_tags (uint32_t *keys, uint32_t *vals, int n, ProtobufCBina
         }
         int8_t code = encode_tag(key, val);
         // Code always written out to encode a key and/or a value, or indicate they are free text.
-        ts_putc(code, ts);
+        size += tag_putc(out ? out + size : NULL, code);
         if (code == 0) {
             // Code 0 means zero-terminated key and value are written out in full.
             // Saving only tags with 'known' keys (nonzero codes) cuts file sizes in half.
             // Some are reduced by over 4x, which seem to contain a lot of bot tags.
             // continue;
-            ts_write(&key, ts);
-            ts_putc(0, ts);
-            ts_write(&val, ts);
-            ts_putc(0, ts);
+            size += tag_write(out ? out + size : NULL, &key);
+            size += tag_putc(out ? out + size : NULL, 0);
+            size += tag_write(out ? out + size : NULL, &val);
+            size += tag_putc(out ? out + size : NULL, 0);
         } else if (code < 0) {
             // Negative code provides key lookup, but value is written as zero-terminated free text.
-            ts_write(&val, ts);
-            ts_putc(0, ts);
+            size += tag_write(out ? out + size : NULL, &val);
+            size += tag_putc(out ? out + size : NULL, 0);
         }
         n_tags_written++;
     }
-    /* If all tags were skipped, return the index of the shared zero-length list. */
+    /* If all tags were skipped, the caller will use the shared zero-length list. */
     if (n_tags_written == 0) return 0;
     /* The tag list is terminated with a single character. TODO maybe use 0 as terminator. */
-    ts_putc(INT8_MAX, ts);
+    size += tag_putc(out ? out + size : NULL, INT8_MAX);
+    return size;
+}
+
+/*
+  Write a compacted tag list to the end of a TagSubfile, updating the subfile position accordingly.
+  Returns the byte offset of the beginning of the new tag list within that file.
+*/
+static uint32_t write_tags (uint32_t *keys, uint32_t *vals, int n, ProtobufCBinaryData *string_table, TagSubfile *ts) {
+    /* If there are no tags, point to index 0, which contains a single tag list terminator char. */
+    if (n == 0) return 0;
+    size_t size = encode_tags (NULL, keys, vals, n, string_table);
+    if (size == 0) return 0;
+    uint64_t position = ts->pos;
+    if (position + size > UINT32_MAX) die ("A tag file index has overflowed.");
+    encode_tags (ts->data + position, keys, vals, n, string_table);
+    ts->pos += size;
     return position;
 }
 
-/* Count the number of nodes and ways loaded, just for progress reporting. */
-static long nodes_loaded = 0;
-static long ways_loaded = 0;
-static long rels_loaded = 0;
+/*
+  A range of a tag subfile reserved by one ingest thread, which it fills from pos up to end.
+  Nothing the thread has yet to write through this cursor lies below low, which other threads read.
+*/
+typedef struct {
+    size_t pos;
+    size_t end;
+    size_t low;
+} TagCursor;
 
-/* Node callback handed to the general-purpose PBF loading code. */
-static void handle_node (OSMPBF__Node *node, ProtobufCBinaryData *string_table) {
-    if (node->id >= MAX_NODE_ID) {
-        die("OSM data contains nodes with larger IDs than expected.");
-    }
-    if (ways_loaded > 0) {
-        die("All nodes must appear before any ways in input file.");
+/* Workers reserve tag space in chunks of this many bytes, so they rarely touch the shared positions. */
+#define TAG_CHUNK (64 * 1024)
+
+/*
+  Write a compacted tag list into the range reserved by a cursor, first reserving another chunk at 
+  the end of the subfile if the list does not fit. Safe to call from several threads at once, each 
+  with its own cursor. Unused space at the end of a chunk is simply never referenced.
+*/
+static uint32_t write_tags_at (TagCursor *cursor, uint32_t *keys, uint32_t *vals, int n, 
+                               ProtobufCBinaryData *string_table, TagSubfile *ts) {
+    if (n == 0) return 0;
+    size_t size = encode_tags (NULL, keys, vals, n, string_table);
+    if (size == 0) return 0;
+    if (cursor->pos + size > cursor->end) {
+        size_t chunk = (size > TAG_CHUNK) ? size : TAG_CHUNK;
+        /* The chunk about to be reserved starts at or above the current end of the subfile. Publish
+           that before reserving it, so tags_drop_behind never sees the chunk without a low below it. */
+        __atomic_store_n(&(cursor->low), __atomic_load_n(&(ts->pos), __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        cursor->pos = __atomic_fetch_add(&(ts->pos), chunk, __ATOMIC_RELEASE);
+        cursor->end = cursor->pos + chunk;
     }
-    // lat and lon are in nanodegrees
-    double lat = node->lat * 0.000000001;
-    double lon = node->lon * 0.000000001;
-    to_coord(&(nodes[node->id].coord), lat, lon);
-    TagSubfile *ts = tag_subfile_for_id(node->id, NODE);
-    nodes[node->id].tags = write_tags (node->keys, node->vals, node->n_keys, string_table, ts);
-    nodes_loaded++;
-    if (nodes_loaded % 1000000 == 0)
-        fprintf(stderr, "loaded %ldM nodes\n", nodes_loaded / 1000000);
-    //printf ("---\nlon=%.5f lat=%.5f\nx=%d y=%d\n", lon, lat, nodes[node->id].x, nodes[node->id].y);
+    uint64_t position = cursor->pos;
+    if (position + size > UINT32_MAX) die ("A tag file index has overflowed.");
+    encode_tags (ts->data + position, keys, vals, n, string_table);
+    cursor->pos += size;
+    __atomic_store_n(&(cursor->low), cursor->pos, __ATOMIC_RELEASE);
+    return position;
 }
 
 /*
-  Way callback handed to the general-purpose PBF loading code.
-  All nodes must come before any ways in the input for this to work.
+  The cursors of every running ingest thread, one per subfile, so that tags_drop_behind can see how
+  far each has got. The node and way pools are sized by CPU count, well under this limit.
 */
-static void handle_way (OSMPBF__Way *way, ProtobufCBinaryData *string_table) {
-    if (way->id >= MAX_WAY_ID) {
-        die("OSM data contains ways with larger IDs than expected.");
+#define MAX_TAG_WRITERS 1024
+static TagCursor *tag_writers[MAX_TAG_WRITERS];
+static int n_tag_writers = 0;
+static pthread_mutex_t tag_writers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Empty a thread's cursors and register them. Until a cursor reserves a chunk it holds nothing back. */
+static void tag_cursors_open (TagCursor *cursors) {
+    for (int s = 0; s < MAX_SUBFILES; s++) {
+        cursors[s].pos = cursors[s].end = 0;
+        cursors[s].low = SIZE_MAX;
     }
-    /*
-       Copy node references into a sub-segment of one big array, reversing the PBF delta coding so
-       they are absolute IDs. All the refs within a way or relation are always known at once, so
-       we can use exact-length lists (unlike the lists of ways within a grid cell).
-       Each way stores the index of the first node reference in its list, and a negative node
-       ID is used to signal the end of the list.
-    */
-    ways[way->id].node_ref_offset = n_node_refs;
-    //fprintf(stderr, "WAY %ld\n", way->id);
-    //fprintf(stderr, "node ref offset %d\n", ways[way->id].node_ref_offset);
-    int64_t node_id = 0;
-    for (int r = 0; r < way->n_refs; r++, n_node_refs++) {
-        node_id += way->refs[r]; // node refs are delta coded
-        node_refs[n_node_refs] = node_id;
-        if (n_node_refs == UINT32_MAX) die ("Node refs index is about to overflow.");
-    }
-    node_refs[n_node_refs - 1] *= -1; // Negate last node ref to signal end of list.
-    /* Index this way, as being in the grid cell of its first node. */
-    uint32_t wbi = get_grid_way_block(&(nodes[way->refs[0]]));
-    WayBlock *wb = &(way_blocks[wbi]);
-    /* If the last node ref is non-negative, no free slots remain. Chain a new empty block. */
-    if (wb->refs[WAY_BLOCK_SIZE - 1] >= 0) {
-        uint32_t new_way_block_index = new_way_block();
-        // Insert new block at head of list to avoid later scanning though large swaths of memory.
-        wb = &(way_blocks[new_way_block_index]);
-        wb->next = wbi;
-        set_grid_way_block(&(nodes[way->refs[0]]), new_way_block_index);
-    }
-    /* We are now certain to have a free slot in the current block. */
-    int nfree = wb->refs[WAY_BLOCK_SIZE - 1];
-    /* A final ref < 0 gives the number of free slots in this block. */
-    if (nfree >= 0) die ("Final ref was expected to be negative, indicating the number of free slots.");
-    int free_idx = WAY_BLOCK_SIZE + nfree;
-    wb->refs[free_idx] = way->id;
-    /* If this was not the last available slot, reduce number of free slots in this block by one. */
-    if (nfree != -1) (wb->refs[WAY_BLOCK_SIZE - 1])++;
-    ways_loaded++;
-    /* Save tags to compacted tag array, and record the index where that tag list begins. */
-    TagSubfile *ts = tag_subfile_for_id(way->id, WAY);
-    ways[way->id].tags = write_tags (way->keys, way->vals, way->n_keys, string_table, ts);
-    if (ways_loaded % 1000000 == 0) {
-        fprintf(stderr, "loaded %ldM ways\n", ways_loaded / 1000000);
+    pthread_mutex_lock(&tag_writers_mutex);
+    if (n_tag_writers == MAX_TAG_WRITERS) die("Too many tag writing threads.");
+    tag_writers[n_tag_writers++] = cursors;
+    pthread_mutex_unlock(&tag_writers_mutex);
+}
+
+/* Unregister the cursors of a thread that writes no more tags. The unused ends of its chunks stay empty. */
+static void tag_cursors_close (TagCursor *cursors) {
+    pthread_mutex_lock(&tag_writers_mutex);
+    for (int w = 0; w < n_tag_writers; w++) {
+        if (tag_writers[w] == cursors) tag_writers[w] = tag_writers[--n_tag_writers];
     }
+    pthread_mutex_unlock(&tag_writers_mutex);
 }
 
 /*
-  Relation callback handed to the general-purpose PBF loading code.
-  All nodes and ways must come before relations in the input file for this to work.
-  Copies one OSMPBF__Relation into a VEx Relation and inserts it in the grid spatial index.
+  Let the page cache drop the tags that are finished, which are not read again during a load. Space
+  below the end of a subfile may still be reserved by an ingest thread and not yet filled, so only
+  the space below every registered cursor's low is finished. The end of the subfile is read first:
+  any chunk reserved after that lies above it, and any reserved before it has its low published.
 */
-static void handle_relation (OSMPBF__Relation* relation, ProtobufCBinaryData *string_table) {
-    if (relation->id >= MAX_REL_ID) {
-        die("OSM data contains relations with larger IDs than expected.");
-    }
-    if (relation->n_memids == 0) return; // logic below expects at least one member reference
-    Relation *r = &(relations[relation->id]); // the Vex struct into which we are copying the PBF relation
-    r->member_offset = n_rel_members;
-    RelMember *rm = &(rel_members[n_rel_members]);
-    /* Check to avoid writing past the end of the relation members file. */
-    if (n_rel_members + relation->n_memids >= MAX_REL_MEMBERS) {
-        die ("There are more relation members in the OSM data than expected.");
+static void tags_drop_behind () {
+    pthread_mutex_lock(&tag_writers_mutex);
+    for (int s = 0; s < MAX_SUBFILES; s++) {
+        TagSubfile *ts = &(tag_subfiles[s]);
+        if (ts->data == NULL) continue;
+        size_t done = __atomic_load_n(&(ts->pos), __ATOMIC_ACQUIRE);
+        for (int w = 0; w < n_tag_writers; w++) {
+            size_t low = __atomic_load_n(&(tag_writers[w][s].low), __ATOMIC_ACQUIRE);
+            if (low < done) done = low;
+        }
+        drop_behind(&(ts->behind), done);
     }
-    /* Copy all the relation members from PBF into the VEx array. */
-    int64_t last_id = 0;
-    for (int m = 0; m < relation->n_memids; m++, n_rel_members++, rm++) {
-        rm->role = encode_role(string_table[relation->roles_sid[m]]);
-        /* OSMPBF NODE, WAY, RELATION constants use the same ints as ours. */
-        rm->element_type = relation->types[m];
-        int64_t id = relation->memids[m] + last_id; // delta-decode
-        last_id = id;
-        rm->id = (uint32_t)id; // currently, 2^31 < max osmid < 2^32
+    pthread_mutex_unlock(&tag_writers_mutex);
+}
+
+/*
+  The coords, node_tags and node_refs files are filled from front to back during a load (coords and
+  node_tags because nodes arrive sorted by ID), so the pages behind the current position can be
+  written back and dropped.
+*/
+static DropBehind coords_behind;
+static DropBehind node_tags_behind;
+static DropBehind node_refs_behind;
+
+/* Count the number of nodes and ways loaded, just for progress reporting. */
+static long nodes_loaded = 0;
+static long ways_loaded = 0;
+static long rels_loaded = 0;
+
+/*
+  Store the coordinates and tags of a batch of nodes, as one tight loop for the coordinates and
+  another for only the few nodes that actually have tags, which fill the places in the node tag
+  index reserved for them from tag_index on. With no cursors this writes to the tag subfiles
+  directly and must run on the loading thread. With an array of cursors (one per subfile) it can
+  run on several node ingest workers at once: each writes disjoint ranges of the coords array and
+  the node tag index, and only appends tags within the ranges its own cursors have reserved.
+*/
+static void ingest_nodes (PbfNodeBatch *batch, ProtobufCBinaryData *string_table, TagCursor *cursors,
+                          uint32_t tag_index) {
+    size_t n = batch->n;
+    int64_t *ids = batch->ids;
+    for (size_t i = 0; i < n && !node_store_blocks; i++) {
+        // lat and lon are in nanodegrees
+        to_coord(&(coords[ids[i]]), batch->lat[i] * 0.000000001, batch->lon[i] * 0.000000001);
     }
-    (rm - 1)->id *= -1; // Negate the last relation member id to signal the end of the list
-    /* Save tags to compacted tag array, and record the index where this relation's tag list begins. */
-    TagSubfile *ts = tag_subfile_for_id (relation->id, RELATION);
-    r->tags = write_tags (relation->keys, relation->vals, relation->n_keys, string_table, ts);
-    /* Insert this relation at the head of a linked list in its containing spatial index grid cell.
-       The GridCell's head field is initially set to zero since it is in a new mmapped file. */
-    GridCell *grid_cell = get_grid_cell_for_relation (r);
-    r->next = 0; // zero means no next relation in this grid cell (we start real relations at index 1).
-    if (grid_cell != NULL) {
-        r->next = grid_cell->head_relation;
-        grid_cell->head_relation = relation->id;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t t0 = batch->tag_offsets[i];
+        uint32_t t1 = batch->tag_offsets[i + 1];
+        if (t1 == t0) continue;
+        NodeTag *nt = &(node_tags[tag_index++]);
+        nt->id = (uint32_t)ids[i];
+        if (cursors == NULL) {
+            TagSubfile *ts = tag_subfile_for_id(ids[i], NODE);
+            nt->tags = write_tags (&(batch->keys[t0]), &(batch->vals[t0]), t1 - t0, string_table, ts);
+        } else {
+            uint32_t subfile = subfile_index_for_id(ids[i], NODE); // already mapped by the loading thread
+            nt->tags = write_tags_at (&(cursors[subfile]), &(batch->keys[t0]), &(batch->vals[t0]), 
+                                      t1 - t0, string_table, &(tag_subfiles[subfile]));
+        }
     }
-    rels_loaded++;
-    if (rels_loaded % 100000 == 0)
-        fprintf(stderr, "loaded %ldk relations\n", rels_loaded / 1000);
 }
 
 /*
-  Show the percentage of grid cells containing any objects.
-  Used to give empirical hints on setting the grid cell size.
-  With 8 bit (256x256) grid, planet.pbf gives 36.87% full
-  With 14 bit grid: 248351486 empty 20083970 used, 7.48% full
+  Parallel node ingest. Each PBF node block covers one contiguous range of IDs, so whole blocks are
+  handed out to a pool of worker threads that then write to disjoint parts of the coords array.
+  A batch from the PBF reader only lives until the callback returns, so it is first copied into a
+  work item, with the strings of its tags gathered into a small string table of the item's own.
+  Items are reused in order, so the loader never gets more than a few blocks ahead of the workers.
 */
-static void fillFactor () {
-    int used = 0;
-    for (int i = 0; i < GRID_DIM; ++i) {
-        for (int j = 0; j < GRID_DIM; ++j) {
-            if (grid->cells[i][j].head_way_block != 0) used++;
-        }
+typedef struct {
+    PbfNodeBatch batch;           // columns owned by this item
+    size_t node_capacity;
+    size_t tag_capacity;
+    ProtobufCBinaryData *strings; // the key and then the value of each tag
+    uint8_t *string_bytes;
+    size_t bytes_capacity;
+    uint32_t tag_index;           // the place reserved in the node tag index for the first tagged node
+    bool done;
+} NodeWork;
+
+static NodeWork *node_work;
+static int n_node_work;
+static long node_work_filled; // the number of items handed to the workers
+static long node_work_taken;  // the number of items claimed by a worker
+static bool node_workers_stop;
+static pthread_t *node_workers;
+static int n_node_workers = 0;
+static pthread_mutex_t node_work_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  node_work_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  node_work_done  = PTHREAD_COND_INITIALIZER;
+
+/* Worker thread main loop: claim items in order and store their nodes until told to stop. */
+static void *node_worker (void *arg) {
+    TagCursor cursors[MAX_SUBFILES];
+    tag_cursors_open(cursors);
+    pthread_mutex_lock(&node_work_mutex);
+    while (true) {
+        while (node_work_taken == node_work_filled && !node_workers_stop)
+            pthread_cond_wait(&node_work_ready, &node_work_mutex);
+        if (node_work_taken == node_work_filled) break; // stopping and no work remains
+        NodeWork *work = &(node_work[node_work_taken % n_node_work]);
+        node_work_taken++;
+        pthread_mutex_unlock(&node_work_mutex);
+        ingest_nodes(&(work->batch), work->strings, cursors, work->tag_index);
+        pthread_mutex_lock(&node_work_mutex);
+        work->done = true;
+        pthread_cond_broadcast(&node_work_done);
     }
-    fprintf(stderr, "index grid: %d used, %.2f%% full\n",
-        used, ((double)used) / (GRID_DIM * GRID_DIM) * 100);
+    pthread_mutex_unlock(&node_work_mutex);
+    tag_cursors_close(cursors);
+    return NULL;
 }
 
-/* Print out a message explaining command line parameters to the user, then exit. */
-static void usage () {
-    fprintf(stderr, "usage:\nvex database_dir <input.osm.pbf>\n");
-    fprintf(stderr, "vex database_dir min_lon,min_lat,max_lon,max_lat <output.osm.pbf>\n");
-    fprintf(stderr, "The output file name can also end in .vex or be - for stdout.\n");
-    exit(EXIT_SUCCESS);
+/* Grow an array to hold at least n elements of the given size, dying if memory runs out. */
+static void *grow_array (void *array, size_t n, size_t size) {
+    array = realloc(array, n * size);
+    if (array == NULL) die("Could not allocate memory for a growing array.");
+    return array;
 }
 
-/* Range checking. */
-static void check_lat_range(double lat) {
-    if (lat < -90 || lat > 90)
-        die ("Latitude out of range.");
+/* Reserve places in the node tag index for the tagged nodes of a batch, on the loading thread. */
+static uint32_t reserve_node_tags (PbfNodeBatch *batch) {
+    static int64_t *tagged = NULL;
+    static size_t capacity = 0;
+    size_t n_tagged = 0;
+    for (size_t i = 0; i < batch->n; i++) {
+        if (batch->tag_offsets[i + 1] == batch->tag_offsets[i]) continue;
+        if (n_tagged == capacity) {
+            capacity = (capacity == 0) ? 1024 : capacity * 2;
+            tagged = grow_array(tagged, capacity, sizeof(int64_t));
+        }
+        tagged[n_tagged++] = batch->ids[i];
+    }
+    return node_tags_reserve (tagged, n_tagged);
 }
 
-/* Range checking. */
-static void check_lon_range(double lon) {
-    if (lon < -180 || lon > 180)
-        die ("Longitude out of range.");
+/* Copy a batch and the strings of its tags into a work item. */
+static void node_work_fill (NodeWork *work, PbfNodeBatch *batch, ProtobufCBinaryData *string_table) {
+    PbfNodeBatch *copy = &(work->batch);
+    size_t n = batch->n;
+    uint32_t n_tags = batch->tag_offsets[n];
+    if (n > work->node_capacity) {
+        work->node_capacity = n;
+        copy->ids = grow_array(copy->ids, n, sizeof(int64_t));
+        copy->lat = grow_array(copy->lat, n, sizeof(int64_t));
+        copy->lon = grow_array(copy->lon, n, sizeof(int64_t));
+        copy->tag_offsets = grow_array(copy->tag_offsets, n + 1, sizeof(uint32_t));
+    }
+    if (n_tags > work->tag_capacity) {
+        work->tag_capacity = n_tags;
+        copy->keys = grow_array(copy->keys, n_tags, sizeof(uint32_t));
+        copy->vals = grow_array(copy->vals, n_tags, sizeof(uint32_t));
+        work->strings = grow_array(work->strings, n_tags * 2, sizeof(ProtobufCBinaryData));
+    }
+    copy->n = n;
+    memcpy(copy->ids, batch->ids, n * sizeof(int64_t));
+    memcpy(copy->lat, batch->lat, n * sizeof(int64_t));
+    memcpy(copy->lon, batch->lon, n * sizeof(int64_t));
+    memcpy(copy->tag_offsets, batch->tag_offsets, (n + 1) * sizeof(uint32_t));
+    size_t n_bytes = 0;
+    for (uint32_t t = 0; t < n_tags; t++) {
+        n_bytes += string_table[batch->keys[t]].len + string_table[batch->vals[t]].len;
+    }
+    // encode_tags may compare the first few bytes of a short key, so leave some slack at the end
+    if (n_bytes + 8 > work->bytes_capacity) {
+        work->bytes_capacity = n_bytes + 8;
+        work->string_bytes = grow_array(work->string_bytes, work->bytes_capacity, 1);
+    }
+    uint8_t *bytes = work->string_bytes;
+    for (uint32_t t = 0; t < n_tags; t++) {
+        ProtobufCBinaryData *key = &(string_table[batch->keys[t]]);
+        ProtobufCBinaryData *val = &(string_table[batch->vals[t]]);
+        memcpy(bytes, key->data, key->len);
+        work->strings[2 * t].data = bytes;
+        work->strings[2 * t].len = key->len;
+        bytes += key->len;
+        memcpy(bytes, val->data, val->len);
+        work->strings[2 * t + 1].data = bytes;
+        work->strings[2 * t + 1].len = val->len;
+        bytes += val->len;
+        copy->keys[t] = 2 * t;
+        copy->vals[t] = 2 * t + 1;
+    }
 }
 
-/* 
-  Functions beginning with print_ output OSM in a simple structured text format.
-  They are not static because they never need to be fast and they are only called when debugging.
-  External visibility will keep the compiler from complaining when they are unused (hack).
-*/
-void print_tags (uint8_t *tag_data) {
-    char *t = (char*)tag_data;
-    KeyVal kv;
-    while (*t != INT8_MAX) {
-        t += decode_tag(t, &kv);
-        fprintf(stderr, "%s=%s ", kv.key, kv.val);
+/* Hand a batch of nodes to the workers, first waiting for the item it will occupy to be free. */
+static void dispatch_nodes (PbfNodeBatch *batch, ProtobufCBinaryData *string_table) {
+    /* Tag subfiles are mapped lazily, which only the loading thread may do. */
+    for (size_t i = 0; i < batch->n; i++) {
+        if (batch->tag_offsets[i + 1] != batch->tag_offsets[i]) tag_subfile_for_id(batch->ids[i], NODE);
+    }
+    NodeWork *work = &(node_work[node_work_filled % n_node_work]);
+    pthread_mutex_lock(&node_work_mutex);
+    while (!work->done)
+        pthread_cond_wait(&node_work_done, &node_work_mutex);
+    /* Workers finish out of order, so batches handed out before the one that last used this item may
+       still be storing nodes. Batches are in ID order, so everything below the lowest unfinished one,
+       and up to the end of this item's last batch, has been written. */
+    int64_t coords_done = -1;
+    uint32_t tags_done = 0;
+    if (work->batch.n > 0) {
+        coords_done = work->batch.ids[work->batch.n - 1];
+        tags_done = work->tag_index;
+        for (int w = 0; w < n_node_work; w++) {
+            NodeWork *other = &(node_work[w]);
+            if (other->done || other->batch.n == 0) continue;
+            if (other->batch.ids[0] < coords_done) coords_done = other->batch.ids[0];
+            if (other->tag_index < tags_done) tags_done = other->tag_index;
+        }
+    }
+    pthread_mutex_unlock(&node_work_mutex);
+    if (coords_done >= 0) {
+        drop_behind(&coords_behind, coords_done * sizeof(coord_t));
+        drop_behind(&node_tags_behind, tags_done * sizeof(NodeTag));
     }
+    node_work_fill(work, batch, string_table);
+    work->tag_index = reserve_node_tags (batch);
+    pthread_mutex_lock(&node_work_mutex);
+    work->done = false;
+    node_work_filled++;
+    pthread_cond_signal(&node_work_ready);
+    pthread_mutex_unlock(&node_work_mutex);
 }
 
-void print_node (uint64_t node_id) {
-    Node node = nodes[node_id];
-    fprintf (stderr, "  node %llu (%.6f, %.6f) ", node_id, get_lat(&node.coord), get_lon(&node.coord));
-    uint8_t *tag_data = tag_data_for_id (node_id, NODE);
-    fprintf (stderr, "(offset %d)", node.tags);
-    print_tags (tag_data + node.tags);
-    fprintf (stderr, "\n");
+/* Start n node ingest workers. With zero workers nodes are stored on the loading thread. */
+static void start_node_workers (int n) {
+    if (n <= 0) return;
+    n_node_work = n * 2;
+    node_work = calloc(n_node_work, sizeof(NodeWork));
+    node_workers = malloc(n * sizeof(pthread_t));
+    if (node_work == NULL || node_workers == NULL) die("Could not allocate node ingest workers.");
+    for (int w = 0; w < n_node_work; w++) node_work[w].done = true;
+    node_work_filled = node_work_taken = 0;
+    node_workers_stop = false;
+    for (int t = 0; t < n; t++) {
+        if (pthread_create(&(node_workers[t]), NULL, &node_worker, NULL) != 0)
+            die("Could not start node ingest thread.");
+    }
+    n_node_workers = n;
+    fprintf(stderr, "Storing nodes on %d threads.\n", n);
 }
 
-void print_way (int64_t way_id) {
-    fprintf (stderr, "way %llu ", way_id);
-    uint8_t *tag_data = tag_data_for_id (way_id, WAY);
-    print_tags (tag_data + ways[way_id].tags);
-    fprintf (stderr, "\n");
+/* Wait for the node ingest workers to store every node handed to them so far, leaving them running. */
+static void sync_node_workers () {
+    if (n_node_workers == 0) return;
+    pthread_mutex_lock(&node_work_mutex);
+    for (int w = 0; w < n_node_work; w++) {
+        while (!node_work[w].done)
+            pthread_cond_wait(&node_work_done, &node_work_mutex);
+    }
+    pthread_mutex_unlock(&node_work_mutex);
 }
 
-/* 
-    Functions prefixed with vexbin_write_ output OSM in a much simpler binary format.
+/* Wait for the node ingest workers to store every node handed to them, then stop them. */
+static void finish_node_workers () {
+    if (n_node_workers == 0) return;
+    pthread_mutex_lock(&node_work_mutex);
+    node_workers_stop = true;
+    pthread_cond_broadcast(&node_work_ready);
+    pthread_mutex_unlock(&node_work_mutex);
+    for (int t = 0; t < n_node_workers; t++) pthread_join(node_workers[t], NULL);
+    for (int w = 0; w < n_node_work; w++) {
+        NodeWork *work = &(node_work[w]);
+        free(work->batch.ids);
+        free(work->batch.lat);
+        free(work->batch.lon);
+        free(work->batch.tag_offsets);
+        free(work->batch.keys);
+        free(work->batch.vals);
+        free(work->strings);
+        free(work->string_bytes);
+    }
+    free(node_work);
+    free(node_workers);
+    n_node_workers = 0;
+}
+
+/* Finish storing nodes, before anything that looks up their coordinates. */
+static void finish_nodes () {
+    finish_node_workers ();
+    if (node_store_blocks) node_store_flush ();
+}
+
+/*
+  Node batch callback handed to the general-purpose PBF loading code. A whole group of nodes arrives
+  at once as columns, and is either stored right away or handed to the node ingest workers.
+*/
+static void handle_node_batch (PbfNodeBatch *batch, ProtobufCBinaryData *string_table) {
+    if (ways_loaded > 0) {
+        die("All nodes must appear before any ways in input file.");
+    }
+    size_t n = batch->n;
+    int64_t *ids = batch->ids;
+    for (size_t i = 0; i < n; i++) {
+        if (ids[i] < 0 || ids[i] >= MAX_NODE_ID) {
+            die("OSM data contains nodes with larger IDs than expected.");
+        }
+    }
+    /* The block node store is filled on the loading thread, in ID order. */
+    for (size_t i = 0; i < n && node_store_blocks; i++) {
+        coord_t coord;
+        to_coord(&coord, batch->lat[i] * 0.000000001, batch->lon[i] * 0.000000001);
+        node_store_put (ids[i], coord);
+    }
+    if (n_node_workers > 0) {
+        dispatch_nodes (batch, string_table);
+    } else {
+        ingest_nodes (batch, string_table, NULL, reserve_node_tags (batch));
+        if (n > 0) drop_behind(&coords_behind, ids[0] * sizeof(coord_t));
+        drop_behind(&node_tags_behind, n_node_tags * sizeof(NodeTag));
+    }
+    tags_drop_behind();
+    if ((nodes_loaded + n) / 1000000 > nodes_loaded / 1000000)
+        fprintf(stderr, "loaded %ldM nodes\n", (nodes_loaded + n) / 1000000);
+    nodes_loaded += n;
+}
+
+/*
+  Collect the distinct grid cells containing the nodes of a way, in a buffer belonging to the calling
+  thread that stays valid until its next call, and return their number. Consecutive nodes are usually
+  in the same cell and most ways touch only a few cells, so a linear search of those found so far is
+  quick. The bounding box of the nodes is also found, if bbox_out is not NULL.
+*/
+static size_t way_cells (int64_t *refs, size_t n_refs, GridCell ***cells_out, BBox *bbox_out) {
+    ThreadBuffers *tb = &thread_buffers;
+    GridCell **cells = tb->cells;
+    size_t n_cells = 0;
+    GridCell *last = NULL;
+    BBox bbox = bbox_empty;
+    for (size_t r = 0; r < n_refs; r++) {
+        coord_t coord = node_coord(refs[r]);
+        bbox_add_coord (&bbox, coord);
+        GridCell *cell = get_grid_cell_for_coord (coord);
+        if (cell == last) continue;
+        last = cell;
+        size_t c = 0;
+        while (c < n_cells && cells[c] != cell) c++;
+        if (c < n_cells) continue;
+        if (n_cells == tb->cells_capacity) {
+            tb->cells_capacity = (tb->cells_capacity == 0) ? 64 : tb->cells_capacity * 2;
+            cells = tb->cells = grow_array(cells, tb->cells_capacity, sizeof(GridCell *));
+        }
+        cells[n_cells++] = cell;
+    }
+    *cells_out = cells;
+    if (bbox_out != NULL) *bbox_out = bbox;
+    return n_cells;
+}
+
+/*
+  The grid cells whose chains changed while applying changes, each listed once, so that only those
+  are compacted again afterward. The tracker is NULL except while applying changes.
+*/
+static IDTracker *touched_cell_set = NULL;
+static uint32_t *touched_cells = NULL;
+static size_t n_touched_cells = 0;
+static size_t touched_capacity = 0;
+
+static void mark_touched_cell (GridCell *cell) {
+    if (touched_cell_set == NULL) return;
+    uint32_t c = grid_cell_index (cell);
+    if (IDTracker_set (touched_cell_set, c)) return;
+    if (n_touched_cells == touched_capacity) {
+        touched_capacity = (touched_capacity == 0) ? 1024 : touched_capacity * 2;
+        touched_cells = grow_array(touched_cells, touched_capacity, sizeof(uint32_t));
+    }
+    touched_cells[n_touched_cells++] = c;
+}
+
+/* Index a way in every grid cell containing one of the given nodes, and record its bounding box. */
+static void index_way (int64_t way_id, int64_t *refs, size_t n_refs) {
+    GridCell **cells;
+    size_t n_cells = way_cells (refs, n_refs, &cells, &(way_bboxes[way_id]));
+    for (size_t c = 0; c < n_cells; c++) {
+        grid_add_way (cells[c], way_id);
+        mark_touched_cell (cells[c]);
+    }
+}
+
+/*
+  Load one way, given the absolute IDs of the nodes it references, returning false if it has none.
+  All nodes must come before any ways in the input for this to work. As with ingest_nodes, the tags
+  are written directly on the loading thread when there are no cursors, and through the given cursors
+  when this is called from several way ingest workers at once.
+*/
+static bool load_way (int64_t way_id, int64_t *refs, size_t n_refs, uint32_t *keys, uint32_t *vals, int n_tags,
+                      ProtobufCBinaryData *string_table, TagCursor *cursors) {
+    if (way_id < 0 || way_id >= MAX_WAY_ID) {
+        die("OSM data contains ways with larger IDs than expected.");
+    }
+    if (n_refs == 0) return false; // logic below expects at least one node reference
+    /*
+       Encode node references into a sub-segment of one big array. All the refs within a way are
+       always known at once, so we can use exact-length lists (unlike the lists of ways within a
+       grid cell), and reserve each list with a single atomic addition once its size is known.
+       Each way stores the byte offset of its encoded list.
+    */
+    size_t size = node_refs_size(refs, n_refs);
+    uint64_t offset = __atomic_fetch_add(&n_node_ref_bytes, size, __ATOMIC_RELAXED);
+    if (offset + size > MAX_NODE_REF_BYTES) die ("There are more node refs in the OSM data than expected.");
+    ways[way_id].node_ref_offset = offset;
+    node_refs_encode(refs, n_refs, node_refs + offset);
+    /* Index this way in every grid cell it touches, so that any bounding box containing one of
+       its nodes finds it. */
+    index_way (way_id, refs, n_refs);
+    /* Save tags to compacted tag array, and record the index where that tag list begins. */
+    if (cursors == NULL) {
+        TagSubfile *ts = tag_subfile_for_id(way_id, WAY);
+        ways[way_id].tags = write_tags (keys, vals, n_tags, string_table, ts);
+    } else {
+        uint32_t subfile = subfile_index_for_id(way_id, WAY); // already mapped by the loading thread
+        ways[way_id].tags = write_tags_at (&(cursors[subfile]), keys, vals, n_tags, string_table, 
+                                           &(tag_subfiles[subfile]));
+    }
+    return true;
+}
+
+/*
+  Parallel way ingest. Ways are indexed straight out of the batch the PBF reader delivers, since
+  the grid, node_refs and tag subfiles can all be appended to from several threads at once.
+  The loading thread publishes a batch, then it and the way ingest workers claim runs of ways
+  from it until none remain, and the batch callback only returns once every run is finished.
+*/
+static PbfWayBatch *way_batch;
+static ProtobufCBinaryData *way_string_table;
+static size_t way_batch_next;  // the first way in the batch not yet claimed
+static long way_batch_number;  // incremented as each batch is published
+static int way_workers_busy;   // the number of workers not yet finished with the current batch
+static bool way_workers_stop;
+static pthread_t *way_workers;
+static int n_way_workers = 0;
+static pthread_mutex_t way_work_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  way_work_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  way_work_done  = PTHREAD_COND_INITIALIZER;
+static TagCursor main_way_cursors[MAX_SUBFILES]; // used by the loading thread while there are workers
+
+/* Ways are claimed this many at a time, to keep the claims themselves rare. */
+#define WAY_RUN 256
+
+/* Claim and load runs of ways from the current batch until none remain. */
+static void load_way_runs (TagCursor *cursors) {
+    PbfWayBatch *batch = way_batch;
+    long loaded = 0;
+    while (true) {
+        size_t w0 = __atomic_fetch_add(&way_batch_next, WAY_RUN, __ATOMIC_RELAXED);
+        if (w0 >= batch->n) break;
+        size_t w1 = (w0 + WAY_RUN < batch->n) ? w0 + WAY_RUN : batch->n;
+        for (size_t w = w0; w < w1; w++) {
+            uint32_t r0 = batch->ref_offsets[w];
+            uint32_t t0 = batch->tag_offsets[w];
+            loaded += load_way (batch->ids[w], &(batch->refs[r0]), batch->ref_offsets[w + 1] - r0,
+                                &(batch->keys[t0]), &(batch->vals[t0]), batch->tag_offsets[w + 1] - t0, 
+                                way_string_table, cursors);
+        }
+    }
+    __atomic_fetch_add(&ways_loaded, loaded, __ATOMIC_RELAXED);
+}
+
+/* Worker thread main loop: help load each batch as it is published, until told to stop. */
+static void *way_worker (void *arg) {
+    TagCursor cursors[MAX_SUBFILES];
+    tag_cursors_open(cursors);
+    long batch_number = 0;
+    pthread_mutex_lock(&way_work_mutex);
+    while (true) {
+        while (way_batch_number == batch_number && !way_workers_stop)
+            pthread_cond_wait(&way_work_ready, &way_work_mutex);
+        if (way_batch_number == batch_number) break; // stopping
+        batch_number = way_batch_number;
+        pthread_mutex_unlock(&way_work_mutex);
+        load_way_runs(cursors);
+        pthread_mutex_lock(&way_work_mutex);
+        if (--way_workers_busy == 0) pthread_cond_signal(&way_work_done);
+    }
+    pthread_mutex_unlock(&way_work_mutex);
+    tag_cursors_close(cursors);
+    free_thread_buffers();
+    node_store_release_cache();
+    return NULL;
+}
+
+/* Start n way ingest workers. With zero workers ways are loaded on the loading thread alone. */
+static void start_way_workers (int n) {
+    if (n <= 0) return;
+    way_workers = malloc(n * sizeof(pthread_t));
+    if (way_workers == NULL) die("Could not allocate way ingest workers.");
+    way_workers_stop = false;
+    tag_cursors_open(main_way_cursors);
+    for (int t = 0; t < n; t++) {
+        if (pthread_create(&(way_workers[t]), NULL, &way_worker, NULL) != 0)
+            die("Could not start way ingest thread.");
+    }
+    n_way_workers = n;
+    fprintf(stderr, "Indexing ways on %d threads.\n", n + 1);
+}
+
+/* Stop the way ingest workers, which are always idle between batches. */
+static void finish_way_workers () {
+    if (n_way_workers == 0) return;
+    pthread_mutex_lock(&way_work_mutex);
+    way_workers_stop = true;
+    pthread_cond_broadcast(&way_work_ready);
+    pthread_mutex_unlock(&way_work_mutex);
+    for (int t = 0; t < n_way_workers; t++) pthread_join(way_workers[t], NULL);
+    tag_cursors_close(main_way_cursors);
+    free(way_workers);
+    n_way_workers = 0;
+}
+
+/* Way batch callback handed to the general-purpose PBF loading code. Refs arrive delta-decoded. */
+static void handle_way_batch (PbfWayBatch *batch, ProtobufCBinaryData *string_table) {
+    finish_nodes(); // ways look up the coordinates of their nodes
+    long before = ways_loaded;
+    way_batch = batch;
+    way_string_table = string_table;
+    way_batch_next = 0;
+    if (n_way_workers > 0) {
+        /* Tag subfiles are mapped lazily, which only the loading thread may do. */
+        for (size_t w = 0; w < batch->n; w++) {
+            if (batch->tag_offsets[w + 1] != batch->tag_offsets[w]) tag_subfile_for_id(batch->ids[w], WAY);
+        }
+        pthread_mutex_lock(&way_work_mutex);
+        way_workers_busy = n_way_workers;
+        way_batch_number++;
+        pthread_cond_broadcast(&way_work_ready);
+        pthread_mutex_unlock(&way_work_mutex);
+        load_way_runs(main_way_cursors);
+        pthread_mutex_lock(&way_work_mutex);
+        while (way_workers_busy > 0)
+            pthread_cond_wait(&way_work_done, &way_work_mutex);
+        pthread_mutex_unlock(&way_work_mutex);
+    } else {
+        load_way_runs(NULL);
+    }
+    if (ways_loaded / 1000000 > before / 1000000)
+        fprintf(stderr, "loaded %ldM ways\n", ways_loaded / 1000000);
+    drop_behind(&node_refs_behind, n_node_ref_bytes);
+    tags_drop_behind();
+}
+
+/*
+  The bounding box of a relation, from the positions of its member nodes and the bounding boxes of its
+  member ways. Member relations may not be loaded yet, so a relation with any is given the whole world,
+  as is one none of whose members are loaded. Applying changes finds the box again when members change.
+*/
+static BBox relation_bbox (Relation *r) {
+    BBox bbox = bbox_empty;
+    for (RelMember *m = &(rel_members[r->member_offset]); true; m++) {
+        int64_t id = llabs(m->id);
+        if (m->element_type == NODE) {
+            bbox_add_coord (&bbox, node_coord(id));
+        } else if (m->element_type == WAY) {
+            if (ways[id].node_ref_offset != 0) bbox_add_bbox (&bbox, &(way_bboxes[id]));
+        } else {
+            return bbox_world;
+        }
+        if (m->id < 0) break;
+    }
+    return (bbox.min_x > bbox.max_x) ? bbox_world : bbox;
+}
+
+/*
+  Insert a relation at the head of a linked list in its containing spatial index grid cell, and
+  record its bounding box. The GridCell's head field is initially set to zero since it is in a new
+  mmapped file.
+*/
+static void link_relation (int64_t relation_id) {
+    Relation *r = &(relations[relation_id]);
+    relation_bboxes[relation_id] = relation_bbox (r);
+    GridCell *grid_cell = get_grid_cell_for_relation (r);
+    r->next = 0; // zero means no next relation in this grid cell (we start real relations at index 1).
+    r->cell = 0;
+    if (grid_cell != NULL) {
+        r->next = grid_cell->head_relation;
+        r->cell = grid_cell_index (grid_cell) + 1;
+        grid_cell->head_relation = relation_id;
+        mark_touched_cell (grid_cell);
+    }
+}
+
+/* Remove a relation from the linked list of the grid cell it was inserted into, if any. */
+static void unlink_relation (int64_t relation_id) {
+    Relation *r = &(relations[relation_id]);
+    if (r->cell == 0) return;
+    GridCell *grid_cell = grid_cell_at (r->cell - 1);
+    mark_touched_cell (grid_cell);
+    for (uint32_t *link = &(grid_cell->head_relation); *link != 0; link = &(relations[*link].next)) {
+        if (*link == relation_id) {
+            *link = r->next;
+            break;
+        }
+    }
+    r->next = 0;
+    r->cell = 0;
+}
+
+/*
+  The reverse index from member nodes and ways to the relations holding them, so that applying changes
+  can find the relations whose bounding boxes a changed member affects without reading them all. The
+  member IDs of each type are grouped in blocks, and a directory holds the first entry of a chain
+  through the entries for the members in each block. When a relation changes its entries are taken
+  out of their chains and abandoned, like its old member list. Member relations have no entries,
+  since they give the relations holding them the whole world as a bounding box anyway.
+*/
+static uint32_t *rel_parent_head (uint8_t element_type, int64_t member_id) {
+    if (element_type == NODE) return &(node_parent_dir[member_id >> NODE_PARENT_BLOCK_BITS]);
+    if (element_type == WAY) return &(way_parent_dir[member_id >> WAY_PARENT_BLOCK_BITS]);
+    return NULL;
+}
+
+/* Add the members of a relation to the reverse index. */
+static void link_relation_parents (int64_t relation_id) {
+    Relation *r = &(relations[relation_id]);
+    for (RelMember *m = &(rel_members[r->member_offset]); true; m++) {
+        int64_t id = llabs(m->id);
+        uint32_t *head = rel_parent_head (m->element_type, id);
+        if (head != NULL) {
+            if (n_rel_parents >= MAX_REL_MEMBERS)
+                die ("There are more relation members in the OSM data than expected.");
+            RelParent *p = &(rel_parents[n_rel_parents]);
+            p->relation = relation_id;
+            p->member = id;
+            p->next = *head;
+            *head = n_rel_parents++;
+        }
+        if (m->id < 0) break;
+    }
+}
+
+/* Take the members of a relation out of the reverse index, before they are replaced or deleted. */
+static void unlink_relation_parents (int64_t relation_id) {
+    Relation *r = &(relations[relation_id]);
+    if (r->member_offset == 0) return;
+    for (RelMember *m = &(rel_members[r->member_offset]); true; m++) {
+        int64_t id = llabs(m->id);
+        uint32_t *link = rel_parent_head (m->element_type, id);
+        while (link != NULL && *link != 0) {
+            RelParent *p = &(rel_parents[*link]);
+            if (p->relation == relation_id && p->member == id) *link = p->next;
+            else link = &(p->next);
+        }
+        if (m->id < 0) break;
+    }
+}
+
+/*
+  Relation callback handed to the general-purpose PBF loading code.
+  All nodes and ways must come before relations in the input file for this to work.
+  Copies one OSMPBF__Relation into a VEx Relation and inserts it in the grid spatial index.
+*/
+static void handle_relation (OSMPBF__Relation* relation, ProtobufCBinaryData *string_table) {
+    finish_nodes(); // in case the input has no ways
+    if (relation->id >= MAX_REL_ID) {
+        die("OSM data contains relations with larger IDs than expected.");
+    }
+    if (relation->n_memids == 0) return; // logic below expects at least one member reference
+    Relation *r = &(relations[relation->id]); // the Vex struct into which we are copying the PBF relation
+    r->member_offset = n_rel_members;
+    RelMember *rm = &(rel_members[n_rel_members]);
+    /* Check to avoid writing past the end of the relation members file. */
+    if (n_rel_members + relation->n_memids >= MAX_REL_MEMBERS) {
+        die ("There are more relation members in the OSM data than expected.");
+    }
+    /* Copy all the relation members from PBF into the VEx array. */
+    int64_t last_id = 0;
+    for (int m = 0; m < relation->n_memids; m++, n_rel_members++, rm++) {
+        rm->role = encode_role(string_table[relation->roles_sid[m]]);
+        /* OSMPBF NODE, WAY, RELATION constants use the same ints as ours. */
+        rm->element_type = relation->types[m];
+        int64_t id = relation->memids[m] + last_id; // delta-decode
+        last_id = id;
+        rm->id = (uint32_t)id; // currently, 2^31 < max osmid < 2^32
+    }
+    (rm - 1)->id *= -1; // Negate the last relation member id to signal the end of the list
+    /* Save tags to compacted tag array, and record the index where this relation's tag list begins. */
+    TagSubfile *ts = tag_subfile_for_id (relation->id, RELATION);
+    r->tags = write_tags (relation->keys, relation->vals, relation->n_keys, string_table, ts);
+    link_relation (relation->id);
+    link_relation_parents (relation->id);
+    rels_loaded++;
+    if (rels_loaded % 100000 == 0)
+        fprintf(stderr, "loaded %ldk relations\n", rels_loaded / 1000);
+}
+
+/*
+  Applying change files. Elements are created, modified and deleted in place. The node_refs, relation
+  members and tag lists they replace are simply abandoned, since those arrays are only appended to.
+  Every way stays indexed in the grid cells of its nodes, so when a node moves to another cell, the
+  ways passing through it are found in its old cell and indexed again.
+*/
+static long changes_applied[3]; // indexed by OscAction
+
+/* Remove a way from every grid cell it is indexed in, found from the current positions of its nodes. */
+static void unindex_way (int64_t way_id) {
+    int64_t *refs;
+    size_t n_refs = way_node_refs (&(ways[way_id]), &refs);
+    GridCell **cells;
+    size_t n_cells = way_cells (refs, n_refs, &cells, NULL);
+    for (size_t c = 0; c < n_cells; c++) {
+        grid_remove_way (cells[c], way_id);
+        mark_touched_cell (cells[c]);
+    }
+}
+
+/*
+  The relations holding a node that moved or a way that changed while applying changes, which need
+  their bounding boxes found again once all the changes are in. They are found through the reverse
+  index, and listed once each. The set is NULL except while applying changes.
+*/
+static IDTracker *stale_relation_set = NULL;
+static uint32_t *stale_relations = NULL;
+static size_t n_stale_relations = 0;
+static size_t stale_capacity = 0;
+
+static void mark_parent_relations (uint8_t element_type, int64_t member_id) {
+    if (stale_relation_set == NULL) return;
+    for (uint32_t e = *rel_parent_head (element_type, member_id); e != 0; e = rel_parents[e].next) {
+        RelParent *p = &(rel_parents[e]);
+        if (p->member != member_id || IDTracker_set (stale_relation_set, p->relation)) continue;
+        if (n_stale_relations == stale_capacity) {
+            stale_capacity = (stale_capacity == 0) ? 1024 : stale_capacity * 2;
+            stale_relations = grow_array(stale_relations, stale_capacity, sizeof(uint32_t));
+        }
+        stale_relations[n_stale_relations++] = p->relation;
+    }
+}
+
+/*
+  Move a node to a new position. The ways passing through it are all indexed in its old cell, where
+  they are found while the node is still where they were indexed. If it moves to another grid cell,
+  they are taken out of the grid and indexed again once it has moved, and otherwise only their
+  bounding boxes are found again, since even a small move can widen them.
+*/
+static void move_node (int64_t node_id, coord_t coord) {
+    static int32_t *moving = NULL;
+    static size_t capacity = 0;
+    size_t n = 0;
+    coord_t old = node_coord(node_id);
+    if (old.x == coord.x && old.y == coord.y) return;
+    GridCell *from = get_grid_cell_for_coord (old);
+    bool reindex = (from != get_grid_cell_for_coord (coord));
+    for (uint32_t b = from->head_way_block; b != 0; b = way_blocks[b].next) {
+        for (int w = 0; w < WAY_BLOCK_SIZE; w++) {
+            int32_t way_id = way_blocks[b].refs[w];
+            /* Empty slots in the way block will be either negative or zero. */
+            if (way_id <= 0) break;
+            int64_t *refs;
+            size_t n_refs = way_node_refs (&(ways[way_id]), &refs);
+            size_t r = 0;
+            while (r < n_refs && refs[r] != node_id) r++;
+            if (r == n_refs) continue;
+            if (n == capacity) {
+                capacity = (capacity == 0) ? 64 : capacity * 2;
+                moving = grow_array(moving, capacity, sizeof(int32_t));
+            }
+            moving[n++] = way_id;
+        }
+    }
+    /* Removing a way moves others around in the chain, so only start once they are all found. */
+    if (reindex) {
+        for (size_t i = 0; i < n; i++) unindex_way (moving[i]);
+    }
+    set_node_coord (node_id, coord);
+    mark_parent_relations (NODE, node_id);
+    for (size_t i = 0; i < n; i++) {
+        int64_t *refs;
+        size_t n_refs = way_node_refs (&(ways[moving[i]]), &refs);
+        if (reindex) {
+            index_way (moving[i], refs, n_refs);
+        } else {
+            GridCell **cells;
+            way_cells (refs, n_refs, &cells, &(way_bboxes[moving[i]]));
+        }
+        mark_parent_relations (WAY, moving[i]);
+    }
+}
+
+static void apply_node (OscElement *e) {
+    if (e->id < 0 || e->id >= MAX_NODE_ID) {
+        die("Change file contains nodes with larger IDs than expected.");
+    }
+    /* A deleted node keeps its position, which is still needed to find any way beginning at it that
+       is deleted later in the same changes. Nodes are only ever extracted as part of a way. */
+    if (e->action == OSC_DELETE) {
+        node_tags_set (e->id, 0);
+        return;
+    }
+    coord_t coord;
+    to_coord(&coord, e->lat, e->lon);
+    /* A created node may already be referenced by ways indexed where its unknown position put it. */
+    move_node (e->id, coord);
+    TagSubfile *ts = tag_subfile_for_id (e->id, NODE);
+    node_tags_set (e->id, write_tags (e->keys, e->vals, e->n_tags, e->strings, ts));
+}
+
+static void apply_way (OscElement *e) {
+    if (e->id < 0 || e->id >= MAX_WAY_ID) {
+        die("Change file contains ways with larger IDs than expected.");
+    }
+    Way *way = &(ways[e->id]);
+    /* If the way exists, take it out of the grid cells of its nodes. */
+    if (way->node_ref_offset != 0) {
+        unindex_way (e->id);
+        way->node_ref_offset = 0;
+        way->tags = 0;
+    }
+    /* The relations holding the way lose it or get its new nodes, once all the changes are in. */
+    mark_parent_relations (WAY, e->id);
+    if (e->action == OSC_DELETE) return;
+    load_way (e->id, e->refs, e->n_refs, e->keys, e->vals, e->n_tags, e->strings, NULL);
+}
+
+static void apply_relation (OscElement *e) {
+    if (e->id < 0 || e->id >= MAX_REL_ID) {
+        die("Change file contains relations with larger IDs than expected.");
+    }
+    Relation *r = &(relations[e->id]);
+    unlink_relation (e->id);
+    unlink_relation_parents (e->id);
+    r->member_offset = 0;
+    r->tags = 0;
+    if (e->action == OSC_DELETE || e->n_members == 0) return;
+    if (n_rel_members + e->n_members >= MAX_REL_MEMBERS) {
+        die ("There are more relation members in the OSM data than expected.");
+    }
+    r->member_offset = n_rel_members;
+    RelMember *rm = &(rel_members[n_rel_members]);
+    for (size_t m = 0; m < e->n_members; m++, n_rel_members++, rm++) {
+        rm->role = encode_role(e->strings[e->members[m].role]);
+        rm->element_type = e->members[m].type;
+        rm->id = (uint32_t)(e->members[m].id); // currently, 2^31 < max osmid < 2^32
+    }
+    (rm - 1)->id *= -1; // Negate the last relation member id to signal the end of the list
+    TagSubfile *ts = tag_subfile_for_id (e->id, RELATION);
+    r->tags = write_tags (e->keys, e->vals, e->n_tags, e->strings, ts);
+    link_relation (e->id);
+    link_relation_parents (e->id);
+}
+
+/*
+  Find the bounding boxes again of the relations with a member node that moved or a member way that
+  changed, once all the changes are in. Relations deleted since they were listed are skipped.
+*/
+static void refresh_relation_bboxes () {
+    long refreshed = 0;
+    for (size_t i = 0; i < n_stale_relations; i++) {
+        Relation *r = &(relations[stale_relations[i]]);
+        if (r->member_offset == 0) continue;
+        relation_bboxes[stale_relations[i]] = relation_bbox (r);
+        refreshed++;
+    }
+    if (refreshed > 0) fprintf(stderr, "found the bounding boxes of %ld relations again.\n", refreshed);
+}
+
+/* Change callback handed to the change file reader. */
+static void apply_change (OscElement *e) {
+    if (e->type == NODE) apply_node (e);
+    else if (e->type == WAY) apply_way (e);
+    else apply_relation (e);
+    changes_applied[e->action]++;
+}
+
+/*
+  The manifest is a small text file of "key value" lines recording everything about a database that
+  is not in its mapped arrays: the limits and grid size it was built with, how much of each
+  append-only array is in use, and how far its load got. A load writes it when it starts, again at
+  each checkpoint and when it finishes, and applying changes rewrites it at the end. It is replaced
+  atomically by renaming, so it always describes a consistent state of the database.
+*/
+typedef struct {
+    uint64_t version;
+    uint64_t grid_bits;
+    uint64_t tile_bits;
+    uint64_t max_grid_tiles;
+    uint64_t max_node_id;
+    uint64_t max_way_id;
+    uint64_t max_rel_id;
+    uint64_t max_rel_members;
+    uint64_t node_parent_block_bits;
+    uint64_t way_parent_block_bits;
+    uint64_t max_node_ref_bytes;
+    uint64_t max_way_blocks;
+    uint64_t way_block_size;
+    uint64_t max_subfiles;
+    uint64_t max_node_tags;
+    uint64_t node_tag_block_bits;
+    uint64_t max_node_tag_overflow;
+    uint64_t node_store;          // 1 if node coordinates are in the block store, 0 for the coords array
+    uint64_t node_block_bits;
+    uint64_t max_node_block_data;
+    uint64_t n_node_ref_bytes;
+    uint64_t n_rel_members;
+    uint64_t n_rel_parents;
+    uint64_t way_block_count;
+    uint64_t grid_tile_count;
+    uint64_t n_node_tags;
+    uint64_t n_node_tag_blocks;
+    uint64_t n_node_tag_overflow;
+    uint64_t node_block_data_size;
+    uint64_t node_block_last;        // one plus the block pending at a load checkpoint, or zero
+    uint64_t node_block_last_offset; // where that block was written at the checkpoint
+    uint64_t nodes_loaded;
+    uint64_t ways_loaded;
+    uint64_t rels_loaded;
+    uint64_t load_resume_offset; // where the input is to be read from to resume the load
+    uint64_t load_input_size;
+    uint64_t load_complete;
+    uint64_t grid_compacted;     // 1 if the compacted grid index matches the cell chains
+    uint64_t grid_way_ids_end;
+    uint64_t grid_way_ids_waste;
+    uint64_t grid_relation_ids_end;
+    uint64_t grid_relation_ids_waste;
+    uint64_t tags_end[MAX_SUBFILES]; // zero for subfiles not yet created
+    char load_input[PATH_MAX];       // the absolute path of the input, or - for stdin
+} Manifest;
+
+#define MANIFEST_VERSION 9
+
+/* The keys of the plain numeric fields, in the order they are written. */
+static const struct {
+    const char *key;
+    size_t offset;
+} manifest_fields[] = {
+    { "vex_manifest",       offsetof(Manifest, version) },
+    { "grid_bits",          offsetof(Manifest, grid_bits) },
+    { "tile_bits",          offsetof(Manifest, tile_bits) },
+    { "max_grid_tiles",     offsetof(Manifest, max_grid_tiles) },
+    { "max_node_id",        offsetof(Manifest, max_node_id) },
+    { "max_way_id",         offsetof(Manifest, max_way_id) },
+    { "max_rel_id",         offsetof(Manifest, max_rel_id) },
+    { "max_rel_members",    offsetof(Manifest, max_rel_members) },
+    { "node_parent_block_bits", offsetof(Manifest, node_parent_block_bits) },
+    { "way_parent_block_bits",  offsetof(Manifest, way_parent_block_bits) },
+    { "max_node_ref_bytes", offsetof(Manifest, max_node_ref_bytes) },
+    { "max_way_blocks",     offsetof(Manifest, max_way_blocks) },
+    { "way_block_size",     offsetof(Manifest, way_block_size) },
+    { "max_subfiles",       offsetof(Manifest, max_subfiles) },
+    { "max_node_tags",      offsetof(Manifest, max_node_tags) },
+    { "node_tag_block_bits",   offsetof(Manifest, node_tag_block_bits) },
+    { "max_node_tag_overflow", offsetof(Manifest, max_node_tag_overflow) },
+    { "node_store",         offsetof(Manifest, node_store) },
+    { "node_block_bits",    offsetof(Manifest, node_block_bits) },
+    { "max_node_block_data", offsetof(Manifest, max_node_block_data) },
+    { "n_node_ref_bytes",   offsetof(Manifest, n_node_ref_bytes) },
+    { "n_rel_members",      offsetof(Manifest, n_rel_members) },
+    { "n_rel_parents",      offsetof(Manifest, n_rel_parents) },
+    { "way_block_count",    offsetof(Manifest, way_block_count) },
+    { "grid_tile_count",    offsetof(Manifest, grid_tile_count) },
+    { "n_node_tags",        offsetof(Manifest, n_node_tags) },
+    { "n_node_tag_blocks",  offsetof(Manifest, n_node_tag_blocks) },
+    { "n_node_tag_overflow", offsetof(Manifest, n_node_tag_overflow) },
+    { "node_block_data_size", offsetof(Manifest, node_block_data_size) },
+    { "node_block_last",    offsetof(Manifest, node_block_last) },
+    { "node_block_last_offset", offsetof(Manifest, node_block_last_offset) },
+    { "nodes_loaded",       offsetof(Manifest, nodes_loaded) },
+    { "ways_loaded",        offsetof(Manifest, ways_loaded) },
+    { "rels_loaded",        offsetof(Manifest, rels_loaded) },
+    { "load_resume_offset", offsetof(Manifest, load_resume_offset) },
+    { "load_input_size",    offsetof(Manifest, load_input_size) },
+    { "load_complete",      offsetof(Manifest, load_complete) },
+    { "grid_compacted",     offsetof(Manifest, grid_compacted) },
+    { "grid_way_ids_end",   offsetof(Manifest, grid_way_ids_end) },
+    { "grid_way_ids_waste", offsetof(Manifest, grid_way_ids_waste) },
+    { "grid_relation_ids_end",   offsetof(Manifest, grid_relation_ids_end) },
+    { "grid_relation_ids_waste", offsetof(Manifest, grid_relation_ids_waste) }
+};
+#define N_MANIFEST_FIELDS (sizeof(manifest_fields) / sizeof(manifest_fields[0]))
+
+static uint64_t *manifest_field (Manifest *m, int f) {
+    return (uint64_t *)((char *)m + manifest_fields[f].offset);
+}
+
+/* The manifest of the database being loaded or changed, as last written. */
+static Manifest manifest;
+
+/* Record the compiled-in limits and the current state of the database in the manifest. */
+static void manifest_capture () {
+    manifest.version = MANIFEST_VERSION;
+    manifest.grid_bits = grid_bits;
+    manifest.tile_bits = TILE_BITS;
+    manifest.max_grid_tiles = grid_max_tiles;
+    manifest.max_node_id = MAX_NODE_ID;
+    manifest.max_way_id = MAX_WAY_ID;
+    manifest.max_rel_id = MAX_REL_ID;
+    manifest.max_rel_members = MAX_REL_MEMBERS;
+    manifest.node_parent_block_bits = NODE_PARENT_BLOCK_BITS;
+    manifest.way_parent_block_bits = WAY_PARENT_BLOCK_BITS;
+    manifest.max_node_ref_bytes = MAX_NODE_REF_BYTES;
+    manifest.max_way_blocks = grid_max_way_blocks;
+    manifest.way_block_size = WAY_BLOCK_SIZE;
+    manifest.max_subfiles = MAX_SUBFILES;
+    manifest.max_node_tags = MAX_NODE_TAGS;
+    manifest.node_tag_block_bits = NODE_TAG_BLOCK_BITS;
+    manifest.max_node_tag_overflow = MAX_NODE_TAG_OVERFLOW;
+    manifest.node_store = node_store_blocks;
+    manifest.node_block_bits = NODE_BLOCK_BITS;
+    manifest.max_node_block_data = MAX_NODE_BLOCK_DATA;
+    manifest.n_node_ref_bytes = n_node_ref_bytes;
+    manifest.n_rel_members = n_rel_members;
+    manifest.n_rel_parents = n_rel_parents;
+    manifest.way_block_count = way_block_count;
+    manifest.grid_tile_count = grid_tile_count;
+    manifest.n_node_tags = n_node_tags;
+    manifest.n_node_tag_blocks = n_node_tag_blocks;
+    manifest.n_node_tag_overflow = n_node_tag_overflow;
+    manifest.node_block_data_size = node_block_data_size;
+    int64_t last_block = node_store_blocks ? node_store_pending_block() : -1;
+    manifest.node_block_last = last_block + 1;
+    manifest.node_block_last_offset = (last_block < 0) ? 0 : node_blocks[last_block];
+    manifest.nodes_loaded = nodes_loaded;
+    manifest.ways_loaded = ways_loaded;
+    manifest.rels_loaded = rels_loaded;
+    manifest.grid_way_ids_end = grid_way_ids_end;
+    manifest.grid_way_ids_waste = grid_way_ids_waste;
+    manifest.grid_relation_ids_end = grid_relation_ids_end;
+    manifest.grid_relation_ids_waste = grid_relation_ids_waste;
+    for (int s = 0; s < MAX_SUBFILES; s++) manifest.tags_end[s] = tag_subfiles[s].pos;
+}
+
+/* Set the allocation state of the database to the one recorded in the manifest. */
+static void manifest_restore () {
+    n_node_ref_bytes = manifest.n_node_ref_bytes;
+    n_rel_members = manifest.n_rel_members;
+    n_rel_parents = manifest.n_rel_parents;
+    way_block_count = manifest.way_block_count;
+    grid_tile_count = manifest.grid_tile_count;
+    n_node_tags = manifest.n_node_tags;
+    n_node_tag_blocks = manifest.n_node_tag_blocks;
+    n_node_tag_overflow = manifest.n_node_tag_overflow;
+    node_block_data_size = manifest.node_block_data_size;
+    nodes_loaded = manifest.nodes_loaded;
+    ways_loaded = manifest.ways_loaded;
+    rels_loaded = manifest.rels_loaded;
+    grid_way_ids_end = manifest.grid_way_ids_end;
+    grid_way_ids_waste = manifest.grid_way_ids_waste;
+    grid_relation_ids_end = manifest.grid_relation_ids_end;
+    grid_relation_ids_waste = manifest.grid_relation_ids_waste;
+    for (int s = 0; s < MAX_SUBFILES; s++) tag_subfiles[s].pos = manifest.tags_end[s];
+}
+
+/* Append one formatted line to the manifest text, refusing to write past the end of the buffer. */
+static void manifest_append (char *text, size_t size, size_t *len, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(text + *len, size - *len, format, args);
+    va_end(args);
+    if (n < 0 || (size_t) n >= size - *len) die ("Manifest too long.");
+    *len += n;
+}
+
+/*
+  Room for the longest manifest: each numeric field and tags_end line is well under 64 bytes, and
+  load_input holds a path of up to PATH_MAX bytes.
+*/
+#define MANIFEST_TEXT_SIZE ((N_MANIFEST_FIELDS + MAX_SUBFILES) * 64 + PATH_MAX + 64)
+
+/* Write the manifest, replacing the previous one only once the new one is safely on disk. */
+static void manifest_write () {
+    char text[MANIFEST_TEXT_SIZE];
+    size_t len = 0;
+    for (int f = 0; f < N_MANIFEST_FIELDS; f++) {
+        manifest_append(text, sizeof(text), &len, "%s %llu\n", manifest_fields[f].key,
+                        (unsigned long long) *manifest_field(&manifest, f));
+    }
+    for (int s = 0; s < MAX_SUBFILES; s++) {
+        if (manifest.tags_end[s] != 0)
+            manifest_append(text, sizeof(text), &len, "tags_end %d %llu\n", s,
+                            (unsigned long long) manifest.tags_end[s]);
+    }
+    manifest_append(text, sizeof(text), &len, "load_input %s\n", manifest.load_input);
+    char path[sizeof(path_buf)], temp_path[sizeof(path_buf)];
+    strcpy(path, make_db_path("manifest", 0));
+    int fd;
+    if (in_memory) {
+        /* Shared memory objects do not survive a system crash anyway, so just overwrite it. */
+        fd = shm_open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    } else {
+        strcpy(temp_path, make_db_path("manifest.tmp", 0));
+        fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    }
+    if (fd == -1 || write(fd, text, len) != len) die ("Could not write database manifest.");
+    if (!in_memory) {
+        if (fsync(fd) != 0 || rename(temp_path, path) != 0) die ("Could not write database manifest.");
+        /* Make the rename itself durable. */
+        int dir_fd = open(database_path, O_RDONLY);
+        if (dir_fd != -1) {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+    }
+    close(fd);
+}
+
+/*
+  Read the manifest of an existing database, dying if there is none or if this build of vex was
+  compiled with different limits or grid tile size, as its arrays would then be laid out differently.
+*/
+static void manifest_read () {
+    make_db_path("manifest", 0);
+    int fd = in_memory ? shm_open(path_buf, O_RDONLY, 0) : open(path_buf, O_RDONLY);
+    if (fd == -1) die ("This database has no manifest. It was probably loaded by an older version of vex, "
+        "and must be loaded again.");
+    FILE *file = fdopen(fd, "r");
+    memset(&manifest, 0, sizeof(manifest));
+    char line[PATH_MAX + 64];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        /* Every line written ends in a newline, so a line without one is overlong or cut short. */
+        char *newline = strchr(line, '\n');
+        if (newline == NULL) die ("Database manifest has an overlong or truncated line.");
+        *newline = '\0';
+        char *value = strchr(line, ' ');
+        if (value == NULL) continue;
+        *(value++) = '\0';
+        if (strcmp(line, "load_input") == 0) {
+            size_t length = strlen(value);
+            if (length >= sizeof(manifest.load_input)) die ("Database manifest has an invalid load_input line.");
+            memcpy(manifest.load_input, value, length + 1);
+        } else if (strcmp(line, "tags_end") == 0) {
+            int s;
+            unsigned long long end;
+            if (sscanf(value, "%d %llu", &s, &end) != 2 || s < 0 || s >= MAX_SUBFILES)
+                die ("Database manifest has an invalid tags_end line.");
+            manifest.tags_end[s] = end;
+        } else {
+            for (int f = 0; f < N_MANIFEST_FIELDS; f++) {
+                if (strcmp(line, manifest_fields[f].key) == 0) *manifest_field(&manifest, f) = strtoull(value, NULL, 10);
+            }
+        }
+    }
+    fclose(file);
+    if (manifest.version != MANIFEST_VERSION) die ("Database manifest has an unknown version.");
+    if (manifest.grid_bits < MIN_GRID_BITS || manifest.grid_bits > MAX_GRID_BITS)
+        die ("Database manifest has an invalid grid size.");
+    grid_set_bits(manifest.grid_bits);
+    if (manifest.tile_bits != TILE_BITS || manifest.max_grid_tiles != grid_max_tiles || manifest.max_node_id != MAX_NODE_ID || manifest.max_way_id != MAX_WAY_ID 
+        || manifest.max_rel_id != MAX_REL_ID || manifest.max_rel_members != MAX_REL_MEMBERS
+        || manifest.node_parent_block_bits != NODE_PARENT_BLOCK_BITS || manifest.way_parent_block_bits != WAY_PARENT_BLOCK_BITS 
+        || manifest.max_node_ref_bytes != MAX_NODE_REF_BYTES || manifest.max_way_blocks != grid_max_way_blocks 
+        || manifest.way_block_size != WAY_BLOCK_SIZE || manifest.max_subfiles != MAX_SUBFILES
+        || manifest.max_node_tags != MAX_NODE_TAGS || manifest.node_tag_block_bits != NODE_TAG_BLOCK_BITS
+        || manifest.max_node_tag_overflow != MAX_NODE_TAG_OVERFLOW
+        || manifest.node_block_bits != NODE_BLOCK_BITS || manifest.max_node_block_data != MAX_NODE_BLOCK_DATA)
+        die ("This database was built by a vex compiled with different limits or grid tile size.");
+}
+
+/*
+  Checkpoints. While loading, the state of the database is saved every VEX_CHECKPOINT_SECONDS
+  (five minutes by default, zero to disable) so that an interrupted load can be resumed. Blocks are
+  handed over from the PBF reader in file order and every callback has finished with its block by
+  the time it returns, except for the node ingest workers, which are waited for. So the database
+  is in a state from which the load can continue at the next blob, and once the mapped files are
+  flushed the manifest can record it.
+*/
+static int checkpoint_seconds = 300;
+static time_t last_checkpoint;
+
+static void checkpoint (uint64_t next_offset) {
+    sync_node_workers();
+    if (node_store_blocks) node_store_flush();
+    sync_mapped_files();
+    manifest_capture();
+    manifest.load_resume_offset = next_offset;
+    manifest_write();
+    fprintf(stderr, "Checkpoint saved, a resumed load would continue at %lluMB.\n",
+            (unsigned long long) next_offset / 1024 / 1024);
+}
+
+/* Blob callback handed to the general-purpose PBF loading code. */
+static void handle_blob_done (uint64_t next_offset) {
+    if (checkpoint_seconds <= 0 || time(NULL) - last_checkpoint < checkpoint_seconds) return;
+    checkpoint(next_offset);
+    last_checkpoint = time(NULL);
+}
+
+/* A way is newer than the last checkpoint if its node refs lie beyond the ones in use at that time. */
+static bool way_is_after_checkpoint (int32_t way_id) {
+    return ways[way_id].node_ref_offset >= n_node_ref_bytes;
+}
+
+/*
+  Undo everything an interrupted load did after its last checkpoint, once manifest_restore has reset
+  the allocation counters. Whatever was appended beyond the counters will simply be overwritten, as
+  will the nodes, ways and relations that are read again, so mostly the grid needs repairing: ways
+  and relations added since the checkpoint are taken off the heads of the chains of every cell, and
+  so are the entries added since then to the reverse index from relation members. In the block node
+  store, blocks written since the checkpoint are forgotten, and the block that was pending then goes
+  back to the copy written at the checkpoint, to be picked up again where it was.
+*/
+static void rollback_to_checkpoint () {
+    if (node_store_blocks) {
+        int64_t last = (int64_t)manifest.node_block_last - 1;
+        for (int64_t b = (last < 0) ? 0 : last; b < MAX_NODE_BLOCKS; b++) {
+            if (node_blocks[b] >= node_block_data_size) node_blocks[b] = 0;
+        }
+        if (last >= 0) node_blocks[last] = manifest.node_block_last_offset;
+    }
+    fprintf(stderr, "Rolling the grid back to the last checkpoint.\n");
+    grid_truncate_tiles (grid_tile_count);
+    for (uint32_t c = 0; c < grid_tile_count * TILE_CELLS; c++) {
+        GridCell *cell = grid_cell_at (c);
+        grid_truncate_ways (cell, way_block_count, &way_is_after_checkpoint);
+        while (cell->head_relation != 0 && relations[cell->head_relation].member_offset >= n_rel_members)
+            cell->head_relation = relations[cell->head_relation].next;
+    }
+    /* Loads only ever add entries to the heads of the reverse index chains. */
+    for (uint64_t b = 0; b < MAX_NODE_PARENT_BLOCKS; b++) {
+        while (node_parent_dir[b] >= n_rel_parents) node_parent_dir[b] = rel_parents[node_parent_dir[b]].next;
+    }
+    for (uint64_t b = 0; b < MAX_WAY_PARENT_BLOCKS; b++) {
+        while (way_parent_dir[b] >= n_rel_parents) way_parent_dir[b] = rel_parents[way_parent_dir[b]].next;
+    }
+}
+
+/* Follow the chain of relations in a grid cell, for grid_compact. */
+static uint32_t next_relation (uint32_t relation_id) {
+    return relations[relation_id].next;
+}
+
+/*
+  Rewrite the compacted grid index from the cell chains. This is done once a load or a set of changes
+  is complete, and until then the manifest records that the compacted index is out of date, so that
+  extracts fall back on following the chains.
+*/
+static void compact_grid () {
+    fprintf(stderr, "Compacting the grid index.\n");
+    grid_compact (MAX_INDEXED_WAYS, MAX_REL_ID, &next_relation);
+}
+
+/*
+  After applying changes, compact only the cells they touched, appending their contents to the
+  compacted index. Once the IDs left behind by cells compacted this way outnumber the rest, or the
+  arrays fill up, the whole index is compacted again instead, which also restores the row order.
+*/
+static void compact_touched_cells () {
+    if (2 * grid_way_ids_waste > grid_way_ids_end || 2 * grid_relation_ids_waste > grid_relation_ids_end
+        || !grid_compact_cells (touched_cells, n_touched_cells, MAX_INDEXED_WAYS, MAX_REL_ID, &next_relation))
+        compact_grid ();
+}
+
+/*
+  Get the IDs of the ways indexed in a grid cell, from the compacted index if it is up to date, and
+  otherwise gathered from the cell's chain of way blocks into a buffer belonging to the calling thread,
+  which is reused on its next call.
+*/
+static size_t cell_ways (GridCell *cell, int32_t **ids_out) {
+    if (manifest.grid_compacted) {
+        GridRange *range = &(grid_ranges[grid_cell_index (cell)]);
+        *ids_out = &(grid_way_ids[range->first_way]);
+        return range->n_ways;
+    }
+    ThreadBuffers *tb = &thread_buffers;
+    int32_t *ids = tb->way_ids;
+    size_t n = 0;
+    for (uint32_t b = cell->head_way_block; b != 0; b = way_blocks[b].next) {
+        for (int w = 0; w < WAY_BLOCK_SIZE; w++) {
+            int32_t way_id = way_blocks[b].refs[w];
+            /* Empty slots in the way block will be either negative or zero. */
+            if (way_id <= 0) break;
+            if (n == tb->way_ids_capacity) {
+                tb->way_ids_capacity = (tb->way_ids_capacity == 0) ? 256 : tb->way_ids_capacity * 2;
+                ids = tb->way_ids = grow_array(ids, tb->way_ids_capacity, sizeof(int32_t));
+            }
+            ids[n++] = way_id;
+        }
+    }
+    *ids_out = ids;
+    return n;
+}
+
+/* Get the IDs of the relations indexed in a grid cell, in the same way as cell_ways. */
+static size_t cell_relations (GridCell *cell, uint32_t **ids_out) {
+    if (manifest.grid_compacted) {
+        GridRange *range = &(grid_ranges[grid_cell_index (cell)]);
+        *ids_out = &(grid_relation_ids[range->first_relation]);
+        return range->n_relations;
+    }
+    ThreadBuffers *tb = &thread_buffers;
+    uint32_t *ids = tb->relation_ids;
+    size_t n = 0;
+    for (uint32_t r = cell->head_relation; r != 0; r = relations[r].next) {
+        if (n == tb->relation_ids_capacity) {
+            tb->relation_ids_capacity = (tb->relation_ids_capacity == 0) ? 256 : tb->relation_ids_capacity * 2;
+            ids = tb->relation_ids = grow_array(ids, tb->relation_ids_capacity, sizeof(uint32_t));
+        }
+        ids[n++] = r;
+    }
+    *ids_out = ids;
+    return n;
+}
+
+/*
+  Show the percentage of grid cells containing any objects, over the whole grid and over the tiles
+  that were allocated. Used to give empirical hints on setting the grid cell size.
+  With 8 bit (256x256) grid, planet.pbf gives 36.87% full
+  With 14 bit grid: 248351486 empty 20083970 used, 7.48% full
+*/
+static void fillFactor () {
+    uint32_t used = 0;
+    uint32_t n_tiles = grid_tile_count - 1;
+    for (uint32_t c = TILE_CELLS; c < grid_tile_count * TILE_CELLS; c++) {
+        if (grid_cell_at(c)->head_way_block != 0) used++;
+    }
+    double n_cells = (double)(1 << grid_bits) * (1 << grid_bits);
+    fprintf(stderr, "index grid: %u used, %.2f%% full, %u tiles allocated, %.2f%% of their cells used\n",
+        used, used / n_cells * 100, n_tiles, n_tiles ? (double)used / n_tiles / TILE_CELLS * 100 : 0.0);
+}
+
+/*
+  The number of CPUs all the thread pools of one run share out between them: the VEX_CPUS environment
+  variable, or the number online.
+*/
+static int cpu_budget () {
+    char *env = getenv("VEX_CPUS");
+    long n_cpus = (env != NULL) ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+    return (n_cpus > 1) ? n_cpus : 1;
+}
+
+/*
+  The number of threads used to decode PBF blobs during a load. The main thread running the callbacks
+  takes one CPU of the budget, and the decoders get half of the rest, rounded up. The node and way
+  ingest pools never run at the same time, so each can have what remains. The VEX_THREADS environment
+  variable overrides the number of decoders.
+*/
+static int load_threads () {
+    char *env = getenv("VEX_THREADS");
+    if (env != NULL) return atoi(env);
+    return cpu_budget() / 2;
+}
+
+/* The CPUs of the budget left to the node or way ingest pool, after the main thread and the decoders. */
+static int ingest_threads () {
+    int n = cpu_budget() - 1 - load_threads();
+    return (n > 0) ? n : 0;
+}
+
+/*
+  The number of threads helping the main thread to index ways during a load. The VEX_WAY_THREADS
+  environment variable overrides the default share of the CPU budget. Zero indexes ways on the
+  main thread alone.
+*/
+static int way_threads () {
+    char *env = getenv("VEX_WAY_THREADS");
+    if (env != NULL) return atoi(env);
+    return ingest_threads();
+}
+
+/*
+  The number of threads storing nodes during a load, alongside the decoder threads. The 
+  VEX_NODE_THREADS environment variable overrides the default share of the CPU budget.
+  Zero stores nodes on the main thread.
+*/
+static int node_threads () {
+    char *env = getenv("VEX_NODE_THREADS");
+    if (env != NULL) return atoi(env);
+    return ingest_threads();
+}
+
+/*
+  The VEX_DIRTY_BUDGET_MB environment variable sets how many megabytes of finished pages of the nodes,
+  node_refs and tags files may stay in the page cache during a load before they are released.
+*/
+static void set_dirty_budget () {
+    char *env = getenv("VEX_DIRTY_BUDGET_MB");
+    if (env == NULL) return;
+    long mb = atol(env);
+    if (mb <= 0) die("VEX_DIRTY_BUDGET_MB must be a positive number of megabytes");
+    pagecache_dirty_budget((size_t)mb * 1024 * 1024);
+}
+
+/*
+  The VEX_COMPRESSION environment variable chooses the codec and level for blobs in PBF output,
+  as "codec" or "codec:level" (for example "zstd:3"). The default is zlib at its default level.
+*/
+static void set_output_compression () {
+    char *env = getenv("VEX_COMPRESSION");
+    if (env == NULL) return;
+    if (!pbf_write_compression(env))
+        die("VEX_COMPRESSION must be none, zlib, lz4 or zstd (if compiled in), optionally followed by a :level the codec accepts");
+    fprintf(stderr, "PBF output will be compressed with %s.\n", env);
+}
+
+/*
+  The number of threads extracting PBF output, including the main thread. They get half the CPU
+  budget, rounded up, unless the VEX_EXTRACT_THREADS environment variable says otherwise. One or zero
+  extracts on the main thread alone.
+*/
+static int extract_threads () {
+    char *env = getenv("VEX_EXTRACT_THREADS");
+    if (env != NULL) return atoi(env);
+    return (cpu_budget() + 1) / 2;
+}
+
+/*
+  The number of threads compressing PBF output blocks while later blocks are filled: the CPUs of the
+  budget left after the extract threads, unless the VEX_COMPRESS_THREADS environment variable says
+  otherwise. Zero compresses each block on the thread that filled it.
+*/
+static int compress_threads () {
+    char *env = getenv("VEX_COMPRESS_THREADS");
+    if (env != NULL) return atoi(env);
+    int n = cpu_budget() - extract_threads();
+    return (n > 0) ? n : 0;
+}
+
+/* Print out a message explaining command line parameters to the user, then exit. */
+static void usage () {
+    fprintf(stderr, "usage:\nvex database_dir <input.osm.pbf>\n");
+    fprintf(stderr, "vex database_dir min_lon,min_lat,max_lon,max_lat <output.osm.pbf>\n");
+    fprintf(stderr, "vex database_dir apply <change.osc.gz> [more changes...]\n");
+    fprintf(stderr, "vex database_dir resume [<input.osm.pbf>]\n");
+    fprintf(stderr, "The input file name can be - for stdin.\n");
+    fprintf(stderr, "The output file name can also end in .vex or be - for stdout.\n");
+    exit(EXIT_SUCCESS);
+}
+
+/* Range checking. */
+static void check_lat_range(double lat) {
+    if (lat < -90 || lat > 90)
+        die ("Latitude out of range.");
+}
+
+/* Range checking. */
+static void check_lon_range(double lon) {
+    if (lon < -180 || lon > 180)
+        die ("Longitude out of range.");
+}
+
+/* 
+  Functions beginning with print_ output OSM in a simple structured text format.
+  They are not static because they never need to be fast and they are only called when debugging.
+  External visibility will keep the compiler from complaining when they are unused (hack).
+*/
+void print_tags (uint8_t *tag_data) {
+    char *t = (char*)tag_data;
+    KeyVal kv;
+    while (*t != INT8_MAX) {
+        t += decode_tag(t, &kv);
+        fprintf(stderr, "%s=%s ", kv.key, kv.val);
+    }
+}
+
+void print_node (uint64_t node_id) {
+    coord_t coord = node_coord(node_id);
+    fprintf (stderr, "  node %llu (%.6f, %.6f) ", node_id, get_lat(&coord), get_lon(&coord));
+    fprintf (stderr, "(offset %d)", node_tags_get(node_id));
+    print_tags (node_tag_list(node_id));
+    fprintf (stderr, "\n");
+}
+
+void print_way (int64_t way_id) {
+    fprintf (stderr, "way %llu ", way_id);
+    uint8_t *tag_data = tag_data_for_id (way_id, WAY);
+    print_tags (tag_data + ways[way_id].tags);
+    fprintf (stderr, "\n");
+}
+
+/* 
+    Functions prefixed with vexbin_write_ output OSM in a much simpler binary format.
     This is comparable in size or smaller than PBF if you zlib it in blocks, but much simpler.
     Q: why does PBF use string tables since a similar result is achieved by zipping the blocks?
     The variables declared here are used to hold shared state for all the write functions.
@@ -725,37 +2370,31 @@ static void vexbin_write_tags (uint8_t *tag_data) {
 }
 
 static void vexbin_write_node (int64_t node_id) {
-    Node node = nodes[node_id];
+    coord_t coord = node_coord(node_id);
     int64_t id_delta = node_id - last_node_id;
     // TODO convert to fixed-point lat,lon as in PBF?
-    int32_t x_delta = node.coord.x - last_x;
-    int32_t y_delta = node.coord.y - last_y;
+    int32_t x_delta = coord.x - last_x;
+    int32_t y_delta = coord.y - last_y;
     vexbin_write_signed (id_delta);
     vexbin_write_signed (x_delta);
     vexbin_write_signed (y_delta);
-    uint8_t *tag_data = tag_data_for_id (node_id, NODE);
-    vexbin_write_tags (tag_data + node.tags); // TODO does this work if tag list is empty?
+    vexbin_write_tags (node_tag_list(node_id)); // TODO does this work if tag list is empty?
     /* Retain values to allow delta-coding on next node to be written. */
     last_node_id = node_id;
-    last_x = node.coord.x;
-    last_y = node.coord.y;
+    last_x = coord.x;
+    last_y = coord.y;
 }
 
 static void vexbin_write_way (int64_t way_id) {
     Way way = ways[way_id];
     int64_t id_delta = way_id - last_way_id;
     vexbin_write_signed (id_delta);
-    /* Count the number of node refs in this way and write out the count before the list. */
-    int n_refs = 0;
-    for (int64_t *node_ref_p = node_refs + way.node_ref_offset; true; node_ref_p++) {
-        n_refs++;
-        if (*node_ref_p < 0) break;
-    }
+    /* Write out the number of node refs in this way before the list. */
+    int64_t *node_refs_for_way;
+    size_t n_refs = way_node_refs (&way, &node_refs_for_way);
     vexbin_write_length (n_refs);
-    int64_t *node_refs_for_way = node_refs + way.node_ref_offset;
-    for (int r = 0; r < n_refs; r++) {
+    for (size_t r = 0; r < n_refs; r++) {
         int64_t node_ref = node_refs_for_way[r];
-        if (node_ref < 0) node_ref = -node_ref;
         // Delta code way references (even across ways) 
         int64_t ref_delta = node_ref - last_node_id;
         last_node_id = node_ref; 
@@ -767,15 +2406,238 @@ static void vexbin_write_way (int64_t way_id) {
     last_way_id = way_id;
 }
 
+/*
+  Extraction. Each of the three stages (nodes, then ways, then relations) visits every grid cell in
+  the requested area, reading the ways or relations listed there. A way is indexed in every cell it
+  touches and many ways share nodes, so the ways and nodes already output are tracked, in trackers
+  shared by all the threads of an extract.
+*/
+static uint32_t extract_min_xbin, extract_max_xbin, extract_min_ybin, extract_max_ybin;
+static BBox extract_query;
+static IDTracker *extract_nodes_seen;
+static IDTracker *extract_ways_seen;
+
+/* Output the nodes, ways or relations of one grid cell, as PBF to the given writer or else as VEX. */
+static void extract_cell (int stage, uint32_t x, uint32_t y, PbfWriter *writer) {
+    GridCell *cell = grid_cell_find (x, y);
+    /* Nothing was ever indexed in the tile of this cell. */
+    if (cell == NULL) return;
+    /* Cells on the edges of the area extend outside it, and may hold elements that lie
+    entirely outside. Elements in the other cells all have a node inside the area. */
+    bool boundary = (x == extract_min_xbin || x == extract_max_xbin
+                  || y == extract_min_ybin || y == extract_max_ybin);
+    if (stage == RELATION) {
+        uint32_t *relation_ids;
+        size_t n_relations = cell_relations (cell, &relation_ids);
+        for (size_t r = 0; r < n_relations; r++) {
+            uint32_t relation_id = relation_ids[r];
+            if (boundary && !bbox_intersects (&extract_query, &(relation_bboxes[relation_id]))) continue;
+            Relation rel = relations[relation_id];
+            if (writer == NULL) {
+                // TODO Output relations in VEX format
+            } else {
+                pbf_writer_relation (writer, relation_id, &(rel_members[rel.member_offset]),
+                    tag_list (relation_id, RELATION, rel.tags));
+            }
+        }
+        return;
+    }
+    /* The NODE and WAY stages both iterate over all ways in this grid cell. */
+    int32_t *way_ids;
+    size_t n_ways = cell_ways (cell, &way_ids);
+    for (size_t w = 0; w < n_ways; w++) {
+        int64_t way_id = way_ids[w];
+        if (boundary && !bbox_intersects (&extract_query, &(way_bboxes[way_id]))) continue;
+        if (IDTracker_set_shared (extract_ways_seen, way_id)) continue;
+        Way way = ways[way_id];
+        if (stage == WAY) {
+            if (writer == NULL) {
+                vexbin_write_way (way_id);
+            } else {
+                int64_t *refs;
+                size_t n_refs = way_node_refs (&way, &refs);
+                pbf_writer_way (writer, way_id, refs, n_refs, tag_list (way_id, WAY, way.tags));
+            }
+        } else if (stage == NODE) {
+            /* Output all nodes in this way. */
+            int64_t *refs;
+            size_t n_refs = way_node_refs (&way, &refs);
+            for (size_t r = 0; r < n_refs; r++) {
+                int64_t node_id = refs[r];
+                // print_node (node_id); // DEBUG
+                /* Mark this node, and skip outputting it if already seen. */
+                if (IDTracker_set_shared (extract_nodes_seen, node_id)) continue;
+                if (writer == NULL) {
+                    vexbin_write_node (node_id);
+                } else {
+                    coord_t coord = node_coord(node_id);
+                    pbf_writer_node (writer, node_id, get_lat(&coord), get_lon(&coord),
+                        node_tag_list(node_id));
+                }
+            }
+        }
+    }
+}
+
+/*
+  Parallel extract. The cells of the area, numbered column by column as the single-threaded extract
+  visits them, are cut into units of EXTRACT_UNIT_CELLS. Each worker starts out owning an even share
+  of the units, and takes them one by one from the front of its share. A worker that runs out steals
+  the back half of another worker's remaining share, so the load stays balanced even though cells in
+  cities take far longer than cells in the countryside. Each worker fills PBF blocks of its own and
+  writes them out whole as they fill. Workers finish each stage before the next begins, so all the
+  nodes in the output still come before all the ways, and those before all the relations.
+*/
+#define EXTRACT_UNIT_CELLS 16
+
+typedef struct {
+    pthread_mutex_t mutex;
+    uint32_t next; // the first unit not yet claimed
+    uint32_t end;  // one past the last unit
+} UnitRange;
+
+static UnitRange *extract_ranges;
+static PbfWriter **extract_writers;
+static int n_extract_workers;
+static int extract_stage;
+
+/* Claim the next unit of a worker's own share, or steal some from another worker. */
+static bool claim_unit (int worker, uint32_t *unit_out) {
+    UnitRange *own = &(extract_ranges[worker]);
+    pthread_mutex_lock(&(own->mutex));
+    bool claimed = own->next < own->end;
+    if (claimed) *unit_out = own->next++;
+    pthread_mutex_unlock(&(own->mutex));
+    if (claimed) return true;
+    for (int v = 1; v < n_extract_workers; v++) {
+        UnitRange *victim = &(extract_ranges[(worker + v) % n_extract_workers]);
+        pthread_mutex_lock(&(victim->mutex));
+        uint32_t remaining = victim->end - victim->next;
+        uint32_t stolen = (remaining + 1) / 2;
+        victim->end -= stolen;
+        uint32_t start = victim->end;
+        pthread_mutex_unlock(&(victim->mutex));
+        if (stolen == 0) continue;
+        pthread_mutex_lock(&(own->mutex));
+        own->next = start + 1;
+        own->end = start + stolen;
+        pthread_mutex_unlock(&(own->mutex));
+        *unit_out = start;
+        return true;
+    }
+    return false;
+}
+
+/* Worker thread main loop: extract units of cells until none remain anywhere. */
+static void *extract_worker (void *arg) {
+    int worker = (intptr_t) arg;
+    uint32_t n_rows = extract_max_ybin - extract_min_ybin + 1;
+    uint32_t n_cells = (extract_max_xbin - extract_min_xbin + 1) * n_rows;
+    uint32_t unit;
+    while (claim_unit(worker, &unit)) {
+        uint32_t c1 = (unit + 1) * EXTRACT_UNIT_CELLS;
+        if (c1 > n_cells) c1 = n_cells;
+        for (uint32_t c = unit * EXTRACT_UNIT_CELLS; c < c1; c++) {
+            extract_cell (extract_stage, extract_min_xbin + c / n_rows, extract_min_ybin + c % n_rows,
+                          extract_writers[worker]);
+        }
+    }
+    /* Write out this worker's last partly filled block before the stage ends. */
+    pbf_writer_flush(extract_writers[worker]);
+    free_thread_buffers();
+    node_store_release_cache();
+    return NULL;
+}
+
+/* Run one stage of an extract to PBF on n worker threads, returning once all of them are done. */
+static void extract_stage_parallel (int stage, int n) {
+    uint32_t n_cells = (extract_max_xbin - extract_min_xbin + 1) * (extract_max_ybin - extract_min_ybin + 1);
+    uint32_t n_units = (n_cells + EXTRACT_UNIT_CELLS - 1) / EXTRACT_UNIT_CELLS;
+    pthread_t threads[n];
+    extract_stage = stage;
+    for (int t = 0; t < n; t++) {
+        extract_ranges[t].next = (uint64_t) n_units * t / n;
+        extract_ranges[t].end = (uint64_t) n_units * (t + 1) / n;
+    }
+    for (int t = 0; t < n; t++) {
+        if (pthread_create(&(threads[t]), NULL, &extract_worker, (void *)(intptr_t) t) != 0)
+            die("Could not start extract thread.");
+    }
+    for (int t = 0; t < n; t++) pthread_join(threads[t], NULL);
+}
+
+/*
+  Extract every element in the area between cmin and cmax, to PBF or else VEX output that has already
+  been begun, using n threads. With one thread, or for VEX output, the cells are visited in order on
+  the calling thread.
+*/
+static void extract (coord_t cmin, coord_t cmax, bool vexformat, int n) {
+    extract_min_xbin = grid_bin(cmin.x);
+    extract_max_xbin = grid_bin(cmax.x);
+    extract_min_ybin = grid_bin(cmin.y);
+    extract_max_ybin = grid_bin(cmax.y);
+    extract_query = bbox_empty;
+    bbox_add_coord(&extract_query, cmin);
+    bbox_add_coord(&extract_query, cmax);
+    if (vexformat || n < 1) n = 1;
+    n_extract_workers = n;
+    extract_ranges = malloc(n * sizeof(UnitRange));
+    extract_writers = malloc(n * sizeof(PbfWriter *));
+    if (extract_ranges == NULL || extract_writers == NULL) die("Could not allocate extract workers.");
+    for (int t = 0; t < n; t++) {
+        pthread_mutex_init(&(extract_ranges[t].mutex), NULL);
+        extract_writers[t] = vexformat ? NULL : pbf_writer_new();
+    }
+    if (n > 1) {
+        /* Workers read tags, so every tag subfile must be mapped before they start. */
+        map_tag_subfiles ();
+        fprintf(stderr, "Extracting on %d threads.\n", n);
+    }
+    /* Initialize the ID trackers so we can avoid outputting nodes and ways more than once. */
+    extract_nodes_seen = IDTracker_new ();
+    IDTracker_reserve (extract_nodes_seen, MAX_NODE_ID);
+    /* Make three passes, first outputting all nodes, then all ways, then all relations.
+    A way is indexed in every cell it touches, so each pass tracks the ways it has already seen. */
+    for (int stage = NODE; stage <= RELATION; stage++) {
+        extract_ways_seen = IDTracker_new ();
+        IDTracker_reserve (extract_ways_seen, MAX_WAY_ID);
+        if (n > 1) {
+            extract_stage_parallel (stage, n);
+        } else {
+            for (uint32_t x = extract_min_xbin; x <= extract_max_xbin; x++) {
+                for (uint32_t y = extract_min_ybin; y <= extract_max_ybin; y++) {
+                    extract_cell (stage, x, y, extract_writers[0]);
+                }
+            }
+            /* Write out any buffered nodes or ways before beginning the next PBF writing stage. */
+            if (!vexformat) pbf_writer_flush(extract_writers[0]);
+        }
+        IDTracker_free (extract_ways_seen);
+    }
+    IDTracker_free (extract_nodes_seen);
+    for (int t = 0; t < n; t++) {
+        pthread_mutex_destroy(&(extract_ranges[t].mutex));
+        if (extract_writers[t] != NULL) pbf_writer_free(extract_writers[t]);
+    }
+    free(extract_ranges);
+    free(extract_writers);
+}
+
 #define ACTION_NONE 0
 #define ACTION_LOAD 1
 #define ACTION_EXTRACT 2
+#define ACTION_APPLY 3
+#define ACTION_RESUME 4
 
 int main (int argc, const char * argv[]) {
 
     /* Decide whether we are loading or extracting based on the number of command line parameters. */
     int action = ACTION_NONE;
-    if (argc == 3) {
+    if (argc >= 4 && strcmp(argv[2], "apply") == 0) {
+        action = ACTION_APPLY;
+    } else if ((argc == 3 || argc == 4) && strcmp(argv[2], "resume") == 0) {
+        action = ACTION_RESUME;
+    } else if (argc == 3) {
         action = ACTION_LOAD;
     } else if (argc == 4) {
         action = ACTION_EXTRACT;
@@ -784,10 +2646,11 @@ int main (int argc, const char * argv[]) {
     }
     
     /* When creating an on-disk database, create the directory and complain loudly if it already exists.
-    We don't want to accidentally destroy two hours of PBF loading, and we don't want to re-open an 
-    existing database for writing (that's not supported yet and causes undefined behavior). */
+    We don't want to accidentally destroy two hours of PBF loading. An existing database is only
+    reopened for writing to resume its load or apply changes, guided by its manifest. */
     database_path = argv[1];
     in_memory = (strcmp(database_path, "memory") == 0);
+    read_only = (ACTION_EXTRACT == action);
     if (ACTION_LOAD == action && !in_memory) {
         int err = mkdir(database_path, 0777);
         if (err == -1) die ("Could not create database. Perhaps the directory already exists "
@@ -800,30 +2663,115 @@ int main (int argc, const char * argv[]) {
     if (lock_fd == -1) {
         die ("Error opening or creating lock file.");
     }
+    /* Take the lock before reading the manifest or mapping any file, so that no other process can
+    change the database between reading its description and using it. Extracts share the database,
+    loads and updates need it to themselves. */
+    if (ACTION_EXTRACT == action) {
+        fprintf(stderr, "Acquiring shared read lock on database.\n");
+        flock(lock_fd, LOCK_SH);
+    } else {
+        fprintf(stderr, "Acquiring exclusive write lock on database.\n");
+        flock(lock_fd, LOCK_EX);
+    }
+
+    /* A new database keeps node coordinates in the form requested and has the grid size requested,
+    an existing one has those recorded in its manifest. */
+    if (ACTION_LOAD == action) {
+        char *store = getenv("VEX_NODE_STORE");
+        if (store != NULL && strcmp(store, "blocks") == 0) node_store_blocks = true;
+        else if (store != NULL && strcmp(store, "flat") != 0) die ("VEX_NODE_STORE must be flat or blocks.");
+        char *bits = getenv("VEX_GRID_BITS");
+        if (bits != NULL) grid_bits = atoi(bits);
+        if (grid_bits < MIN_GRID_BITS || grid_bits > MAX_GRID_BITS)
+            die ("VEX_GRID_BITS must be between 8 and 16.");
+        grid_set_bits(grid_bits);
+    } else {
+        /* This also sets the grid size and the limits that follow from it. */
+        manifest_read();
+        node_store_blocks = manifest.node_store;
+    }
 
     /* Memory-map files or create shared memory objects for each OSM element type, 
-    and for references between them. */
-    grid        = map_file("grid",        0, sizeof(Grid));
+    and for references between them. Extracts only map the existing files, read-only. */
+    grid_tiles  = map_file("grid_tiles",  0, sizeof(uint32_t)  * MAX_TILE_DIR);
+    grid_cells  = map_file("grid",        0, sizeof(GridCell)  * TILE_CELLS * grid_max_tiles);
     ways        = map_file("ways",        0, sizeof(Way)       * MAX_WAY_ID);
-    nodes       = map_file("nodes",       0, sizeof(Node)      * MAX_NODE_ID);
-    node_refs   = map_file("node_refs",   0, sizeof(int64_t)   * MAX_NODE_REFS);
-    way_blocks  = map_file("way_blocks",  0, sizeof(WayBlock)  * MAX_WAY_BLOCKS);
+    int coords_fd = -1, node_tags_fd, node_refs_fd;
+    if (node_store_blocks) {
+        node_store_init (map_file("node_blocks", 0, sizeof(uint64_t) * MAX_NODE_BLOCKS), MAX_NODE_BLOCKS,
+                         map_file("node_block_data", 0, MAX_NODE_BLOCK_DATA), MAX_NODE_BLOCK_DATA);
+    } else {
+        coords  = map_file_fd("coords",   0, sizeof(coord_t)   * MAX_NODE_ID, &coords_fd);
+    }
+    node_tags   = map_file_fd("node_tags",0, sizeof(NodeTag)   * MAX_NODE_TAGS, &node_tags_fd);
+    node_tag_dir = map_file("node_tag_dir", 0, sizeof(uint32_t) * MAX_NODE_TAG_BLOCKS);
+    node_tag_overflow = map_file("node_tag_overflow", 0, sizeof(NodeTagOverflow) * MAX_NODE_TAG_OVERFLOW);
+    node_refs   = map_file_fd("node_refs",0, MAX_NODE_REF_BYTES, &node_refs_fd);
+    way_blocks  = map_file("way_blocks",  0, sizeof(WayBlock)  * grid_max_way_blocks);
     relations   = map_file("relations",   0, sizeof(Relation)  * MAX_REL_ID);
     rel_members = map_file("rel_members", 0, sizeof(RelMember) * MAX_REL_MEMBERS);
-
-    if (ACTION_LOAD == action) {
-
-        /* LOAD INTO DATABASE */
+    way_bboxes  = map_file("way_bboxes",  0, sizeof(BBox)      * MAX_WAY_ID);
+    relation_bboxes = map_file("relation_bboxes", 0, sizeof(BBox) * MAX_REL_ID);
+    rel_parents = map_file("rel_parents", 0, sizeof(RelParent) * MAX_REL_MEMBERS);
+    node_parent_dir = map_file("node_parent_dir", 0, sizeof(uint32_t) * MAX_NODE_PARENT_BLOCKS);
+    way_parent_dir = map_file("way_parent_dir", 0, sizeof(uint32_t) * MAX_WAY_PARENT_BLOCKS);
+    grid_ranges = map_file("grid_ranges", 0, sizeof(GridRange) * TILE_CELLS * grid_max_tiles);
+    grid_way_ids = map_file("grid_way_ids", 0, sizeof(int32_t) * MAX_INDEXED_WAYS);
+    grid_relation_ids = map_file("grid_relation_ids", 0, sizeof(uint32_t) * MAX_REL_ID);
+
+    if (ACTION_LOAD == action || ACTION_RESUME == action) {
+
+        /* LOAD INTO DATABASE, OR CONTINUE AN INTERRUPTED LOAD FROM ITS LAST CHECKPOINT */
         const char *filename = argv[2];
+        uint64_t offset = 0;
+        if (ACTION_RESUME == action) {
+            if (manifest.load_complete) die ("This database has already been loaded completely.");
+            filename = (argc == 4) ? argv[3] : manifest.load_input;
+            if (strcmp(filename, "-") == 0 && argc == 3) die ("The interrupted load read from stdin. "
+                "Pipe in the same input again and resume with - as the input file name.");
+            offset = manifest.load_resume_offset;
+        }
+        /* Remember the input by absolute path, so the load can be resumed from any directory. */
+        struct stat input_stat;
+        bool input_is_file = strcmp(filename, "-") != 0 && stat(filename, &input_stat) == 0;
+        if (ACTION_RESUME == action && input_is_file && manifest.load_input_size != 0
+            && manifest.load_input_size != input_stat.st_size)
+            die ("The input file is not the one the interrupted load was reading.");
+        set_dirty_budget();
+        char *env = getenv("VEX_CHECKPOINT_SECONDS");
+        if (env != NULL) checkpoint_seconds = atoi(env);
+        if (!node_store_blocks) drop_behind_init(&coords_behind, coords, coords_fd, true);
+        drop_behind_init(&node_tags_behind, node_tags, node_tags_fd, true);
+        drop_behind_init(&node_refs_behind, node_refs, node_refs_fd, true);
         PbfReadCallbacks callbacks = {
-            .way  = &handle_way,
-            .node = &handle_node,
-            .relation = &handle_relation
+            .way_batch  = &handle_way_batch,
+            .node_batch = &handle_node_batch,
+            .relation = &handle_relation,
+            .blob_done = &handle_blob_done
         };
-        /* Request an exclusive write lock, blocking while reads complete. */
-        fprintf(stderr, "Acquiring exclusive write lock on database.\n");
-        flock(lock_fd, LOCK_EX);
-        pbf_read (filename, &callbacks); // we could just pass the callbacks by value
+        if (ACTION_RESUME == action) {
+            manifest_restore();
+            rollback_to_checkpoint();
+            fprintf(stderr, "Resuming load of '%s' after %ld nodes, %ld ways and %ld relations.\n",
+                    filename, nodes_loaded, ways_loaded, rels_loaded);
+        } else {
+            if (!input_is_file) strcpy(manifest.load_input, "-");
+            else if (realpath(filename, manifest.load_input) == NULL) die ("Could not resolve input file path.");
+            manifest.load_input_size = input_is_file ? input_stat.st_size : 0;
+            checkpoint(0);
+        }
+        last_checkpoint = time(NULL);
+        start_node_workers (node_threads());
+        start_way_workers (way_threads());
+        pbf_read_threaded_from (filename, &callbacks, load_threads(), offset);
+        finish_nodes ();
+        finish_way_workers ();
+        compact_grid ();
+        sync_mapped_files();
+        manifest_capture();
+        manifest.load_complete = true;
+        manifest.grid_compacted = true;
+        manifest_write();
         fillFactor();
         /* Release exclusive write lock, allowing reads to begin. */
         flock(lock_fd, LOCK_UN);
@@ -831,6 +2779,38 @@ int main (int argc, const char * argv[]) {
                 nodes_loaded, ways_loaded, rels_loaded);
         return EXIT_SUCCESS;
         
+    } else if (ACTION_APPLY == action) {
+
+        /* APPLY CHANGE FILES TO DATABASE, IN THE ORDER GIVEN */
+        if (!manifest.load_complete) die ("This database was not loaded completely. Resume the load first.");
+        manifest_restore();
+        node_tags_open_overflow();
+        /* The chains are about to change, so the compacted index must not be used until rewritten.
+           Only if it was up to date before can the cells the changes touch be compacted on their own. */
+        bool was_compacted = manifest.grid_compacted;
+        manifest.grid_compacted = false;
+        manifest_write();
+        stale_relation_set = IDTracker_new ();
+        touched_cell_set = IDTracker_new ();
+        for (int f = 3; f < argc; f++) {
+            osc_read (argv[f], &apply_change);
+        }
+        if (node_store_blocks) node_store_flush ();
+        refresh_relation_bboxes ();
+        IDTracker_free (stale_relation_set);
+        IDTracker_free (touched_cell_set);
+        stale_relation_set = touched_cell_set = NULL;
+        if (was_compacted) compact_touched_cells ();
+        else compact_grid ();
+        sync_mapped_files();
+        manifest_capture();
+        manifest.grid_compacted = true;
+        manifest_write();
+        flock(lock_fd, LOCK_UN);
+        fprintf(stderr, "applied %ld creations, %ld modifications and %ld deletions.\n",
+                changes_applied[OSC_CREATE], changes_applied[OSC_MODIFY], changes_applied[OSC_DELETE]);
+        return EXIT_SUCCESS;
+
     } else if (ACTION_EXTRACT == action) {
     
         /* EXTRACT FROM DATABASE */
@@ -848,15 +2828,11 @@ int main (int argc, const char * argv[]) {
         coord_t cmin, cmax;
         to_coord(&cmin, min_lat, min_lon);
         to_coord(&cmax, max_lat, max_lon);
-        uint32_t min_xbin = bin(cmin.x);
-        uint32_t max_xbin = bin(cmax.x);
-        uint32_t min_ybin = bin(cmin.y);
-        uint32_t max_ybin = bin(cmax.y);
         bool vexformat = false;
 
-        /* Request a shared read lock, blocking while any writes to complete. */
-        fprintf(stderr, "Acquiring shared read lock on database.\n");
-        flock(lock_fd, LOCK_SH);
+        if (!manifest.load_complete) fprintf(stderr, "Warning: this database was not loaded completely.\n");
+        manifest_restore();
+        node_tags_open_overflow();
 
         /* Get the output stream, interpreting the dash character as stdout. */
         FILE *output_file;
@@ -876,82 +2852,13 @@ int main (int argc, const char * argv[]) {
         if (vexformat) {
             vexbin_write_init (output_file);
         } else {
+            set_output_compression ();
+            pbf_write_pipeline (compress_threads (), extract_threads ());
             pbf_write_begin (output_file);
         }
 
-        /* Initialize the ID tracker so we can avoid outputting nodes more than once. */
-        IDTracker_reset (); // TODO also track ways so we can store ways in more than one tile
-        
-        /* Make three passes, first outputting all nodes, then all ways, then all relations. */
-        for (int stage = NODE; stage <= RELATION; stage++) {
-            for (uint32_t x = min_xbin; x <= max_xbin; x++) {
-                for (uint32_t y = min_ybin; y <= max_ybin; y++) {
-                    if (stage == RELATION) {
-                        uint32_t relation_id = grid->cells[x][y].head_relation;
-                        while (relation_id > 0) {
-                            Relation rel = relations[relation_id];
-                            if (vexformat) {
-                                // TODO Output relations in VEX format
-                            } else {
-                                uint8_t *tags = tag_data_for_id (relation_id, RELATION);
-                                pbf_write_relation (relation_id, 
-                                    &(rel_members[rel.member_offset]), &(tags[rel.tags])
-                                );
-                            }
-                            /* Within a tile, relations are linked into a list. */
-                            relation_id = rel.next; 
-                        }
-                        /* All the remaining code in the y loop body relates only to WAY and NODE stages. */
-                        continue; 
-                    }
-                    /* The following code handles NODE and WAY stages if RELATION clause was not entered.
-                    Iterate over all ways in this block, then repeat for any chained blocks.
-                    If there are no ways in this grid cell, the head way block index will be zero. */
-                    // TODO factor this and the above relation output code out into functions
-                    uint32_t way_block_index = grid->cells[x][y].head_way_block;
-                    for (WayBlock *way_block = NULL; way_block_index > 0; way_block_index = way_block->next) {
-                        way_block = &(way_blocks[way_block_index]);
-                        for (int w = 0; w < WAY_BLOCK_SIZE; w++) {
-                            int64_t way_id = way_block->refs[w];
-                            /* Empty slots in the way block will be either negative or zero. */
-                            if (way_id <= 0) break;
-                            Way way = ways[way_id];
-                            if (stage == WAY) {
-                                if (vexformat) {
-                                    vexbin_write_way (way_id);
-                                } else {
-                                    uint8_t *tags = tag_data_for_id(way_id, WAY);
-                                    pbf_write_way(way_id, &(node_refs[way.node_ref_offset]), &(tags[way.tags]));
-                                }
-                            } else if (stage == NODE) {
-                                /* Output all nodes in this way. */
-                                uint32_t nr = way.node_ref_offset;
-                                for (bool more = true; more; nr++) {
-                                    int64_t node_id = node_refs[nr];
-                                    if (node_id < 0) {
-                                        node_id = -node_id;
-                                        more = false;
-                                    }
-                                    // print_node (node_id); // DEBUG
-                                    /* Mark this node, and skip outputting it if already seen. */
-                                    if (IDTracker_set (node_id)) continue;
-                                    if (vexformat) {
-                                        vexbin_write_node (node_id);
-                                    } else {
-                                        Node node = nodes[node_id];
-                                        uint8_t *tags = tag_data_for_id(node_id, NODE);
-                                        pbf_write_node(node_id, get_lat(&(node.coord)),
-                                            get_lon(&(node.coord)), &(tags[node.tags]));
-                                    }
-                                }
-                            }
-                        }
-                    }
-                }
-            }
-            /* Write out any buffered nodes or ways before beginning the next PBF writing stage. */
-            if (!vexformat) pbf_write_flush();
-        }
+        extract (cmin, cmax, vexformat, extract_threads());
+        if (!vexformat) pbf_write_end ();
         fclose(output_file);
         /* Release the shared lock, allowing writes to begin. */
         flock(lock_fd, LOCK_UN); 